@@ -52,6 +52,8 @@ int main(int argc, char *argv[]) {
   LeoErrorType rc;
 
   char filename[128];
+  char journal[128];
+  char journalName[160];
   int leoHandle;
   int switchHandle;
   int gpioHandle;
@@ -64,18 +66,20 @@ int main(int argc, char *argv[]) {
   int is_all = 0;
   int is_clean = 0;
   int is_force = 0;
+  int is_journal = 0;
   int leoId;
   uint8_t readSwitch;
   char *leoSbdf = NULL;
 
   LeoI2CDriverType *i2cDriver;
   LeoDeviceType *leoDevice;
+  LeoSpiFwImageType *fwImage;
   DefaultArgsType defaultArgs = {.leoAddress = LEO_DEV_LEO_0,
                                  .switchAddress = LEO_DEV_MUX,
                                  .switchMode = 0x03, // 0x03 for Leo 0
                                  .serialnum = NULL,
                                  .bdf = NULL};
-  enum { DEFAULT_ENUMS, ENUM_PROGRAM_e, ENUM_VERIFY_e, ENUM_CLEAN_e, ENUM_FORCE_e, ENUM_ALL_e, ENUM_EOL_e };
+  enum { DEFAULT_ENUMS, ENUM_PROGRAM_e, ENUM_VERIFY_e, ENUM_CLEAN_e, ENUM_FORCE_e, ENUM_ALL_e, ENUM_JOURNAL_e, ENUM_EOL_e };
 
   struct option long_options[] = {DEFAULT_OPTIONS,
                                   {"program", required_argument, 0, 0},
@@ -83,6 +87,7 @@ int main(int argc, char *argv[]) {
                                   {"clean", no_argument, 0, 0},
                                   {"force", no_argument, 0, 0},
                                   {"all", no_argument, 0, 0},
+                                  {"journal", required_argument, 0, 0},
                                   {0, 0, 0, 0}};
 
   const char *help_string[] = {
@@ -91,6 +96,7 @@ int main(int argc, char *argv[]) {
       "Overwrite persistent data (needed for downgrading FW version to below 0.6)",
       "Force programming, ignoring asic version compatibility check",
       "If board is Aurora 2, program both Leo devices",
+      "Keep a journal (one per device, suffixed with BDF or Leo id) to resume an interrupted update",
   };
 
   while (1) {
@@ -122,6 +128,10 @@ int main(int argc, char *argv[]) {
       case ENUM_ALL_e:
         is_all = 1;
         break;
+      case ENUM_JOURNAL_e:
+        is_journal = 1;
+        strcpy(journal, optarg);
+        break;
       default:
         ASTERA_ERROR("option_index = %d undecoded", option_index);
       } // switch (option_index)
@@ -155,6 +165,13 @@ int main(int argc, char *argv[]) {
     defaultArgs.switchMode = 0x03; // 0x03 for Leo 0
   }
 
+  // Parse the .mem file once, every device below is updated from it
+  rc = leo_spi_fw_image_load(filename, &fwImage);
+  if (0 != rc) {
+    ASTERA_ERROR("Failed to read FW image from file %s", filename);
+    exit(1);
+  }
+
   if (defaultArgs.bdf != NULL) {
     int ret = -1;
 
@@ -183,6 +200,10 @@ int main(int argc, char *argv[]) {
       leoDevice->i2cDriver = i2cDriver;
       leoDevice->ignorePersistentDataFlag = is_clean;
       leoDevice->ignoreCompatibilityCheckFlag = is_force;
+      if (is_journal) {
+        snprintf(journalName, sizeof(journalName), "%s.%s", journal, leoSbdf);
+        leoDevice->updateJournalFile = journalName;
+      }
 
       char cmd[128];
       strcpy(cmd, "sudo setpci -s ");
@@ -197,13 +218,13 @@ int main(int argc, char *argv[]) {
 
       if (is_program) {
         if (is_clean) {
-          rc = leoFwUpdateFromFile(leoDevice, filename);
+          rc = leoFwUpdateFromImage(leoDevice, fwImage);
         } else {
-          rc = leoFwUpdateTarget(leoDevice, filename, 0, 1);
+          rc = leoFwUpdateTargetFromImage(leoDevice, fwImage, 0, 1);
         }
       }
       else if (is_verify) {
-        leo_spi_verify_crc(leoDevice, filename);
+        leo_spi_verify_crc_image(leoDevice, fwImage);
       }
 
       free(leoDevice);
@@ -262,6 +283,10 @@ int main(int argc, char *argv[]) {
       }
       leoDevice->ignorePersistentDataFlag = is_clean;
       leoDevice->ignoreCompatibilityCheckFlag = is_force;
+      if (is_journal) {
+        snprintf(journalName, sizeof(journalName), "%s.leo%d", journal, leoId);
+        leoDevice->updateJournalFile = journalName;
+      }
 
       if (defaultArgs.serialnum == NULL) {
         leoHandle = asteraI2COpenConnection(i2cBus, i2cDriver->slaveAddr);
@@ -288,13 +313,13 @@ int main(int argc, char *argv[]) {
 
       if (is_program) {
         if (is_clean) {
-          rc = leoFwUpdateFromFile(leoDevice, filename);
+          rc = leoFwUpdateFromImage(leoDevice, fwImage);
         } else {
-          rc = leoFwUpdateTarget(leoDevice, filename, 0, 1);
+          rc = leoFwUpdateTargetFromImage(leoDevice, fwImage, 0, 1);
         }
       }
       else if (is_verify) {
-        rc += leo_spi_verify_crc(leoDevice, filename);
+        rc += leo_spi_verify_crc_image(leoDevice, fwImage);
       }
 
       asteraI2CCloseConnection(leoHandle);
@@ -307,4 +332,6 @@ int main(int argc, char *argv[]) {
       }
     }
   } // if (defaultArgs.bdf != NULL)
+
+  leo_spi_fw_image_free(fwImage);
 }
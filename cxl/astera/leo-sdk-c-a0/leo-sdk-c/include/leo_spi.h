@@ -115,6 +115,47 @@ typedef struct {
   LeoSpiDescriptionEntryType entries[3];
 } LeoSpiDescriptionBlockDataType;
 
+/*
+ * Parsed .mem firmware image. Created once by leo_spi_fw_image_load() and
+ * never modified afterwards, so one image can be shared between threads
+ * programming different devices.
+ */
+typedef struct {
+    uint8_t *buf;                // SPI_FLASH_SIZE bytes at flash addresses
+    uint32_t *dwords;            // buf as big-endian dwords, as written to flash
+    uint32_t mem_min;            // lowest address present in the .mem file
+    uint32_t mem_max;            // one past the highest address present
+} LeoSpiFwImageType;
+
+/*
+ * Update journal, used by leo_spi_update_target() to resume an interrupted
+ * update. The file holds one header followed by one record per erase or
+ * program unit completed. Units never straddle a 64KB erase block.
+ */
+#define LEO_SPI_JOURNAL_MAGIC (0x4c4a4e4c) // "LJNL"
+#define LEO_SPI_JOURNAL_VERSION (2)
+#define LEO_SPI_JOURNAL_UNIT_SIZE (0x10000)
+
+typedef enum {
+    LEO_SPI_JOURNAL_ERASE_e = 0x1,
+    LEO_SPI_JOURNAL_PROGRAM_e = 0x2
+} LEO_SPI_JOURNAL_RECORD_TYPE;
+
+typedef struct leo_spi_journal_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t target;
+    uint32_t num_units;
+    uint32_t plan_crc;           // crc32 over (addr, len, crc) of every unit
+} leo_spi_journal_header_t;
+
+typedef struct leo_spi_journal_record {
+    uint32_t type;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t crc;                // firmware CRC-32C of the data programmed into the unit
+} leo_spi_journal_record_t;
+
 enum {
   FLASH_BOOT_LOAD_STATUS_OK = 0,
   FLASH_BOOT_LOAD_READ_DW_STATUS_NO_CMD_ACTIVE = 0x0001,
@@ -449,6 +490,22 @@ void read_fw_version(LeoI2CDriverType *leoDriver, uint32_t *values);
 LeoErrorType flash_verify_block_crc(LeoI2CDriverType *leoDriver, uint32_t startAddr,
                            size_t lenDWords, uint32_t crc);
 
+/**
+ * @brief parse a .mem file into a newly allocated firmware image
+ *
+ * @param[in]  filename  filepath name
+ * @param[out] image     image to release with leo_spi_fw_image_free()
+ */
+LeoErrorType leo_spi_fw_image_load(const char *filename,
+                                   LeoSpiFwImageType **image);
+
+/**
+ * @brief release an image created by leo_spi_fw_image_load()
+ *
+ * @param[in] image  image to free, may be NULL
+ */
+void leo_spi_fw_image_free(LeoSpiFwImageType *image);
+
 /**
  * @brief program Leo SPI with the new flash memory
  *
@@ -459,14 +516,45 @@ LeoErrorType flash_verify_block_crc(LeoI2CDriverType *leoDriver, uint32_t startA
 LeoErrorType leo_spi_program_flash(LeoDeviceType *leoDevice,
                                    const char *filename);
 
+/**
+ * @brief program Leo SPI from an already loaded image
+ *
+ * @param[in] leoDevice  pointer to the device
+ * @param[in] image      firmware image, not modified
+ */
+LeoErrorType leo_spi_program_flash_image(LeoDeviceType *leoDevice,
+                                         const LeoSpiFwImageType *image);
+
 
-LeoErrorType leo_spi_update_target(LeoDeviceType *device, 
+/**
+ * @brief update the code and syscfg blocks of one target slot in Leo SPI.
+ * If leoDevice->updateJournalFile is set, completed erase and program units
+ * are journaled there and an interrupted update resumes from the first
+ * incomplete unit. The journal is removed once the update succeeds.
+ *
+ * @param[in] device    pointer to the device
+ * @param[in] filename  filepath name of the .mem image
+ * @param[in] target    TOC slot to update
+ * @param[in] verify    CRC verify the updated blocks when non-zero
+ */
+LeoErrorType leo_spi_update_target(LeoDeviceType *device,
                                    char *filename, 
                                    int target,
                                    int verify);
 
+/**
+ * @brief leo_spi_update_target() from an already loaded image
+ */
+LeoErrorType leo_spi_update_target_image(LeoDeviceType *device,
+                                         const LeoSpiFwImageType *image,
+                                         int target,
+                                         int verify);
+
 LeoErrorType leo_spi_verify_crc(LeoDeviceType *device, char *filename);
 
+LeoErrorType leo_spi_verify_crc_image(LeoDeviceType *device,
+                                      const LeoSpiFwImageType *image);
+
 LeoErrorType leoSpiCheckCompatibility(LeoDeviceType *device, uint8_t *fwBuf);
 
 #ifdef __cplusplus
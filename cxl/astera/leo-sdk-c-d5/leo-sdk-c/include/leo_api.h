@@ -247,6 +247,30 @@ LeoErrorType leoFwUpdateFromFile(LeoDeviceType *device, char *flashFileName);
  */
 LeoErrorType leoFwUpdateTarget(LeoDeviceType *device, char *flashFileName, int target, int verify);
 
+/**
+ * @brief Update FW from an image loaded with leo_spi_fw_image_load()
+ *
+ * @param[in]  device        Pointer to Leo Device struct object
+ * @param[in]  image         Firmware image, may be shared between devices
+ * @return     LeoErrorType - Leo error code
+ */
+LeoErrorType leoFwUpdateFromImage(LeoDeviceType *device,
+                                  const LeoSpiFwImageType *image);
+
+/**
+ * @brief Update one FW target slot from an image loaded with
+ * leo_spi_fw_image_load()
+ *
+ * @param[in]  device        Pointer to Leo Device struct object
+ * @param[in]  image         Firmware image, may be shared between devices
+ * @param[in]  target        0/1/2 Which slot to update (not implemented in 0.8)
+ * @param[in]  verify        Verify the flash contents after update
+ * @return     LeoErrorType - Leo error code
+ */
+LeoErrorType leoFwUpdateTargetFromImage(LeoDeviceType *device,
+                                        const LeoSpiFwImageType *image,
+                                        int target, int verify);
+
 /**
  * @brief Update FW from a .mem file
  *
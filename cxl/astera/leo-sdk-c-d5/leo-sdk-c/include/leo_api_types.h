@@ -394,6 +394,7 @@ typedef struct LeoDevice {
   uint8_t ignorePersistentDataFlag; /** Overwrite persistent data when updating firmware */
   uint8_t ignoreCompatibilityCheckFlag; /** Ignore asic version check when updating firmware */
   int spiDevice;
+  const char *updateJournalFile; /** Journal to resume an interrupted target update, NULL to disable */
 } LeoDeviceType;
 
 /**
@@ -129,6 +129,21 @@ LeoErrorType leoInitDevice(LeoDeviceType *device) {
 }
 
 LeoErrorType leoFwUpdateFromFile(LeoDeviceType *device, char *flashFileName) {
+  LeoSpiFwImageType *image;
+  LeoErrorType rc;
+
+  rc = leo_spi_fw_image_load(flashFileName, &image);
+  if (0 != rc) {
+    ASTERA_ERROR("Failed to read FW image from file %s", flashFileName);
+    return rc;
+  }
+  rc = leoFwUpdateFromImage(device, image);
+  leo_spi_fw_image_free(image);
+  return rc;
+}
+
+LeoErrorType leoFwUpdateFromImage(LeoDeviceType *device,
+                                  const LeoSpiFwImageType *image) {
   LeoErrorType rc;
   uint32_t jedecID;
   int spiDevice;
@@ -176,12 +191,28 @@ LeoErrorType leoFwUpdateFromFile(LeoDeviceType *device, char *flashFileName) {
   device->spiDevice = spiDevice;
 
   // Program and verify the flash
-  rc = leo_spi_program_flash(device, flashFileName);
+  rc = leo_spi_program_flash_image(device, image);
 
   return rc;
 }
 
 LeoErrorType leoFwUpdateTarget(LeoDeviceType *device, char *flashFileName, int target, int verify) {
+  LeoSpiFwImageType *image;
+  LeoErrorType rc;
+
+  rc = leo_spi_fw_image_load(flashFileName, &image);
+  if (0 != rc) {
+    ASTERA_ERROR("Failed to read FW image from file %s", flashFileName);
+    return rc;
+  }
+  rc = leoFwUpdateTargetFromImage(device, image, target, verify);
+  leo_spi_fw_image_free(image);
+  return rc;
+}
+
+LeoErrorType leoFwUpdateTargetFromImage(LeoDeviceType *device,
+                                        const LeoSpiFwImageType *image,
+                                        int target, int verify) {
 
   LeoErrorType rc;
   uint32_t jedecID;
@@ -210,7 +241,7 @@ LeoErrorType leoFwUpdateTarget(LeoDeviceType *device, char *flashFileName, int t
   device->spiDevice = spiDevice;
 
   // Program and verify the flash
-  rc = leo_spi_update_target(device, flashFileName, target, verify);
+  rc = leo_spi_update_target_image(device, image, target, verify);
   return rc;
 }
 
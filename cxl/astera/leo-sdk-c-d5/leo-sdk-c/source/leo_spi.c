@@ -727,11 +727,6 @@ LeoErrorType flash_verify_block_crc(LeoI2CDriverType *leoDriver, uint32_t startA
   return LEO_SUCCESS;
 }
 
-static uint32_t leo_flash_mem_min = 0xfffffff;
-static uint32_t leo_flash_mem_max = 0x0000000;
-static unsigned char leo_flash_fw_buffer[SPI_FLASH_SIZE]; // 8MB
-static int flash_mem_done_reading = 0;
-
 static int buf_eq(const uint8_t a[], const uint8_t b[], size_t n) {
   size_t i;
   for (i = 0; i < n; i++) {
@@ -741,10 +736,10 @@ static int buf_eq(const uint8_t a[], const uint8_t b[], size_t n) {
   return 1;
 }
 
-static int decode_mem_line(char *line) {
+static int decode_mem_line(LeoSpiFwImageType *image, char *line) {
   char *token, *str1, *saveptr;
   int jj;
-  unsigned int address;
+  unsigned int address = 0;
   unsigned int value = 0;
   for (jj = 0, str1 = line;; jj++, str1 = NULL) {
     token = strtok_r(str1, " ", &saveptr);
@@ -752,40 +747,59 @@ static int decode_mem_line(char *line) {
       break;
     if (0 == jj) {
       address = strtoul((token + 1), NULL, 16);
-      if (address < leo_flash_mem_min)
-        leo_flash_mem_min = address;
+      if (address < image->mem_min)
+        image->mem_min = address;
     } else {
+      if (address >= SPI_FLASH_SIZE) {
+        return (1);
+      }
       value = strtoul(token, NULL, 16);
-      leo_flash_fw_buffer[address] = (unsigned char)value;
+      image->buf[address] = (unsigned char)value;
       address++;
     }
   } // for (jj=0, str1 = line; ; jj++, str1 = NULL)
-  if (address > leo_flash_mem_max)
-    leo_flash_mem_max = address;
+  if (address > image->mem_max)
+    image->mem_max = address;
   return (0);
 } // int decode_mem_line()
 
-static LeoErrorType readFWImageFromFile(const char *filename) {
-  int rc;
+LeoErrorType leo_spi_fw_image_load(const char *filename,
+                                   LeoSpiFwImageType **image) {
+  int rc = 0;
   FILE *fp;
   int num_errors = 0;
   char line[128];
-  int count;
-  if (0 != flash_mem_done_reading) {
-    return 0;
-  }
+  int count = 0;
+  uint32_t ii;
+  LeoSpiFwImageType *img;
 
+  *image = NULL;
   fp = fopen(filename, "r");
   if (NULL == fp) {
     ASTERA_ERROR("Couldn't open file %s", filename);
     return (1);
   }
-  memset(leo_flash_fw_buffer, 0xff, (8 * 1024 * 1024));
+
+  img = (LeoSpiFwImageType *)calloc(1, sizeof(LeoSpiFwImageType));
+  if (NULL != img) {
+    img->buf = (uint8_t *)malloc(SPI_FLASH_SIZE);
+    img->dwords = (uint32_t *)malloc(SPI_FLASH_SIZE);
+  }
+  if (NULL == img || NULL == img->buf || NULL == img->dwords) {
+    ASTERA_ERROR("%s %s %d: malloc failed", __FILE__, __FUNCTION__, __LINE__);
+    leo_spi_fw_image_free(img);
+    fclose(fp);
+    return (1);
+  }
+  img->mem_min = 0xfffffff;
+  img->mem_max = 0x0000000;
+  memset(img->buf, 0xff, SPI_FLASH_SIZE);
   while (1) {
     if (feof(fp))
       break;
-    rc = fscanf(fp, "%[^\n]\n", line);
-    rc = decode_mem_line(line);
+    if (1 != fscanf(fp, "%127[^\n]\n", line))
+      break;
+    rc = decode_mem_line(img, line);
     if (0 != rc) {
       ASTERA_ERROR("decode_line failed");
       num_errors++;
@@ -796,22 +810,37 @@ static LeoErrorType readFWImageFromFile(const char *filename) {
   fclose(fp);
   if (0 != num_errors) {
     ASTERA_WARN("WARNING(ERROR): decode_line failed");
+    leo_spi_fw_image_free(img);
     return (1);
   }
   ASTERA_INFO("**INFO : Counted %d lines, address ranges from  %08x to %08x",
-              count, leo_flash_mem_min, leo_flash_mem_max);
-  flash_mem_done_reading = 1;
-  return rc;
+              count, img->mem_min, img->mem_max);
+
+  // Flash is written in big-endian dwords, swap the whole image once here
+  for (ii = 0; ii < SPI_FLASH_SIZE; ii += 4) {
+    img->dwords[ii >> 2] = img->buf[ii] << 24 | img->buf[ii + 1] << 16 |
+                           img->buf[ii + 2] << 8 | img->buf[ii + 3];
+  }
+
+  *image = img;
+  return LEO_SUCCESS;
 }
 
-static int leo_verify_flash_crc(LeoI2CDriverType *leoDriver,
-                                const char *filename) {
-  readFWImageFromFile(filename);
+void leo_spi_fw_image_free(LeoSpiFwImageType *image) {
+  if (NULL == image) {
+    return;
+  }
+  free(image->buf);
+  free(image->dwords);
+  free(image);
+}
 
+static int leo_verify_flash_crc(LeoI2CDriverType *leoDriver,
+                                const LeoSpiFwImageType *image) {
   const uint8_t startPat[] = {0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5};
   const uint8_t endPat[] = {0xaa, 0x55, 0xaa, 0x55, 0xaa, 0x55, 0xaa, 0x55};
-  size_t imageLen =
-      sizeof(leo_flash_fw_buffer) / sizeof(leo_flash_fw_buffer[0]);
+  const uint8_t *fw_buffer = image->buf;
+  size_t imageLen = SPI_FLASH_SIZE;
   int foundStart = 0;
   uint32_t lenDWords = 0;
   uint32_t startAddr = 0;
@@ -821,9 +850,9 @@ static int leo_verify_flash_crc(LeoI2CDriverType *leoDriver,
   size_t i;
   for (i = 0; i < imageLen - 8; i++) {
     if (!foundStart) {
-      foundStart = buf_eq(startPat, (uint8_t *)&leo_flash_fw_buffer[i], 8);
+      foundStart = buf_eq(startPat, &fw_buffer[i], 8);
       if (foundStart) {
-        blockType = leo_flash_fw_buffer[i + 11];
+        blockType = fw_buffer[i + 11];
         if (blockType == 0x6) {
           foundStart = 0;
           continue;
@@ -833,12 +862,12 @@ static int leo_verify_flash_crc(LeoI2CDriverType *leoDriver,
       }
       continue;
     }
-    if (!buf_eq(endPat, (uint8_t *)&leo_flash_fw_buffer[i], 8)) {
+    if (!buf_eq(endPat, &fw_buffer[i], 8)) {
       // TODO: Can probably increment i by 3 extra bytes
       continue;
     }
-    crc = leo_flash_fw_buffer[i - 4] << 24 | leo_flash_fw_buffer[i - 3] << 16 |
-          leo_flash_fw_buffer[i - 2] << 8 | leo_flash_fw_buffer[i - 1];
+    crc = fw_buffer[i - 4] << 24 | fw_buffer[i - 3] << 16 |
+          fw_buffer[i - 2] << 8 | fw_buffer[i - 1];
 
     lenDWords = (i + 8 - startAddr) / 4;
     if (LEO_SUCCESS != flash_verify_block_crc(leoDriver, startAddr, lenDWords, crc)) {
@@ -851,17 +880,17 @@ static int leo_verify_flash_crc(LeoI2CDriverType *leoDriver,
   return 0;
 }
 
-static int leo_verify_flash(LeoI2CDriverType *leoDriver) {
+static int leo_verify_flash(LeoI2CDriverType *leoDriver,
+                            const LeoSpiFwImageType *image) {
 #define ONE_KB (1024)
 #define MAX_ERRORS 10
   uint32_t *read_buffer;
-  uint32_t addr = leo_flash_mem_min;
+  uint32_t addr = image->mem_min;
   uint32_t length = ONE_KB;
   uint32_t num_errors = 0;
   uint32_t i;
-  int rc;
 
-  ASTERA_DEBUG("Reading back FW image from flash, to %x", leo_flash_mem_max);
+  ASTERA_DEBUG("Reading back FW image from flash, to %x", image->mem_max);
   read_buffer = (uint32_t *)malloc(8 * 1024 * 1024);
 
   if (NULL == read_buffer) {
@@ -869,7 +898,7 @@ static int leo_verify_flash(LeoI2CDriverType *leoDriver) {
     return (1);
   }
 
-  for (addr = leo_flash_mem_min; addr < leo_flash_mem_max;
+  for (addr = image->mem_min; addr < image->mem_max;
        addr = addr + ONE_KB) {
     printf("reading flash at [%06x] \r", addr);
     fflush(stdout);
@@ -877,16 +906,13 @@ static int leo_verify_flash(LeoI2CDriverType *leoDriver) {
   }
   printf("\n");
 
-  ASTERA_DEBUG("Verifying content (%06x-%06x)", leo_flash_mem_min,
-               leo_flash_mem_max);
+  ASTERA_DEBUG("Verifying content (%06x-%06x)", image->mem_min,
+               image->mem_max);
   uint32_t fw_buf_dword;
   uint32_t rd_buf_dword;
-  uint32_t rx_idx = leo_flash_mem_min >> 2;
-  for (i = leo_flash_mem_min; i < leo_flash_mem_max; i = i + 4) {
-    fw_buf_dword = ((leo_flash_fw_buffer[i] & 0xff) << 24) |
-                   ((leo_flash_fw_buffer[i + 1] & 0xff) << 16) |
-                   ((leo_flash_fw_buffer[i + 2] & 0xff) << 8) |
-                   ((leo_flash_fw_buffer[i + 3] & 0xff));
+  uint32_t rx_idx = image->mem_min >> 2;
+  for (i = image->mem_min; i < image->mem_max; i = i + 4) {
+    fw_buf_dword = image->dwords[i >> 2];
     rd_buf_dword = read_buffer[rx_idx];
     if (fw_buf_dword != rd_buf_dword) {
       ASTERA_ERROR("Mismatch at %06x.  Read %08x, expected %08x", i,
@@ -905,39 +931,44 @@ static int leo_verify_flash(LeoI2CDriverType *leoDriver) {
 
 LeoErrorType leo_spi_program_flash(LeoDeviceType *leoDevice,
                                    const char *filename) {
+  LeoSpiFwImageType *image;
+  LeoErrorType rc;
+
+  ASTERA_INFO("Reading FW flash image file %s", filename);
+  rc = leo_spi_fw_image_load(filename, &image);
+  if (rc != 0) {
+    printf("Failed to read FW image from file %s", filename);
+    return rc;
+  }
+  rc = leo_spi_program_flash_image(leoDevice, image);
+  leo_spi_fw_image_free(image);
+  return rc;
+}
+
+LeoErrorType leo_spi_program_flash_image(LeoDeviceType *leoDevice,
+                                         const LeoSpiFwImageType *image) {
   LeoI2CDriverType *leoDriver = leoDevice->i2cDriver;
   int rc;
-  FILE *fp;
-  uint32_t count = 0;
   uint32_t i;
-  uint32_t j;
   uint32_t addr;
-  uint32_t tx_idx = 0;
-  uint32_t *read_buffer;
   uint32_t *write_buffer;
+  uint32_t persistent_len = 0;
+  uint32_t block_len;
   uint32_t dt;
   uint32_t num_errors = 0;
-  char line[132];
   char now_string[32];
   block_info_t persistent_data_block_info_flash;
-  block_info_t persistent_data_block_info_mem;
-  uint32_t *persistent_data_block_buf;
+  block_info_t persistent_data_block_info_mem = {0};
+  uint32_t *persistent_data_block_buf = NULL;
   struct timeval tv_start;
-  struct timeval tv_mark;
   struct timeval tv_now;
 
   gettimeofday(&tv_start, NULL);
   strcpy(now_string, ctime(&(tv_start.tv_sec)));
   now_string[24] = '\0';
-  ASTERA_INFO("Reading FW flash image file %s (%s)", filename, now_string);
+  ASTERA_INFO("Programming FW flash image (%s)", now_string);
 
-  rc = readFWImageFromFile(filename);
-  if (rc != 0) {
-    printf("Failed to read FW image from file %s", filename);
-    return rc;
-  }
-
-  rc = leoSpiCheckCompatibility(leoDevice, leo_flash_fw_buffer);
+  rc = leoSpiCheckCompatibility(leoDevice, image->buf);
   if (0 != rc) {
     return rc;
   }
@@ -953,7 +984,7 @@ LeoErrorType leo_spi_program_flash(LeoDeviceType *leoDevice,
       }
       rc += get_block_info(leoDevice->i2cDriver, persistent_data_block_info_flash.start_addr, &persistent_data_block_info_flash, NULL);
     }
-    rc = find_block_by_type(leoDevice->i2cDriver, BT_PERSISTENT_DATA_e, &persistent_data_block_info_mem, leo_flash_fw_buffer);
+    rc = find_block_by_type(leoDevice->i2cDriver, BT_PERSISTENT_DATA_e, &persistent_data_block_info_mem, image->buf);
     persistent_data_block_buf = (uint32_t *)malloc(persistent_data_block_info_flash.length);
 
     ASTERA_INFO("Reading persistent data block from flash");
@@ -963,15 +994,7 @@ LeoErrorType leo_spi_program_flash(LeoDeviceType *leoDevice,
       free(persistent_data_block_buf);
       return rc;
     }
-
-    for (i = 0; i < persistent_data_block_info_flash.length; i+=4) {
-      addr = persistent_data_block_info_mem.start_addr + LEO_SPI_FLASH_HEADER_BYTE_CNT + i;
-      leo_flash_fw_buffer[addr + 0] = (persistent_data_block_buf[i >> 2] >> 24) & 0xff;
-      leo_flash_fw_buffer[addr + 1] = (persistent_data_block_buf[i >> 2] >> 16) & 0xff;
-      leo_flash_fw_buffer[addr + 2] = (persistent_data_block_buf[i >> 2] >>  8) & 0xff;
-      leo_flash_fw_buffer[addr + 3] = (persistent_data_block_buf[i >> 2] >>  0) & 0xff;
-    }
-    free(persistent_data_block_buf);
+    persistent_len = persistent_data_block_info_flash.length;
   }
 
   // Disable write block protect
@@ -984,32 +1007,38 @@ LeoErrorType leo_spi_program_flash(LeoDeviceType *leoDevice,
 
   // Program only the blocks, nothing in between
   block_info_t curr_block_info_mem;
-  rc = find_next_block(leoDevice->i2cDriver, 0, 0, &addr, leo_flash_fw_buffer);
+  rc = find_next_block(leoDevice->i2cDriver, 0, 0, &addr, image->buf);
   if (rc != 0) {
     ASTERA_ERROR("Failed to find first block");
+    free(persistent_data_block_buf);
     return rc;
   }
 
   while (rc == 0) {
-    rc += get_block_info(leoDevice->i2cDriver, addr, &curr_block_info_mem, leo_flash_fw_buffer);
+    rc += get_block_info(leoDevice->i2cDriver, addr, &curr_block_info_mem, image->buf);
     if (rc != 0) {
       ASTERA_ERROR("Failed to get block info for block at 0x%06x", addr);
       break;
     }
 
-    write_buffer = (uint32_t *)malloc(curr_block_info_mem.end_addr - curr_block_info_mem.start_addr);
-    tx_idx = 0;
-    for (i = curr_block_info_mem.start_addr; i < curr_block_info_mem.end_addr; i+=4) {
-      write_buffer[tx_idx] = (leo_flash_fw_buffer[i + 0] << 24) |
-                             (leo_flash_fw_buffer[i + 1] << 16) |
-                             (leo_flash_fw_buffer[i + 2] <<  8) |
-                             (leo_flash_fw_buffer[i + 3] <<  0);
-      tx_idx++;
+    // The image is shared read-only, so persistent data is spliced into
+    // a private copy of its block rather than into the image itself
+    block_len = curr_block_info_mem.end_addr - curr_block_info_mem.start_addr;
+    write_buffer = &image->dwords[curr_block_info_mem.start_addr >> 2];
+    if (NULL != persistent_data_block_buf &&
+        curr_block_info_mem.start_addr == persistent_data_block_info_mem.start_addr) {
+      write_buffer = (uint32_t *)malloc(block_len);
+      memcpy(write_buffer, &image->dwords[curr_block_info_mem.start_addr >> 2], block_len);
+      for (i = 0; i < persistent_len && (LEO_SPI_FLASH_HEADER_BYTE_CNT + i) < block_len; i+=4) {
+        write_buffer[(LEO_SPI_FLASH_HEADER_BYTE_CNT + i) >> 2] = persistent_data_block_buf[i >> 2];
+      }
     }
 
     ASTERA_INFO("Writing block at 0x%06x", addr);
-    rc += flash_write(leoDevice->i2cDriver, curr_block_info_mem.start_addr, (curr_block_info_mem.end_addr - curr_block_info_mem.start_addr) >> 2, write_buffer);
-    free(write_buffer);
+    rc += flash_write(leoDevice->i2cDriver, curr_block_info_mem.start_addr, block_len >> 2, write_buffer);
+    if (write_buffer != &image->dwords[curr_block_info_mem.start_addr >> 2]) {
+      free(write_buffer);
+    }
     if (rc != 0) {
       ASTERA_ERROR("Failed to write block at 0x%06x", addr);
       break;
@@ -1018,8 +1047,9 @@ LeoErrorType leo_spi_program_flash(LeoDeviceType *leoDevice,
     if (BT_END_e == curr_block_info_mem.type) {
       break;
     }
-    rc += find_next_block(leoDevice->i2cDriver, addr, 1, &addr, leo_flash_fw_buffer);
+    rc += find_next_block(leoDevice->i2cDriver, addr, 1, &addr, image->buf);
   }
+  free(persistent_data_block_buf);
 
   // Enable write block protect
   leo_spi_flash_write_block_protect(leoDevice->i2cDriver, leoDevice->spiDevice, 1);
@@ -1032,7 +1062,7 @@ LeoErrorType leo_spi_program_flash(LeoDeviceType *leoDevice,
   ASTERA_INFO("SPI image update done %s", now_string);
 
   // Verify image
-  num_errors += leo_verify_flash_crc(leoDriver, filename);
+  num_errors += leo_verify_flash_crc(leoDriver, image);
 
   gettimeofday(&tv_now, NULL);
   dt = tv_now.tv_sec - tv_start.tv_sec;
@@ -1463,9 +1493,220 @@ LeoErrorType leoSpiCheckCompatibility(LeoDeviceType *device, uint8_t *fwBuf)
   return LEO_SUCCESS;
 }
 
+/*
+ * One erase/program unit of a target update. Units are cut at 64KB
+ * boundaries so that re-erasing one never touches data of another.
+ */
+typedef struct {
+    uint32_t addr;
+    uint32_t len;
+    uint32_t *data;
+    uint32_t crc;
+    int erased;
+    int programmed;
+} leo_spi_update_unit_t;
+
+#define LEO_SPI_UPDATE_MAX_UNITS ((SPI_FLASH_SIZE / LEO_SPI_JOURNAL_UNIT_SIZE) + 2)
+
+static uint32_t leo_spi_crc32(uint32_t crc, const uint8_t *buf, size_t len) {
+    // Nibble table keeps this reentrant without a lazily built 1KB table
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    size_t ii;
+
+    crc = ~crc;
+    for (ii = 0; ii < len; ii++) {
+        crc ^= buf[ii];
+        crc = table[crc & 0xf] ^ (crc >> 4);
+        crc = table[crc & 0xf] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+/*********************************************************************
+ * CRC the firmware's FW_CRC_VERIFY mailbox command checks: CRC-32C,
+ * init 0 and no final XOR, fed each dword low byte first, like
+ * calc_crc32() in scripts/sysconfig/sysconfig_manager.py.
+ ********************************************************************/
+static uint32_t leo_spi_fw_crc32c(const uint32_t *dwords, size_t len_dwords) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1,
+        0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+        0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9,
+        0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75
+    };
+    uint32_t crc = 0;
+    size_t ii;
+    int jj;
+
+    for (ii = 0; ii < len_dwords; ii++) {
+        for (jj = 0; jj < 32; jj += 8) {
+            crc ^= (dwords[ii] >> jj) & 0xff;
+            crc = table[crc & 0xf] ^ (crc >> 4);
+            crc = table[crc & 0xf] ^ (crc >> 4);
+        }
+    }
+    return crc;
+}
+
+/*********************************************************************
+ * Split [start, end) of flash into 64KB aligned units sourced from
+ * src (dword image data for start). Returns the number of units added.
+ ********************************************************************/
+static int leo_spi_add_update_units(
+    leo_spi_update_unit_t *units,
+    int num_units,
+    uint32_t start,
+    uint32_t end,
+    uint32_t *src
+    ) {
+    uint32_t addr = start;
+    uint32_t unit_end;
+    int count = 0;
+
+    while (addr < end && (num_units + count) < LEO_SPI_UPDATE_MAX_UNITS) {
+        unit_end = (addr + LEO_SPI_JOURNAL_UNIT_SIZE) & ~(LEO_SPI_JOURNAL_UNIT_SIZE - 1);
+        if (unit_end > end) {
+            unit_end = end;
+        }
+        units[num_units + count].addr = addr;
+        units[num_units + count].len = unit_end - addr;
+        units[num_units + count].data = &src[(addr - start) >> 2];
+        units[num_units + count].crc = leo_spi_fw_crc32c(units[num_units + count].data, (unit_end - addr) >> 2);
+        units[num_units + count].erased = 0;
+        units[num_units + count].programmed = 0;
+        addr = unit_end;
+        count++;
+    }
+    return count;
+}
+
+static void leo_spi_journal_append(FILE *fp, uint32_t type, leo_spi_update_unit_t *unit) {
+    leo_spi_journal_record_t rec;
+
+    if (NULL == fp) {
+        return;
+    }
+    rec.type = type;
+    rec.addr = unit->addr;
+    rec.len = unit->len;
+    rec.crc = unit->crc;
+    if (1 != fwrite(&rec, sizeof(rec), 1, fp) || 0 != fflush(fp) ||
+        0 != fsync(fileno(fp))) {
+        ASTERA_WARN("Failed to write update journal record for 0x%06x", unit->addr);
+    }
+}
+
+/*********************************************************************
+ * Open the update journal. If it was written for the same update plan,
+ * mark the units it records as done; otherwise start a fresh journal.
+ ********************************************************************/
+static FILE *leo_spi_journal_open(
+    const char *filename,
+    leo_spi_journal_header_t *header,
+    leo_spi_update_unit_t *units,
+    int num_units
+    ) {
+    leo_spi_journal_header_t old_header;
+    leo_spi_journal_record_t rec;
+    FILE *fp;
+    int ii;
+    int num_done = 0;
+
+    fp = fopen(filename, "r+b");
+    if (NULL != fp) {
+        if (1 == fread(&old_header, sizeof(old_header), 1, fp) &&
+            0 == memcmp(&old_header, header, sizeof(old_header))) {
+            while (1 == fread(&rec, sizeof(rec), 1, fp)) {
+                for (ii = 0; ii < num_units; ii++) {
+                    if (units[ii].addr != rec.addr || units[ii].len != rec.len) {
+                        continue;
+                    }
+                    if (LEO_SPI_JOURNAL_ERASE_e == rec.type) {
+                        // A later erase wipes what an earlier record programmed
+                        if (0 != units[ii].programmed) {
+                            units[ii].programmed = 0;
+                            num_done--;
+                        }
+                        units[ii].erased = 1;
+                    } else if (LEO_SPI_JOURNAL_PROGRAM_e == rec.type && units[ii].crc == rec.crc) {
+                        units[ii].programmed = 1;
+                        num_done++;
+                    }
+                    break;
+                }
+            }
+            // Drop a partially written trailing record
+            fseek(fp, sizeof(old_header) + ((ftell(fp) - sizeof(old_header)) / sizeof(rec)) * sizeof(rec), SEEK_SET);
+            ASTERA_INFO("Resuming update from journal %s, %d of %d units already programmed",
+                        filename, num_done, num_units);
+            return fp;
+        }
+        fclose(fp);
+        ASTERA_INFO("Journal %s is for a different update, starting over", filename);
+    }
+
+    fp = fopen(filename, "wb");
+    if (NULL == fp) {
+        ASTERA_WARN("Couldn't open update journal %s, update will not be resumable", filename);
+        return NULL;
+    }
+    if (1 != fwrite(header, sizeof(*header), 1, fp) || 0 != fflush(fp) ||
+        0 != fsync(fileno(fp))) {
+        ASTERA_WARN("Failed to write update journal header to %s", filename);
+    }
+    return fp;
+}
+
+/*********************************************************************
+ * Re-check units the journal says are programmed with the on-device
+ * CRC check, nothing is read back over I2C. A unit that fails the
+ * check is erased and programmed again.
+ ********************************************************************/
+static void leo_spi_journal_verify_units(
+    LeoI2CDriverType *leoDriver,
+    leo_spi_update_unit_t *units,
+    int num_units
+    ) {
+    int ii;
+
+    for (ii = 0; ii < num_units; ii++) {
+        if (0 == units[ii].programmed) {
+            continue;
+        }
+        if (LEO_SUCCESS != flash_verify_block_crc(leoDriver, units[ii].addr, units[ii].len >> 2, units[ii].crc)) {
+            ASTERA_WARN("Journaled unit at 0x%06x failed CRC check, re-programming", units[ii].addr);
+            units[ii].erased = 0;
+            units[ii].programmed = 0;
+        }
+    }
+}
+
 /*********************************************************************
  ********************************************************************/
 LeoErrorType leo_spi_update_target(LeoDeviceType *device, char *filename, int target, int verify) {
+    LeoSpiFwImageType *image;
+    LeoErrorType rc;
+
+    rc = leo_spi_fw_image_load(filename, &image);
+    if (rc != 0) {
+      printf("Failed to read FW image from file %s", filename);
+      return rc;
+    }
+    rc = leo_spi_update_target_image(device, image, target, verify);
+    leo_spi_fw_image_free(image);
+    return rc;
+}
+
+/*********************************************************************
+ ********************************************************************/
+LeoErrorType leo_spi_update_target_image(LeoDeviceType *device,
+                                         const LeoSpiFwImageType *image,
+                                         int target, int verify) {
     LeoErrorType rc = 0;
     int  count      = 0;
     int  num_errors = 0;
@@ -1497,8 +1738,13 @@ LeoErrorType leo_spi_update_target(LeoDeviceType *device, char *filename, int ta
     uint32_t *block_data_flash;
     toc_data_t *toc_data_mem;
     toc_data_t *toc_data_flash;
-    uint32_t *fw_flash_buffer_dwords;
     uint32_t check_flash_empty_buffer[2];
+    leo_spi_update_unit_t units[LEO_SPI_UPDATE_MAX_UNITS];
+    leo_spi_journal_header_t journal_header;
+    FILE *journal_fp = NULL;
+    int num_units;
+    int first_unit;
+    int jj;
 
     gettimeofday(&tv_start, NULL);
     strcpy(now_string, ctime(&(tv_start.tv_sec)));
@@ -1509,17 +1755,11 @@ LeoErrorType leo_spi_update_target(LeoDeviceType *device, char *filename, int ta
         0x5aa55aa5 != check_flash_empty_buffer[1]) {
       ASTERA_ERROR("Flash is corrupted, performing clean update rc %d [%x, %x]", rc, check_flash_empty_buffer[0], check_flash_empty_buffer[1]);
       device->ignorePersistentDataFlag = 1;
-      rc = leo_spi_program_flash(device, filename);
-      return rc;
-    }
-
-    rc += readFWImageFromFile(filename);
-    if (rc != 0) {
-      printf("Failed to read FW image from file %s", filename);
+      rc = leo_spi_program_flash_image(device, image);
       return rc;
     }
 
-    rc = leoSpiCheckCompatibility(device, leo_flash_fw_buffer);
+    rc = leoSpiCheckCompatibility(device, image->buf);
     if (0 != rc) {
       return rc;
     }
@@ -1527,7 +1767,7 @@ LeoErrorType leo_spi_update_target(LeoDeviceType *device, char *filename, int ta
     //
     // Find TOC in flash and .mem file
     //
-    rc = find_block_by_type(device->i2cDriver, BT_TOC_e, &toc_block_info_mem, leo_flash_fw_buffer);
+    rc = find_block_by_type(device->i2cDriver, BT_TOC_e, &toc_block_info_mem, image->buf);
     if (0 != rc) {
         ASTERA_ERROR("Failed to find TOC block in .mem");
         return rc;
@@ -1543,7 +1783,7 @@ LeoErrorType leo_spi_update_target(LeoDeviceType *device, char *filename, int ta
         if (1 == toc_block_info_mem.config_data[0]) {
           ASTERA_INFO("Upgrading to 0.8+ from <0.8, this might take a while (up to 5x longer than normal)");
         }
-        rc = leo_spi_program_flash(device, filename);
+        rc = leo_spi_program_flash_image(device, image);
         return rc;
     }
     if (1 != toc_block_info_mem.config_data[0] || 0 != toc_block_info_mem.config_data[1]) {
@@ -1560,7 +1800,7 @@ LeoErrorType leo_spi_update_target(LeoDeviceType *device, char *filename, int ta
     // Use TOC to find code and syscfg blocks in flash and .mem file
     //
     block_data_mem = (uint32_t *)malloc(toc_block_info_mem.length);
-    rc += read_block_data(device->i2cDriver, toc_block_info_mem, block_data_mem, leo_flash_fw_buffer);
+    rc += read_block_data(device->i2cDriver, toc_block_info_mem, block_data_mem, image->buf);
     toc_data_mem = (toc_data_t *) block_data_mem;
     if (0 != rc) {
         ASTERA_ERROR("Failed to read TOC block in .mem");
@@ -1579,8 +1819,8 @@ LeoErrorType leo_spi_update_target(LeoDeviceType *device, char *filename, int ta
         return rc;
     }
 
-    rc += get_block_info(device->i2cDriver, toc_data_mem->syscfg_data[target].addr_pointer, &syscfg_block_info_mem, leo_flash_fw_buffer);
-    rc += get_block_info(device->i2cDriver, toc_data_mem->code_data[target].addr_pointer, &code_block_info_mem, leo_flash_fw_buffer);
+    rc += get_block_info(device->i2cDriver, toc_data_mem->syscfg_data[target].addr_pointer, &syscfg_block_info_mem, image->buf);
+    rc += get_block_info(device->i2cDriver, toc_data_mem->code_data[target].addr_pointer, &code_block_info_mem, image->buf);
     if (0 != rc) {
         ASTERA_ERROR("Failed to get block info for code or syscfg block in .mem");
         free(block_data_flash);
@@ -1614,12 +1854,12 @@ LeoErrorType leo_spi_update_target(LeoDeviceType *device, char *filename, int ta
     // Find end block in .mem
     addr = toc_data_mem->code_data[target].addr_pointer;
     while (BT_END_e != end_block_info_mem.type) {
-        rc += find_next_block(device->i2cDriver, addr, 1, &addr, leo_flash_fw_buffer);
+        rc += find_next_block(device->i2cDriver, addr, 1, &addr, image->buf);
         if (0 != rc) {
             ASTERA_ERROR("Failed to find end block in .mem");
             break;
         }
-        rc += get_block_info(device->i2cDriver, addr, &end_block_info_mem, leo_flash_fw_buffer);
+        rc += get_block_info(device->i2cDriver, addr, &end_block_info_mem, image->buf);
     }
     if (0 != rc) {
         free(block_data_flash);
@@ -1640,29 +1880,76 @@ LeoErrorType leo_spi_update_target(LeoDeviceType *device, char *filename, int ta
         ? syscfg_block_info_flash.end_addr 
         : syscfg_block_info_flash.start_addr + syscfg_block_info_mem.end_addr - syscfg_block_info_mem.start_addr;
     //
-    // Erase current code block and syscfg block from flash
+    // Split the syscfg and code writes into 64KB units and pick up an
+    // earlier, interrupted run of the same update from the journal
     //
-    rc += flash_erase_range(device, syscfg_block_info_flash.start_addr, syscfg_write_end_addr);
-    if (0 != rc) {
-        ASTERA_ERROR("Failed to erase syscfg block in flash\n");
-    }
-    rc += flash_erase_range(device, code_block_info_flash.start_addr, code_write_end_addr);
-    if (0 != rc) {
-        ASTERA_ERROR("Failed to erase code block in flash\n");
+    num_units = leo_spi_add_update_units(units, 0, syscfg_block_info_flash.start_addr, syscfg_write_end_addr,
+                                         &image->dwords[syscfg_block_info_mem.start_addr >> 2]);
+    num_units += leo_spi_add_update_units(units, num_units, code_block_info_flash.start_addr, code_write_end_addr,
+                                          &image->dwords[code_block_info_mem.start_addr >> 2]);
+
+    if (NULL != device->updateJournalFile) {
+        journal_header.magic = LEO_SPI_JOURNAL_MAGIC;
+        journal_header.version = LEO_SPI_JOURNAL_VERSION;
+        journal_header.target = target;
+        journal_header.num_units = num_units;
+        journal_header.plan_crc = 0;
+        for (ii = 0; ii < num_units; ii++) {
+            journal_header.plan_crc = leo_spi_crc32(journal_header.plan_crc, (uint8_t *)&units[ii].addr, sizeof(uint32_t));
+            journal_header.plan_crc = leo_spi_crc32(journal_header.plan_crc, (uint8_t *)&units[ii].len, sizeof(uint32_t));
+            journal_header.plan_crc = leo_spi_crc32(journal_header.plan_crc, (uint8_t *)&units[ii].crc, sizeof(uint32_t));
+        }
+        journal_fp = leo_spi_journal_open(device->updateJournalFile, &journal_header, units, num_units);
+        leo_spi_journal_verify_units(device->i2cDriver, units, num_units);
     }
 
     //
-    // Write code block and syscfg block from .mem file to flash
+    // Erase current code block and syscfg block from flash. The first unit
+    // not yet programmed may hold a partial write, so it is always erased.
+    // Erasing a unit erases its whole 64KB sector, so any other unit in the
+    // same sector has to be programmed again.
     //
-    fw_flash_buffer_dwords = (uint32_t *)malloc(SPI_FLASH_SIZE);
-    for (ii = 0; ii < SPI_FLASH_SIZE; ii+=4) {
-      fw_flash_buffer_dwords[ii>>2] = leo_flash_fw_buffer[ii] << 24 | leo_flash_fw_buffer[ii+1] << 16 | leo_flash_fw_buffer[ii+2] << 8 | leo_flash_fw_buffer[ii+3];
+    first_unit = 1;
+    for (ii = 0; ii < num_units; ii++) {
+        if (0 != units[ii].programmed) {
+            continue;
+        }
+        if (0 == units[ii].erased || first_unit) {
+            rc += flash_erase_range(device, units[ii].addr, units[ii].addr + units[ii].len);
+            if (0 != rc) {
+                ASTERA_ERROR("Failed to erase flash at 0x%06x", units[ii].addr);
+                break;
+            }
+            for (jj = 0; jj < num_units; jj++) {
+                if (units[jj].addr / LEO_SPI_JOURNAL_UNIT_SIZE != units[ii].addr / LEO_SPI_JOURNAL_UNIT_SIZE) {
+                    continue;
+                }
+                if (jj != ii && 0 != units[jj].programmed) {
+                    ASTERA_INFO("Unit at 0x%06x shares the erased sector, re-programming", units[jj].addr);
+                }
+                units[jj].erased = 1;
+                units[jj].programmed = 0;
+                leo_spi_journal_append(journal_fp, LEO_SPI_JOURNAL_ERASE_e, &units[jj]);
+            }
+        }
+        first_unit = 0;
     }
 
+    //
+    // Write code block and syscfg block from .mem file to flash
+    //
     ASTERA_INFO("Writing syscfg block to flash from 0x%x to 0x%x", syscfg_block_info_flash.start_addr, syscfg_write_end_addr);
-    rc += flash_write(device->i2cDriver, syscfg_block_info_flash.start_addr, (syscfg_write_end_addr - syscfg_block_info_flash.start_addr) >> 2, &fw_flash_buffer_dwords[syscfg_block_info_mem.start_addr >> 2]);
     ASTERA_INFO("Writing code block to flash from 0x%x to 0x%x", code_block_info_flash.start_addr, code_write_end_addr);
-    rc += flash_write(device->i2cDriver, code_block_info_flash.start_addr, (code_write_end_addr - code_block_info_flash.start_addr) >> 2, &fw_flash_buffer_dwords[code_block_info_mem.start_addr >> 2]);
+    for (ii = 0; ii < num_units && 0 == rc; ii++) {
+        if (0 != units[ii].programmed) {
+            continue;
+        }
+        rc += flash_write(device->i2cDriver, units[ii].addr, units[ii].len >> 2, units[ii].data);
+        if (0 == rc) {
+            units[ii].programmed = 1;
+            leo_spi_journal_append(journal_fp, LEO_SPI_JOURNAL_PROGRAM_e, &units[ii]);
+        }
+    }
     if (0 != rc) {
         ASTERA_ERROR("Failed to write code or syscfg block to flash");
     }
@@ -1697,7 +1984,14 @@ LeoErrorType leo_spi_update_target(LeoDeviceType *device, char *filename, int ta
     dt = tv_now.tv_sec - tv_start.tv_sec;
     ASTERA_INFO("Total Elapsed time: %d seconds", dt);
 
-    free(fw_flash_buffer_dwords);
+    // The journal is only kept around to resume a failed update
+    if (NULL != journal_fp) {
+        fclose(journal_fp);
+        if (0 == rc) {
+            remove(device->updateJournalFile);
+        }
+    }
+
     free(block_data_flash);
     free(block_data_mem);
 
@@ -1705,7 +1999,22 @@ LeoErrorType leo_spi_update_target(LeoDeviceType *device, char *filename, int ta
 }
 
 LeoErrorType leo_spi_verify_crc(LeoDeviceType *device, char *filename) {
+  LeoSpiFwImageType *image;
   LeoErrorType rc;
+
+  rc = leo_spi_fw_image_load(filename, &image);
+  if (rc != 0) {
+    printf("Failed to read FW image from file %s", filename);
+    return rc;
+  }
+  rc = leo_spi_verify_crc_image(device, image);
+  leo_spi_fw_image_free(image);
+  return rc;
+}
+
+LeoErrorType leo_spi_verify_crc_image(LeoDeviceType *device,
+                                      const LeoSpiFwImageType *image) {
+  LeoErrorType rc = 0;
   int ii;
   uint32_t *block_data_flash;
   uint32_t *block_data_mem;
@@ -1720,19 +2029,13 @@ LeoErrorType leo_spi_verify_crc(LeoDeviceType *device, char *filename) {
 
   ASTERA_INFO("Verifying flash image blocks ...");
 
-  rc = readFWImageFromFile(filename);
-  if (rc != 0) {
-    printf("Failed to read FW image from file %s", filename);
-    return rc;
-  }
-
   block_info_t block_info_flash = {0};
   block_info_t block_info_mem = {0};
   block_info_t toc_block_info_flash = {0};
   block_info_t toc_block_info_mem = {0};
 
   rc += find_block_by_type(device->i2cDriver, BT_TOC_e, &toc_block_info_flash, NULL);
-  rc += find_block_by_type(device->i2cDriver, BT_TOC_e, &toc_block_info_mem, leo_flash_fw_buffer);
+  rc += find_block_by_type(device->i2cDriver, BT_TOC_e, &toc_block_info_mem, image->buf);
   rc += flash_verify_block_crc(device->i2cDriver, toc_block_info_flash.start_addr, (toc_block_info_flash.end_addr - toc_block_info_flash.start_addr) >> 2, toc_block_info_mem.crc);
   if (0 != rc) {
     ASTERA_ERROR("Failed to verify TOC block in flash");
@@ -1746,7 +2049,7 @@ LeoErrorType leo_spi_verify_crc(LeoDeviceType *device, char *filename) {
 
   if (1 == toc_block_info_flash.config_data[0]) {
     rc += find_block_by_type(device->i2cDriver, BT_DESCRIPTION_e, &block_info_flash, NULL);
-    rc += find_block_by_type(device->i2cDriver, BT_DESCRIPTION_e, &block_info_mem, leo_flash_fw_buffer);
+    rc += find_block_by_type(device->i2cDriver, BT_DESCRIPTION_e, &block_info_mem, image->buf);
     if (0 != rc) {
       ASTERA_ERROR("Failed to find description block in flash");
       return rc;
@@ -1761,7 +2064,7 @@ LeoErrorType leo_spi_verify_crc(LeoDeviceType *device, char *filename) {
   }
 
   rc += find_block_by_type(device->i2cDriver, BT_FLASH_CTRL_e, &block_info_flash, NULL);
-  rc += find_block_by_type(device->i2cDriver, BT_FLASH_CTRL_e, &block_info_mem, leo_flash_fw_buffer);
+  rc += find_block_by_type(device->i2cDriver, BT_FLASH_CTRL_e, &block_info_mem, image->buf);
   rc += flash_verify_block_crc(device->i2cDriver, block_info_flash.start_addr, (block_info_flash.end_addr - block_info_flash.start_addr) >> 2, block_info_mem.crc);
   if (0 != rc) {
     ASTERA_ERROR("Failed to verify flash ctrl block in flash");
@@ -1788,7 +2091,7 @@ LeoErrorType leo_spi_verify_crc(LeoDeviceType *device, char *filename) {
   if (NULL == block_data_mem) {
     ASTERA_ERROR("Failed to allocate memory for block_data_mem");
   }
-  rc += read_block_data(device->i2cDriver, block_info_mem, block_data_mem, leo_flash_fw_buffer);
+  rc += read_block_data(device->i2cDriver, block_info_mem, block_data_mem, image->buf);
   toc_data_mem = (toc_data_t *) block_data_mem;
   if (0 != rc) {
     ASTERA_ERROR("Failed to read TOC block in .mem");
@@ -1797,7 +2100,7 @@ LeoErrorType leo_spi_verify_crc(LeoDeviceType *device, char *filename) {
     return rc;
   }
 
-  rc += get_block_info(device->i2cDriver, toc_data_mem->code_data[0].addr_pointer, &block_info_mem, leo_flash_fw_buffer);
+  rc += get_block_info(device->i2cDriver, toc_data_mem->code_data[0].addr_pointer, &block_info_mem, image->buf);
   for (ii = 0; ii < 3; ii++) {
     // check if primary
     if (0 == (toc_data_flash->code_data[ii].config & 0x01010000)) {
@@ -1824,7 +2127,7 @@ LeoErrorType leo_spi_verify_crc(LeoDeviceType *device, char *filename) {
     while (addr < end_block_info_flash.start_addr) {
         rc += find_next_block(device->i2cDriver, prev_addr, 1, &addr, NULL);
         rc += get_block_info(device->i2cDriver, addr, &tmp_block_info, NULL);
-        rc += get_block_info(device->i2cDriver, toc_data_mem->code_data[0].addr_pointer + (addr - block_info_flash.start_addr), &block_info_mem, leo_flash_fw_buffer);
+        rc += get_block_info(device->i2cDriver, toc_data_mem->code_data[0].addr_pointer + (addr - block_info_flash.start_addr), &block_info_mem, image->buf);
         rc += flash_verify_block_crc(device->i2cDriver, addr, (tmp_block_info.end_addr - tmp_block_info.start_addr) >> 2, block_info_mem.crc);
         prev_addr = addr;
     }
@@ -1837,7 +2140,7 @@ LeoErrorType leo_spi_verify_crc(LeoDeviceType *device, char *filename) {
     }
   }
 
-  rc += get_block_info(device->i2cDriver, toc_data_mem->syscfg_data[0].addr_pointer, &block_info_mem, leo_flash_fw_buffer);
+  rc += get_block_info(device->i2cDriver, toc_data_mem->syscfg_data[0].addr_pointer, &block_info_mem, image->buf);
   for (ii = 0; ii < 3; ii++) {
     // check if valid
     if (0 == (toc_data_flash->syscfg_data[ii].valid)) {
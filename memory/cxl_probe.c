@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <emmintrin.h>
+
+#define CACHE_LINE            64UL
+#define MAX_PROBE_THREADS     256
+#define MAX_NUMA_NODES        1024
+#define DEFAULT_BUFFER_SIZE   (1UL << 30)
+#define DEFAULT_SECONDS       2
+#define DEFAULT_THREAD_LIST   "1,2,4,8"
+#define BW_CHUNK_SIZE         (64UL << 10)
+#define CHASE_BATCH           (1UL << 14)
+#define SLICE_ALIGN           4096UL
+
+#define PROBE_IDLE            0x1
+#define PROBE_BANDWIDTH       0x2
+#define PROBE_LOADED          0x4
+
+typedef enum {
+    BW_READ,
+    BW_WRITE,
+    BW_NT_WRITE,
+    BW_MIXED,
+    NUM_BW_MODES,
+} bw_mode_t;
+
+static const char *BW_MODE_NAMES[NUM_BW_MODES] = {"read", "write", "nt_write", "mixed"};
+
+typedef struct probe_thread {
+    pthread_t tid;
+    int cpu;
+    int chase;
+    bw_mode_t mode;
+    uint8_t *base;
+    uint64_t size;
+    uint64_t bytes;
+    uint64_t hops;
+    uint64_t elapsed_ns;
+} probe_thread_t;
+
+static int numa_node = -1;
+static uint64_t phys_addr = 0;
+static int use_phys = 0;
+static const char *dax_path = NULL;
+static uint64_t buffer_size = DEFAULT_BUFFER_SIZE;
+static uint64_t chase_size = 0;
+static int seconds = DEFAULT_SECONDS;
+static int probe_tests = PROBE_IDLE | PROBE_BANDWIDTH | PROBE_LOADED;
+static int probe_modes = (1 << NUM_BW_MODES) - 1;
+static int thread_counts[MAX_PROBE_THREADS];
+static int num_thread_counts = 0;
+static int cpus[MAX_PROBE_THREADS];
+static int num_cpus = 0;
+
+static uint8_t *chase_base;
+static uint8_t *bw_base;
+static uint64_t bw_size;
+static void *chase_head;
+static volatile int probe_stop;
+static volatile uint64_t probe_sink;
+static pthread_barrier_t probe_barrier;
+
+static void usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s [-n node | -p phys_addr | -D dax_device] [-s size] [-l chase_size] [-t threads] [-c cpus] [-S seconds] [-m modes] [-T tests] [-h]\n\n", prog_name);
+    fprintf(stderr, "Measure host-visible latency and bandwidth of (CXL) memory. Results are printed as CSV with the same\n");
+    fprintf(stderr, "timestamp format and MB/s unit (1024 * 1024 bytes) as leo_sample_cxl_bw, use the same -S/-seconds window\n");
+    fprintf(stderr, "to line up host and Leo counter samples\n\n");
+    fprintf(stderr, "Command Option Description:\n");
+    fprintf(stderr, "       [-n node]          Allocate the buffer on NUMA node, e.g. the CPU-less node of a CXL memory expander\n");
+    fprintf(stderr, "       [-p phys_addr]     Map the buffer from /dev/mem at phys_addr. Its content is destroyed\n");
+    fprintf(stderr, "       [-D dax_device]    Map the buffer from a device DAX, e.g. /dev/dax0.0. Its content is destroyed\n");
+    fprintf(stderr, "       [-s size]          Buffer size, K/M/G suffix allowed, default: 1G\n");
+    fprintf(stderr, "       [-l chase_size]    Part of the buffer used for the pointer chase, default: a quarter of the buffer\n");
+    fprintf(stderr, "       [-t threads]       Comma separated bandwidth thread counts, default: %s\n", DEFAULT_THREAD_LIST);
+    fprintf(stderr, "       [-c cpus]          CPU list to run on, e.g. 0-15,32, default: CPUs this process may run on\n");
+    fprintf(stderr, "       [-S seconds]       Length of every measurement window, default: %d\n", DEFAULT_SECONDS);
+    fprintf(stderr, "       [-m modes]         Comma separated bandwidth modes: read, write, nt_write, mixed, default: all\n");
+    fprintf(stderr, "       [-T tests]         Comma separated tests: idle, bw, loaded, default: all\n");
+    fprintf(stderr, "       [-h]               Print command usage\n");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int parse_size(const char *str, uint64_t *size)
+{
+    char *end;
+    uint64_t value = strtoull(str, &end, 0);
+
+    switch (*end) {
+        case 'g': case 'G': value <<= 10; /* fall through */
+        case 'm': case 'M': value <<= 10; /* fall through */
+        case 'k': case 'K': value <<= 10; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*end != '\0' || value == 0)
+        return -1;
+
+    *size = value;
+    return 0;
+}
+
+static int parse_int_list(const char *str, int *list, int max, int allow_range)
+{
+    char *copy = strdup(str), *token, *save = NULL;
+    int first, last, count = 0;
+
+    for (token = strtok_r(copy, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        if (!allow_range || sscanf(token, "%d-%d", &first, &last) != 2) {
+            if (sscanf(token, "%d", &first) != 1) {
+                count = -1;
+                break;
+            }
+            last = first;
+        }
+        for (; first <= last && first >= 0 && count < max; first++)
+            list[count++] = first;
+    }
+    free(copy);
+
+    return count;
+}
+
+static int parse_name_list(const char *str, const char **names, int num_names)
+{
+    char *copy = strdup(str), *token, *save = NULL;
+    int mask = 0, i;
+
+    for (token = strtok_r(copy, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        for (i = 0; i < num_names; i++)
+            if (!strcmp(token, names[i]))
+                break;
+        if (i == num_names) {
+            mask = -1;
+            break;
+        }
+        mask |= 1 << i;
+    }
+    free(copy);
+
+    return mask;
+}
+
+static uint8_t *map_node_memory(uint64_t size)
+{
+    unsigned long nodemask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+    uint8_t *buffer;
+    void *page;
+    int status = -1;
+
+    buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+        return NULL;
+    madvise(buffer, size, MADV_HUGEPAGE);
+
+    if (numa_node >= 0) {
+        if (numa_node >= MAX_NUMA_NODES) {
+            printf("ERROR: NUMA node %d out of range\n", numa_node);
+            munmap(buffer, size);
+            return NULL;
+        }
+        nodemask[numa_node / (8 * sizeof(unsigned long))] |= 1UL << (numa_node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, buffer, size, MPOL_BIND, nodemask, MAX_NUMA_NODES, MPOL_MF_STRICT) != 0) {
+            printf("ERROR: Failed to bind buffer to NUMA node %d - %s\n", numa_node, strerror(errno));
+            munmap(buffer, size);
+            return NULL;
+        }
+    }
+
+    // Fault the whole buffer in so that the first measurement does not pay for it
+    memset(buffer, 0, size);
+
+    page = buffer;
+    if (syscall(SYS_move_pages, 0, 1UL, &page, NULL, &status, 0) == 0 && status >= 0)
+        fprintf(stderr, "INFO: Buffer of 0x%lx bytes allocated on NUMA node %d\n", size, status);
+
+    return buffer;
+}
+
+static uint8_t *map_device_memory(const char *path, uint64_t offset, uint64_t size)
+{
+    uint8_t *buffer;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        printf("ERROR: Failed to open %s - %s\n", path, strerror(errno));
+        return NULL;
+    }
+    buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    close(fd);
+    if (buffer == MAP_FAILED) {
+        printf("ERROR: Failed to map 0x%lx bytes at 0x%lx of %s - %s\n", size, offset, path, strerror(errno));
+        return NULL;
+    }
+    fprintf(stderr, "INFO: Buffer of 0x%lx bytes mapped at 0x%lx of %s\n", size, offset, path);
+
+    return buffer;
+}
+
+static uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * Link every cache line of the chase region into one cycle visiting the
+ * lines in random order, so neither the prefetchers nor the caches help.
+ */
+static int build_chase(uint8_t *base, uint64_t size)
+{
+    uint64_t lines = size / CACHE_LINE;
+    uint64_t *order, i, j, tmp;
+    uint64_t seed = now_ns() | 1;
+
+    order = malloc(lines * sizeof(*order));
+    if (order == NULL)
+        return -1;
+
+    for (i = 0; i < lines; i++)
+        order[i] = i;
+    for (i = lines - 1; i > 0; i--) {
+        j = xorshift64(&seed) % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (i = 0; i < lines; i++)
+        *(void **)(base + order[i] * CACHE_LINE) = base + order[(i + 1) % lines] * CACHE_LINE;
+
+    chase_head = base + order[0] * CACHE_LINE;
+    free(order);
+
+    return 0;
+}
+
+static void *chase(void *p, uint64_t hops)
+{
+    void **q = p;
+
+    for (; hops >= 8; hops -= 8) {
+        q = *q; q = *q; q = *q; q = *q;
+        q = *q; q = *q; q = *q; q = *q;
+    }
+    while (hops--)
+        q = *q;
+
+    return q;
+}
+
+static uint64_t read_chunk(const uint8_t *p, uint64_t len)
+{
+    const uint64_t *q = (const uint64_t *)p;
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    uint64_t i;
+
+    for (i = 0; i < len / 8; i += 8) {
+        s0 += q[i] + q[i + 1];
+        s1 += q[i + 2] + q[i + 3];
+        s2 += q[i + 4] + q[i + 5];
+        s3 += q[i + 6] + q[i + 7];
+    }
+
+    return s0 + s1 + s2 + s3;
+}
+
+static void write_chunk(uint8_t *p, uint64_t len, uint64_t value)
+{
+    uint64_t *q = (uint64_t *)p;
+    uint64_t i;
+
+    for (i = 0; i < len / 8; i++)
+        q[i] = value;
+}
+
+static void nt_write_chunk(uint8_t *p, uint64_t len, uint64_t value)
+{
+    __m128i v = _mm_set1_epi64x((long long)value);
+    uint64_t i;
+
+    for (i = 0; i < len; i += 64) {
+        _mm_stream_si128((__m128i *)(p + i), v);
+        _mm_stream_si128((__m128i *)(p + i + 16), v);
+        _mm_stream_si128((__m128i *)(p + i + 32), v);
+        _mm_stream_si128((__m128i *)(p + i + 48), v);
+    }
+    _mm_sfence();
+}
+
+static void *probe_worker(void *arg)
+{
+    probe_thread_t *thread = arg;
+    cpu_set_t cpuset;
+    uint64_t start, offset = 0, span, sum = 0;
+    void *p = chase_head;
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(thread->cpu, &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+
+    pthread_barrier_wait(&probe_barrier);
+    start = now_ns();
+
+    if (thread->chase) {
+        while (!probe_stop) {
+            p = chase(p, CHASE_BATCH);
+            thread->hops += CHASE_BATCH;
+        }
+        probe_sink = (uint64_t)p;
+    } else {
+        // Mixed mode reads the first half of the slice and writes the second one
+        span = thread->mode == BW_MIXED ? thread->size / 2 : thread->size;
+        while (!probe_stop) {
+            switch (thread->mode) {
+                case BW_READ:
+                    sum += read_chunk(thread->base + offset, BW_CHUNK_SIZE);
+                    thread->bytes += BW_CHUNK_SIZE;
+                    break;
+                case BW_WRITE:
+                    write_chunk(thread->base + offset, BW_CHUNK_SIZE, offset);
+                    thread->bytes += BW_CHUNK_SIZE;
+                    break;
+                case BW_NT_WRITE:
+                    nt_write_chunk(thread->base + offset, BW_CHUNK_SIZE, offset);
+                    thread->bytes += BW_CHUNK_SIZE;
+                    break;
+                default:
+                    sum += read_chunk(thread->base + offset, BW_CHUNK_SIZE);
+                    write_chunk(thread->base + span + offset, BW_CHUNK_SIZE, sum);
+                    thread->bytes += 2 * BW_CHUNK_SIZE;
+                    break;
+            }
+            offset += BW_CHUNK_SIZE;
+            if (offset + BW_CHUNK_SIZE > span)
+                offset = 0;
+        }
+        probe_sink = sum;
+    }
+
+    thread->elapsed_ns = now_ns() - start;
+    return NULL;
+}
+
+static void print_result(const struct timespec *wall, const char *test, const char *mode, int threads,
+                         uint64_t elapsed_ns, uint64_t bytes, double latency_ns)
+{
+    char buf[32];
+    struct tm lt;
+    double secs = elapsed_ns / 1e9;
+
+    localtime_r(&wall->tv_sec, &lt);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &lt);
+    printf("%s.%03ld,%lu,%s,%s,%d,%.3f,%lu,%.0f,%.2f,%.2f\n",
+           buf, wall->tv_nsec / 1000000, (uint64_t)wall->tv_sec * 1000 + wall->tv_nsec / 1000000,
+           test, mode, threads, secs, bytes,
+           secs > 0 ? bytes / secs : 0, secs > 0 ? bytes / secs / (1024 * 1024) : 0, latency_ns);
+    fflush(stdout);
+}
+
+/*
+ * Run one measurement window: optionally one pointer-chase thread on the
+ * first CPU plus bw_threads bandwidth threads on the following CPUs.
+ */
+static int run_probe(const char *test, bw_mode_t mode, int bw_threads, int with_chase)
+{
+    probe_thread_t threads[MAX_PROBE_THREADS + 1];
+    int num_threads = bw_threads + (with_chase ? 1 : 0);
+    uint64_t slice, bytes = 0, hops = 0, elapsed_ns = 0, chase_ns = 0;
+    struct timespec wall;
+    struct timespec window = {seconds, 0};
+    int i, ret, cpu_index = 0;
+
+    slice = bw_threads ? (bw_size / bw_threads) & ~(SLICE_ALIGN - 1) : 0;
+    if (bw_threads && slice < 2 * BW_CHUNK_SIZE) {
+        printf("ERROR: Buffer too small for %d bandwidth threads\n", bw_threads);
+        return -1;
+    }
+
+    memset(threads, 0, sizeof(threads));
+    for (i = 0; i < num_threads; i++) {
+        threads[i].cpu = cpus[cpu_index++ % num_cpus];
+        if (with_chase && i == 0) {
+            threads[i].chase = 1;
+            continue;
+        }
+        threads[i].mode = mode;
+        threads[i].base = bw_base + (uint64_t)(i - (with_chase ? 1 : 0)) * slice;
+        threads[i].size = slice;
+    }
+
+    probe_stop = 0;
+    pthread_barrier_init(&probe_barrier, NULL, num_threads + 1);
+    for (i = 0; i < num_threads; i++) {
+        ret = pthread_create(&threads[i].tid, NULL, probe_worker, &threads[i]);
+        if (ret != 0) {
+            printf("ERROR: Failed to create probe thread - %s\n", strerror(ret));
+            exit(-1);
+        }
+    }
+
+    pthread_barrier_wait(&probe_barrier);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    nanosleep(&window, NULL);
+    probe_stop = 1;
+
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        if (threads[i].chase) {
+            hops = threads[i].hops;
+            chase_ns = threads[i].elapsed_ns;
+        } else {
+            bytes += threads[i].bytes;
+        }
+        if (threads[i].elapsed_ns > elapsed_ns)
+            elapsed_ns = threads[i].elapsed_ns;
+    }
+    pthread_barrier_destroy(&probe_barrier);
+
+    print_result(&wall, test, with_chase && !bw_threads ? "chase" : BW_MODE_NAMES[mode], bw_threads,
+                 elapsed_ns, bytes, hops ? (double)chase_ns / hops : 0);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *TEST_NAMES[] = {"idle", "bw", "loaded"};
+    int opt, i, mode;
+    uint8_t *buffer;
+    cpu_set_t cpuset;
+    const char *optstring = "hn:p:D:s:l:t:c:S:m:T:";
+
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        switch (opt) {
+            case 'n':
+                numa_node = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'p':
+                phys_addr = strtoull(optarg, NULL, 0);
+                use_phys = 1;
+                break;
+            case 'D':
+                dax_path = optarg;
+                break;
+            case 's':
+                if (parse_size(optarg, &buffer_size)) {
+                    printf("ERROR: %s - Invalid buffer size\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'l':
+                if (parse_size(optarg, &chase_size)) {
+                    printf("ERROR: %s - Invalid chase size\n", optarg);
+                    return -1;
+                }
+                break;
+            case 't':
+                num_thread_counts = parse_int_list(optarg, thread_counts, MAX_PROBE_THREADS, 0);
+                for (i = 0; i < num_thread_counts; i++)
+                    if (thread_counts[i] <= 0 || thread_counts[i] > MAX_PROBE_THREADS)
+                        num_thread_counts = -1;
+                if (num_thread_counts <= 0) {
+                    printf("ERROR: %s - Invalid thread list\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'c':
+                num_cpus = parse_int_list(optarg, cpus, MAX_PROBE_THREADS, 1);
+                if (num_cpus <= 0) {
+                    printf("ERROR: %s - Invalid CPU list\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'S':
+                seconds = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'm':
+                probe_modes = parse_name_list(optarg, BW_MODE_NAMES, NUM_BW_MODES);
+                if (probe_modes <= 0) {
+                    printf("ERROR: %s - Invalid mode list\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'T':
+                probe_tests = parse_name_list(optarg, TEST_NAMES, 3);
+                if (probe_tests <= 0) {
+                    printf("ERROR: %s - Invalid test list\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                return 0;
+        }
+    }
+
+    if ((numa_node >= 0) + use_phys + (dax_path != NULL) > 1) {
+        printf("ERROR: -n, -p and -D are mutually exclusive\n");
+        return -1;
+    }
+    if (seconds <= 0)
+        seconds = DEFAULT_SECONDS;
+    if (num_thread_counts == 0)
+        num_thread_counts = parse_int_list(DEFAULT_THREAD_LIST, thread_counts, MAX_PROBE_THREADS, 0);
+    if (num_cpus == 0 && sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+        for (i = 0; i < CPU_SETSIZE && num_cpus < MAX_PROBE_THREADS; i++)
+            if (CPU_ISSET(i, &cpuset))
+                cpus[num_cpus++] = i;
+    }
+    if (num_cpus == 0) {
+        printf("ERROR: No CPU to run on\n");
+        return -1;
+    }
+    // Threads beyond the CPU list share CPUs round-robin, the loaded test adds the chase thread
+    for (i = 0; i < num_thread_counts; i++) {
+        if (thread_counts[i] + ((probe_tests & PROBE_LOADED) ? 1 : 0) > num_cpus)
+            fprintf(stderr, "WARNING: %d bandwidth threads%s exceed the %d CPUs, results will be skewed\n",
+                    thread_counts[i], (probe_tests & PROBE_LOADED) ? " plus the chase thread" : "", num_cpus);
+    }
+
+    buffer_size &= ~(SLICE_ALIGN - 1);
+    if (chase_size == 0)
+        chase_size = buffer_size / 4;
+    chase_size &= ~(SLICE_ALIGN - 1);
+    if (chase_size == 0 || chase_size >= buffer_size) {
+        printf("ERROR: Chase size 0x%lx does not fit the buffer of 0x%lx bytes\n", chase_size, buffer_size);
+        return -1;
+    }
+
+    if (use_phys)
+        buffer = map_device_memory("/dev/mem", phys_addr, buffer_size);
+    else if (dax_path)
+        buffer = map_device_memory(dax_path, 0, buffer_size);
+    else
+        buffer = map_node_memory(buffer_size);
+    if (buffer == NULL) {
+        printf("ERROR: Failed to set up a buffer of 0x%lx bytes - %s\n", buffer_size, strerror(errno));
+        return -1;
+    }
+
+    chase_base = buffer;
+    bw_base = buffer + chase_size;
+    bw_size = buffer_size - chase_size;
+    if (build_chase(chase_base, chase_size)) {
+        printf("ERROR: Failed to build the pointer chase\n");
+        return -1;
+    }
+
+    printf("time,epoch_ms,test,mode,threads,seconds,bytes,bytes_per_sec,mb_per_sec,latency_ns\n");
+
+    if (probe_tests & PROBE_IDLE)
+        run_probe("idle_latency", BW_READ, 0, 1);
+
+    for (mode = 0; mode < NUM_BW_MODES; mode++) {
+        if (!(probe_modes & (1 << mode)))
+            continue;
+        for (i = 0; i < num_thread_counts; i++) {
+            if (probe_tests & PROBE_BANDWIDTH)
+                run_probe("bandwidth", mode, thread_counts[i], 0);
+            if (probe_tests & PROBE_LOADED)
+                run_probe("loaded_latency", mode, thread_counts[i], 1);
+        }
+    }
+
+    munmap(buffer, buffer_size);
+
+    return 0;
+}
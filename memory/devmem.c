@@ -29,6 +29,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -36,6 +37,8 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <termios.h>
+#include <time.h>
+#include <immintrin.h>
 #include <sys/types.h>
 #include <sys/mman.h>
   
@@ -45,76 +48,551 @@
 #define MAP_SIZE 4096UL
 #define MAP_MASK (MAP_SIZE - 1)
 
+/* Batch mode keeps up to MAP_CACHE_SLOTS windows of MAP_WINDOW bytes mapped */
+#define MAP_WINDOW (64 * 1024UL)
+#define MAP_WINDOW_MASK (MAP_WINDOW - 1)
+#define MAP_CACHE_SLOTS 16
+
+/* Range commands map and walk RANGE_CHUNK bytes at a time */
+#define RANGE_CHUNK (4 * 1024 * 1024UL)
+#define RANGE_MAX_MISMATCH 16
+
+typedef struct map_slot {
+    off_t base;
+    void *map;
+    size_t size;
+    unsigned long last_use;
+} map_slot_t;
+
+static int mem_fd = -1;
+static map_slot_t map_cache[MAP_CACHE_SLOTS];
+static unsigned long map_clock = 0;
+static int range_simd = 0;
+static uint32_t crc32c_table[256];
+
+static int access_width(int access_type)
+{
+    switch(access_type) {
+        case 'b': return 1;
+        case 'h': return 2;
+        case 'w': return 4;
+        case 'q': return 8;
+    }
+    return 0;
+}
+
+/*
+ * Return the virtual address of target, mapping its window on a cache miss
+ * and evicting the least recently used one. Falls back to a single page
+ * where the whole window can't be mapped.
+ */
+static void *map_target(off_t target)
+{
+    off_t base = target & ~MAP_WINDOW_MASK;
+    size_t size = MAP_WINDOW;
+    map_slot_t *slot = &map_cache[0];
+    void *map;
+    int i;
+
+    map_clock++;
+    for(i = 0; i < MAP_CACHE_SLOTS; i++) {
+        if(map_cache[i].map != NULL && target >= map_cache[i].base &&
+           target < map_cache[i].base + (off_t)map_cache[i].size) {
+            map_cache[i].last_use = map_clock;
+            return map_cache[i].map + (target - map_cache[i].base);
+        }
+        if(map_cache[i].last_use < slot->last_use)
+            slot = &map_cache[i];
+    }
+
+    map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, base);
+    if(map == MAP_FAILED) {
+        base = target & ~MAP_MASK;
+        size = MAP_SIZE;
+        map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, base);
+        if(map == MAP_FAILED)
+            return NULL;
+    }
+    if(slot->map != NULL)
+        munmap(slot->map, slot->size);
+    slot->base = base;
+    slot->map = map;
+    slot->size = size;
+    slot->last_use = map_clock;
+    return map + (target - base);
+}
+
+static void unmap_all(void)
+{
+    int i;
+
+    for(i = 0; i < MAP_CACHE_SLOTS; i++) {
+        if(map_cache[i].map != NULL)
+            munmap(map_cache[i].map, map_cache[i].size);
+        map_cache[i].map = NULL;
+    }
+}
+
+static unsigned long mem_read(volatile void *virt_addr, int access_type)
+{
+    switch(access_type) {
+        case 'b': return *((volatile uint8_t *) virt_addr);
+        case 'h': return *((volatile uint16_t *) virt_addr);
+        case 'w': return *((volatile uint32_t *) virt_addr);
+        default: return *((volatile uint64_t *) virt_addr);
+    }
+}
+
+static void mem_write(volatile void *virt_addr, int access_type, unsigned long writeval)
+{
+    switch(access_type) {
+        case 'b': *((volatile uint8_t *) virt_addr) = writeval; break;
+        case 'h': *((volatile uint16_t *) virt_addr) = writeval; break;
+        case 'w': *((volatile uint32_t *) virt_addr) = writeval; break;
+        default: *((volatile uint64_t *) virt_addr) = writeval; break;
+    }
+}
+
+static double elapsed_sec(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void report_throughput(const char *op, off_t target, unsigned long length, const struct timespec *start)
+{
+    double sec = elapsed_sec(start);
+
+    printf("%s 0x%lx+0x%lx: %.3f ms, %.1f MB/s\n", op, target, length, sec * 1e3,
+           sec > 0 ? length / sec / 1e6 : 0.0);
+}
+
+static void *map_chunk(off_t target, unsigned long length, size_t *size)
+{
+    off_t base = target & ~MAP_MASK;
+    void *map;
+
+    *size = ((target - base) + length + MAP_MASK) & ~MAP_MASK;
+    map = mmap(0, *size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, base);
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "Could not map 0x%lx+0x%lx [%s]\n", base, *size, strerror(errno));
+        return NULL;
+    }
+    return map + (target - base);
+}
+
+/* Device memory: one 64-bit volatile access per word */
+static void fill_mmio(volatile uint64_t *dst, uint64_t pattern, unsigned long words)
+{
+    unsigned long i;
+
+    for(i = 0; i < words; i++)
+        dst[i] = pattern;
+}
+
+/* Ordinary memory: streaming 256-bit stores, bypassing the cache */
+__attribute__((target("avx2")))
+static void fill_avx2(uint64_t *dst, uint64_t pattern, unsigned long words)
+{
+    __m256i v = _mm256_set1_epi64x(pattern);
+    unsigned long i = 0;
+
+    for(; i < words && ((uintptr_t)(dst + i) & 31); i++)
+        dst[i] = pattern;
+    for(; i + 4 <= words; i += 4)
+        _mm256_stream_si256((__m256i *)(dst + i), v);
+    for(; i < words; i++)
+        dst[i] = pattern;
+    _mm_sfence();
+}
+
+static void copy_mmio(volatile uint64_t *dst, const volatile uint64_t *src, unsigned long words)
+{
+    unsigned long i;
+
+    for(i = 0; i < words; i++)
+        dst[i] = src[i];
+}
+
+static void crc32c_init(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    for(i = 0; i < 256; i++) {
+        crc = i;
+        for(j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const volatile uint8_t *buf, unsigned long length)
+{
+    unsigned long i;
+    uint64_t word;
+    int b;
+
+    for(i = 0; i + 8 <= length; i += 8) {
+        word = *(const volatile uint64_t *)(buf + i);
+        for(b = 0; b < 8; b++, word >>= 8)
+            crc = crc32c_table[(crc ^ word) & 0xff] ^ (crc >> 8);
+    }
+    for(; i < length; i++)
+        crc = crc32c_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const volatile uint8_t *buf, unsigned long length)
+{
+    uint64_t crc64 = crc;
+    unsigned long i;
+
+    for(i = 0; i + 8 <= length; i += 8)
+        crc64 = _mm_crc32_u64(crc64, *(const volatile uint64_t *)(buf + i));
+    crc = (uint32_t)crc64;
+    for(; i < length; i++)
+        crc = _mm_crc32_u8(crc, buf[i]);
+    return crc;
+}
+
+/*
+ * Range commands, lengths and addresses must be 8-byte aligned:
+ *   fill <address> <length> <pattern>        fill with a 64-bit pattern
+ *   copy <dst> <src> <length>                copy between physical ranges
+ *   cmp  <address> <length> <pattern|@file>  compare against a pattern or file
+ *   crc  <address> <length>                  CRC32C of the range
+ */
+static int run_range_command(int argc, char **argv)
+{
+    off_t target, src = 0;
+    unsigned long length, done, chunk, words, i;
+    unsigned long mismatches = 0;
+    uint64_t pattern = 0, expect, value;
+    uint64_t *filebuf = NULL;
+    uint32_t crc = 0xffffffff;
+    int use_crc_hw = __builtin_cpu_supports("sse4.2");
+    int use_avx2 = range_simd && __builtin_cpu_supports("avx2");
+    struct timespec start;
+    FILE *fp = NULL;
+    void *virt_addr, *src_addr = NULL;
+    size_t size, src_size = 0;
+    int ret = 0;
+
+    if(argc < 3 || ((strcmp(argv[0], "fill") == 0 || strcmp(argv[0], "copy") == 0 ||
+                     strcmp(argv[0], "cmp") == 0) && argc < 4)) {
+        fprintf(stderr, "Missing arguments for '%s'.\n", argv[0]);
+        return -1;
+    }
+
+    target = strtoul(argv[1], 0, 0);
+    if(strcmp(argv[0], "copy") == 0) {
+        src = strtoul(argv[2], 0, 0);
+        length = strtoul(argv[3], 0, 0);
+    } else {
+        length = strtoul(argv[2], 0, 0);
+    }
+    if((target | src | length) & 7) {
+        fprintf(stderr, "Address and length must be 8-byte aligned.\n");
+        return -1;
+    }
+
+    if(strcmp(argv[0], "fill") == 0 || strcmp(argv[0], "cmp") == 0) {
+        if(argv[3][0] == '@') {
+            fp = fopen(argv[3] + 1, "rb");
+            filebuf = malloc(RANGE_CHUNK);
+            if(fp == NULL || filebuf == NULL) {
+                fprintf(stderr, "Could not open %s [%s]\n", argv[3] + 1, strerror(errno));
+                ret = -1;
+                goto out;
+            }
+        } else {
+            pattern = strtoull(argv[3], 0, 0);
+        }
+    }
+    if(crc32c_table[1] == 0)
+        crc32c_init();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(done = 0; done < length; done += chunk) {
+        chunk = length - done < RANGE_CHUNK ? length - done : RANGE_CHUNK;
+        words = chunk / 8;
+        virt_addr = map_chunk(target + done, chunk, &size);
+        if(virt_addr == NULL) {
+            ret = -1;
+            break;
+        }
+
+        if(strcmp(argv[0], "fill") == 0) {
+            if(fp != NULL) {
+                fprintf(stderr, "fill takes a pattern, not a file.\n");
+                ret = -1;
+            } else if(use_avx2) {
+                fill_avx2((uint64_t *)virt_addr, pattern, words);
+            } else {
+                fill_mmio((volatile uint64_t *)virt_addr, pattern, words);
+            }
+        } else if(strcmp(argv[0], "copy") == 0) {
+            src_addr = map_chunk(src + done, chunk, &src_size);
+            if(src_addr == NULL) {
+                ret = -1;
+            } else {
+                if(range_simd)
+                    memcpy(virt_addr, src_addr, chunk);
+                else
+                    copy_mmio((volatile uint64_t *)virt_addr, (volatile uint64_t *)src_addr, words);
+                munmap((void *)((uintptr_t)src_addr & ~MAP_MASK), src_size);
+            }
+        } else if(strcmp(argv[0], "cmp") == 0) {
+            if(fp != NULL && fread(filebuf, 1, chunk, fp) != chunk) {
+                fprintf(stderr, "%s is shorter than the range.\n", argv[3] + 1);
+                ret = -1;
+            } else if(range_simd && fp != NULL && memcmp(virt_addr, filebuf, chunk) == 0) {
+                /* Fast path: whole chunk matches */
+            } else {
+                for(i = 0; i < words; i++) {
+                    value = ((volatile uint64_t *)virt_addr)[i];
+                    expect = fp != NULL ? filebuf[i] : pattern;
+                    if(value != expect) {
+                        if(mismatches < RANGE_MAX_MISMATCH)
+                            printf("0x%lx: 0x%016lx != 0x%016lx\n", target + done + i * 8, value, expect);
+                        mismatches++;
+                    }
+                }
+            }
+        } else if(strcmp(argv[0], "crc") == 0) {
+            crc = use_crc_hw ? crc32c_hw(crc, virt_addr, chunk) : crc32c_sw(crc, virt_addr, chunk);
+        } else {
+            fprintf(stderr, "Illegal command '%s'.\n", argv[0]);
+            ret = -1;
+        }
+
+        munmap((void *)((uintptr_t)virt_addr & ~MAP_MASK), size);
+        if(ret)
+            break;
+    }
+
+    if(ret == 0) {
+        if(strcmp(argv[0], "cmp") == 0)
+            printf("cmp 0x%lx+0x%lx: %lu mismatching words\n", target, length, mismatches);
+        else if(strcmp(argv[0], "crc") == 0)
+            printf("crc 0x%lx+0x%lx: 0x%08x\n", target, length, ~crc);
+        report_throughput(argv[0], target, length, &start);
+        if(mismatches)
+            ret = -1;
+    }
+
+out:
+    if(fp != NULL)
+        fclose(fp);
+    free(filebuf);
+    return ret;
+}
+
+/*
+ * One batch command per line, '#' starts a comment:
+ *   r <address> [type] [count]              read count items
+ *   w <address> <type> <data> [count]       write data to count items
+ *   m <address> <type> <mask> <data>        read-modify-write the mask bits
+ * plus the range commands of run_range_command().
+ */
+static int run_command(char *line)
+{
+    char *argv[8];
+    int argc = 0, access_type, width;
+    unsigned long count = 1, i, value, writeval = 0, mask = 0;
+    off_t target;
+    void *virt_addr;
+    char *p;
+
+    if((p = strchr(line, '#')) != NULL)
+        *p = '\0';
+    for(p = strtok(line, " \t\r\n"); p != NULL && argc < 8; p = strtok(NULL, " \t\r\n"))
+        argv[argc++] = p;
+    if(argc == 0)
+        return 0;
+    if(strcmp(argv[0], "fill") == 0 || strcmp(argv[0], "copy") == 0 ||
+       strcmp(argv[0], "cmp") == 0 || strcmp(argv[0], "crc") == 0)
+        return run_range_command(argc, argv);
+    if(argc < 2) {
+        fprintf(stderr, "Missing address.\n");
+        return -1;
+    }
+
+    target = strtoul(argv[1], 0, 0);
+    access_type = argc > 2 ? tolower(argv[2][0]) : 'w';
+    width = access_width(access_type);
+    if(width == 0) {
+        fprintf(stderr, "Illegal data type '%c'.\n", access_type);
+        return -1;
+    }
+    if(target & (width - 1)) {
+        fprintf(stderr, "Address 0x%lx is not aligned to %d bytes.\n", target, width);
+        return -1;
+    }
+
+    switch(tolower(argv[0][0])) {
+        case 'r':
+            if(argc > 3)
+                count = strtoul(argv[3], 0, 0);
+            break;
+        case 'w':
+            if(argc < 4) {
+                fprintf(stderr, "Missing data.\n");
+                return -1;
+            }
+            writeval = strtoul(argv[3], 0, 0);
+            if(argc > 4)
+                count = strtoul(argv[4], 0, 0);
+            break;
+        case 'm':
+            if(argc < 5) {
+                fprintf(stderr, "Missing mask or data.\n");
+                return -1;
+            }
+            mask = strtoul(argv[3], 0, 0);
+            writeval = strtoul(argv[4], 0, 0);
+            break;
+        default:
+            fprintf(stderr, "Illegal command '%s'.\n", argv[0]);
+            return -1;
+    }
+
+    for(i = 0; i < count; i++, target += width) {
+        virt_addr = map_target(target);
+        if(virt_addr == NULL) {
+            fprintf(stderr, "Could not map 0x%lx [%s]\n", target, strerror(errno));
+            return -1;
+        }
+        switch(tolower(argv[0][0])) {
+            case 'r':
+                printf("0x%lx: 0x%0*lx\n", target, width * 2, mem_read(virt_addr, access_type));
+                break;
+            case 'w':
+                mem_write(virt_addr, access_type, writeval);
+                printf("0x%lx: 0x%0*lx written\n", target, width * 2, writeval);
+                break;
+            case 'm':
+                value = mem_read(virt_addr, access_type);
+                mem_write(virt_addr, access_type, (value & ~mask) | (writeval & mask));
+                printf("0x%lx: 0x%0*lx -> 0x%0*lx\n", target, width * 2, value, width * 2,
+                       mem_read(virt_addr, access_type));
+                break;
+        }
+    }
+    return 0;
+}
+
+static int run_batch(const char *path)
+{
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char *line = NULL;
+    size_t len = 0;
+    int lineno = 0, errors = 0;
+
+    if(fp == NULL) FATAL;
+    /* Results go out as one buffered stream */
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    while(getline(&line, &len, fp) != -1) {
+        lineno++;
+        if(run_command(line) != 0) {
+            fprintf(stderr, "%s:%d: command failed\n", path, lineno);
+            errors++;
+        }
+    }
+    free(line);
+    if(fp != stdin)
+        fclose(fp);
+    fflush(stdout);
+    return errors ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
-    int fd;
-    void *map_base, *virt_addr; 
+    void *virt_addr; 
     unsigned long read_result, writeval;
     off_t target;
     int access_type = 'w';
+    int ret;
+
+    /* -s: range commands target ordinary memory and may use SIMD */
+    if(argc > 1 && strcmp(argv[1], "-s") == 0) {
+        range_simd = 1;
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
     
     if(argc < 2) {
         fprintf(stderr, "\nUsage:\t%s { address } [ type [ data ] ]\n"
+            "\t%s [-s] -f { script | - }\n"
+            "\t%s [-s] -c \"command\"\n"
             "\taddress : memory address to act upon\n"
-            "\ttype    : access operation type : [b]yte, [h]alfword, [w]ord\n"
-            "\tdata    : data to be written\n\n",
-            argv[0]);
+            "\ttype    : access operation type : [b]yte, [h]alfword, [w]ord, [q]uadword\n"
+            "\tdata    : data to be written\n"
+            "\tscript  : file (or - for stdin) with one command per line:\n"
+            "\t          r address [type] [count]\n"
+            "\t          w address type data [count]\n"
+            "\t          m address type mask data\n"
+            "\t          fill address length pattern\n"
+            "\t          copy dst src length\n"
+            "\t          cmp address length { pattern | @file }\n"
+            "\t          crc address length\n"
+            "\t-s      : range commands work on ordinary memory, use SIMD/cache-bypassing routines\n\n",
+            argv[0], argv[0], argv[0]);
         exit(1);
     }
+
+    /* O_SYNC maps uncached, only MMIO needs it; -s ranges are ordinary RAM */
+    if((mem_fd = open("/dev/mem", range_simd ? O_RDWR : O_RDWR | O_SYNC)) == -1) FATAL;
+
+    if(strcmp(argv[1], "-f") == 0 || strcmp(argv[1], "-c") == 0) {
+        if(argc < 3) {
+            fprintf(stderr, "Missing script file or command.\n");
+            exit(1);
+        }
+        if(strcmp(argv[1], "-c") == 0)
+            ret = run_command(argv[2]) ? 1 : 0;
+        else
+            ret = run_batch(argv[2]);
+        unmap_all();
+        close(mem_fd);
+        return ret;
+    }
+
     target = strtoul(argv[1], 0, 0);
 
     if(argc > 2)
         access_type = tolower(argv[2][0]);
+    if(access_width(access_type) == 0) {
+        fprintf(stderr, "Illegal data type '%c'.\n", access_type);
+        exit(2);
+    }
 
-
-    if((fd = open("/dev/mem", O_RDWR | O_SYNC)) == -1) FATAL;
     printf("/dev/mem opened.\n"); 
     fflush(stdout);
     
-    /* Map one page */
-    map_base = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, target & ~MAP_MASK);
-    if(map_base == (void *) -1) FATAL;
-    printf("Memory mapped at address %p.\n", map_base); 
+    /* Map one window */
+    virt_addr = map_target(target);
+    if(virt_addr == NULL) FATAL;
+    printf("Memory mapped at address %p.\n", map_cache[0].map); 
     fflush(stdout);
     
-    virt_addr = map_base + (target & MAP_MASK);
-    switch(access_type) {
-        case 'b':
-            read_result = *((unsigned char *) virt_addr);
-            break;
-        case 'h':
-            read_result = *((unsigned short *) virt_addr);
-            break;
-        case 'w':
-            read_result = *((unsigned long *) virt_addr);
-            break;
-        default:
-            fprintf(stderr, "Illegal data type '%c'.\n", access_type);
-            exit(2);
-    }
+    read_result = mem_read(virt_addr, access_type);
     printf("Value at address 0x%lx (%p): 0x%lx\n", target, virt_addr, read_result); 
     fflush(stdout);
 
     if(argc > 3) {
         writeval = strtoul(argv[3], 0, 0);
-        switch(access_type) {
-            case 'b':
-                *((unsigned char *) virt_addr) = writeval;
-                read_result = *((unsigned char *) virt_addr);
-                break;
-            case 'h':
-                *((unsigned short *) virt_addr) = writeval;
-                read_result = *((unsigned short *) virt_addr);
-                break;
-            case 'w':
-                *((unsigned int *) virt_addr) = writeval;
-                read_result = *((unsigned int *) virt_addr);
-                break;
-        }
+        mem_write(virt_addr, access_type, writeval);
+        read_result = mem_read(virt_addr, access_type);
         printf("Written 0x%lx; readback 0x%lx\n", writeval, read_result); 
         fflush(stdout);
     }
     
-    if(munmap(map_base, MAP_SIZE) == -1) FATAL;
-    close(fd);
+    unmap_all();
+    close(mem_fd);
     return 0;
 }
@@ -15,10 +15,85 @@
 #include <linux/slab.h>
 #include <linux/highmem.h>
 #include <linux/vmalloc.h>
+#include <linux/io.h>
+#include <linux/ioport.h>
+#include <linux/capability.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <asm/cpufeature.h>
+#include <asm/special_insns.h>
+
+#include "mem_debug_ioctl.h"
 
 MODULE_LICENSE("GPL");
 
+#define MEM_WRITE_CHUNK     (64 * 1024)
+#define MAX_MEM_WRITERS     256
+#define MEM_DEBUG_CHUNK     (4 * 1024 * 1024)
+#define WRITER_STATS_LINE   128     // longest writer_stats line
+
+enum mem_flush_method {
+    MEM_FLUSH_NONE,
+    MEM_FLUSH_CLFLUSHOPT,
+    MEM_FLUSH_CLWB,
+    MEM_FLUSH_NT,
+};
+
+static const char * const mem_flush_names[] = {
+    [MEM_FLUSH_NONE]        = "none",
+    [MEM_FLUSH_CLFLUSHOPT]  = "clflushopt",
+    [MEM_FLUSH_CLWB]        = "clwb",
+    [MEM_FLUSH_NT]          = "nt",
+};
+
+// One writer kthread bound to a CPU, looping over its slice of the range
+struct mem_writer {
+    struct task_struct *task;
+    int cpu;
+    uint64_t phys_start;
+    uint64_t size;
+    void *virt;
+    enum mem_flush_method flush;
+    uint32_t pace_us;
+    bool released;
+    bool done;
+    ktime_t deadline;
+    uint64_t bytes_written;
+    ktime_t start_time;
+    ktime_t last_time;
+};
+
+// Set of writers launched by a single mem_write_job request
+struct mem_write_job_desc {
+    uint64_t base;
+    uint64_t stride;
+    uint32_t count;
+    uint64_t size;
+    struct cpumask cpus;
+    uint32_t duration_ms;
+};
+
 uint64_t physical_start_address = 0x1100000000; // Start from 64GB
+static uint64_t range_size = PAGE_SIZE;
+static uint32_t nr_writers = 1;
+static uint32_t pace_us = 0;
+static enum mem_flush_method flush_method = MEM_FLUSH_NT;
+static uint64_t pattern_seed;
+static struct mem_writer mem_writers[MAX_MEM_WRITERS];
+static int nr_mem_writers = 0;
+static int next_writer_cpu = -1;
+static bool mem_writers_halt = false;
+static struct mem_write_job_desc mem_write_job;
+static DEFINE_MUTEX(mem_writers_lock);
+static DECLARE_WAIT_QUEUE_HEAD(mem_writers_wq);
 static struct kobject *kobj_mem_debug;
 
 // Sysfs to show current physical address to kick off mem_write
@@ -44,51 +119,490 @@ static ssize_t physical_start_address_store(struct kobject *kobj, struct kobj_at
     return count;
 }
 
-static int mem_write(void *arg)
+// Sysfs to show/change the size in bytes of the range split between writers
+static ssize_t range_size_show(struct kobject *kobj, struct kobj_attribute *attr, char *buff)
 {
-    uint8_t mem_src_data[2 * PAGE_SIZE];
-    int index = 0;
-    uint64_t pfn = physical_start_address / PAGE_SIZE;
-    struct page *page = pfn_to_page(pfn);
+    return sprintf(buff, "0x%llx\n", range_size);
+}
+
+static ssize_t range_size_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count)
+{
+    uint64_t new_range_size = 0;
 
-    // Generate random memory source data which used for memory write
-    for (index = 0; index < 2 * PAGE_SIZE; index++) {
-        get_random_bytes(&mem_src_data[index], sizeof(uint8_t));
-        // printk(KERN_INFO "MEM_SRC_DATA#0x%08x: 0x%x\n", index, mem_src_data[index]);
+    if (kstrtoull(buff, 0, &new_range_size) || new_range_size < PAGE_SIZE) {
+        printk(KERN_INFO "Failed to update range_size, it must be at least 0x%lx\n", PAGE_SIZE);
+        return count;
     }
 
-    void *kmap_address = kmap(page);
+    range_size = round_down(new_range_size, PAGE_SIZE);
+
+    return count;
+}
+
+// Sysfs to show/change the number of writers started by each mem_write_request
+static ssize_t nr_writers_show(struct kobject *kobj, struct kobj_attribute *attr, char *buff)
+{
+    return sprintf(buff, "%u\n", nr_writers);
+}
+
+static ssize_t nr_writers_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count)
+{
+    uint32_t new_nr_writers = 0;
+
+    if (kstrtouint(buff, 0, &new_nr_writers) || new_nr_writers == 0 || new_nr_writers > MAX_MEM_WRITERS) {
+        printk(KERN_INFO "Failed to update nr_writers, it must be 1..%d\n", MAX_MEM_WRITERS);
+        return count;
+    }
+
+    nr_writers = new_nr_writers;
+
+    return count;
+}
+
+// Sysfs to show/change the delay between two chunks of a writer, 0 only yields
+static ssize_t pace_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buff)
+{
+    return sprintf(buff, "%u\n", pace_us);
+}
+
+static ssize_t pace_us_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count)
+{
+    if (kstrtouint(buff, 0, &pace_us))
+        printk(KERN_INFO "Failed to update pace_us\n");
+
+    return count;
+}
+
+// Sysfs to show/change how written lines are pushed out of the CPU caches
+static ssize_t flush_method_show(struct kobject *kobj, struct kobj_attribute *attr, char *buff)
+{
+    int i;
+    ssize_t count = 0;
+
+    for (i = 0; i < ARRAY_SIZE(mem_flush_names); i++)
+        count += sprintf(buff + count, i == flush_method ? "[%s] " : "%s ", mem_flush_names[i]);
+    count += sprintf(buff + count, "\n");
+
+    return count;
+}
+
+static ssize_t flush_method_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count)
+{
+    int method = sysfs_match_string(mem_flush_names, buff);
+
+    if (method < 0) {
+        printk(KERN_INFO "Unknown flush_method %s\n", buff);
+        return count;
+    }
+    if ((method == MEM_FLUSH_CLFLUSHOPT && !boot_cpu_has(X86_FEATURE_CLFLUSHOPT)) ||
+        (method == MEM_FLUSH_CLWB && !boot_cpu_has(X86_FEATURE_CLWB))) {
+        printk(KERN_INFO "flush_method %s is not supported by this CPU\n", mem_flush_names[method]);
+        return count;
+    }
+
+    flush_method = method;
+
+    return count;
+}
+
+// Sysfs to show/change the seed of the data pattern written by mem_write
+static ssize_t pattern_seed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buff)
+{
+    return sprintf(buff, "0x%016llx\n", pattern_seed);
+}
+
+static ssize_t pattern_seed_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count)
+{
+    if (kstrtoull(buff, 16, &pattern_seed))
+        printk(KERN_INFO "Failed to update pattern_seed\n");
+
+    return count;
+}
+
+// Every qword holds its own physical address mixed with the seed
+static inline uint64_t mem_debug_pattern(uint64_t phys)
+{
+    return phys ^ pattern_seed;
+}
+
+static void mem_write_chunk(struct mem_writer *writer, uint64_t offset, uint64_t len)
+{
+    uint64_t *dst = writer->virt + offset;
+    uint64_t phys = writer->phys_start + offset;
+    uint64_t i;
+    uint32_t line = boot_cpu_data.x86_clflush_size;
+
+    if (writer->flush == MEM_FLUSH_NT) {
+        // Non-temporal stores go to memory without filling the cache
+        for (i = 0; i < len / 8; i++)
+            asm volatile("movnti %1, %0" : "=m" (dst[i]) : "r" (mem_debug_pattern(phys + i * 8)));
+        wmb();
+        return;
+    }
+
+    for (i = 0; i < len / 8; i++)
+        WRITE_ONCE(dst[i], mem_debug_pattern(phys + i * 8));
+
+    switch (writer->flush) {
+        case MEM_FLUSH_CLFLUSHOPT:
+            for (i = 0; i < len; i += line)
+                clflushopt((void *)dst + i);
+            wmb();
+            break;
+        case MEM_FLUSH_CLWB:
+            for (i = 0; i < len; i += line)
+                clwb((void *)dst + i);
+            wmb();
+            break;
+        default:
+            break;
+    }
+}
+
+static int mem_write(void *arg)
+{
+    struct mem_writer *writer = arg;
+    uint64_t offset = 0;
+    uint64_t len;
+
+    // Barrier: wait until every writer of the request has been created
+    wait_event_interruptible(mem_writers_wq, READ_ONCE(writer->released) || kthread_should_stop());
+
+    writer->start_time = ktime_get();
+    while (!kthread_should_stop() && !READ_ONCE(mem_writers_halt)) {
+        if (writer->deadline && ktime_after(ktime_get(), writer->deadline))
+            break;
+
+        len = min_t(uint64_t, MEM_WRITE_CHUNK, writer->size - offset);
+        mem_write_chunk(writer, offset, len);
+        offset += len;
+        if (offset >= writer->size)
+            offset = 0;
+
+        WRITE_ONCE(writer->bytes_written, writer->bytes_written + len);
+        WRITE_ONCE(writer->last_time, ktime_get());
+
+        if (writer->pace_us)
+            usleep_range(writer->pace_us, writer->pace_us + writer->pace_us / 8 + 1);
+        else
+            cond_resched();
+    }
+
+    // Park until the next start or mem_writers_stop() reaps the thread
+    WRITE_ONCE(writer->done, true);
+    set_current_state(TASK_INTERRUPTIBLE);
     while (!kthread_should_stop()) {
-        index = 0;
-        while (index < 100) {
-            memcpy(kmap_address, mem_src_data + index, 0x1000);
-            // printk(KERN_INFO "DST_DATA: 0x%08x, SRC_DATA: 0x%08x\n", *(uint32_t *)kmap_address, *(uint32_t *)(mem_src_data + index));
-            asm volatile (
-                "wbinvd\n\t"
-                ::);
-            index++;
-            msleep(1);
-        }
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
     }
+    __set_current_state(TASK_RUNNING);
 
-    kunmap(page);
-    printk(KERN_INFO "Terminate kthread to end mem_write from physical_adress: 0x%016llx\n", physical_start_address);
+    printk(KERN_INFO "Terminate kthread to end mem_write from physical_adress: 0x%016llx\n", writer->phys_start);
     return 0;
 }
 
-// Sysfs to trigger mem_write request
-static ssize_t mem_write_request_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count)
+// Writers still writing, finished ones park until they are reaped
+static int mem_writers_running(void)
 {
+    int index, running = 0;
+
+    for (index = 0; index < nr_mem_writers; index++)
+        running += mem_writers[index].task != NULL && !READ_ONCE(mem_writers[index].done);
+    return running;
+}
+
+// Reap the writers that stopped or reached their deadline and free their slots, running writers
+// keep their slot since their kthread points at it. The caller holds mem_writers_lock.
+static void mem_writers_reap(void)
+{
+    struct mem_writer *writer;
+    int index, last = -1;
+
+    for (index = 0; index < nr_mem_writers; index++) {
+        writer = &mem_writers[index];
+        if (writer->task != NULL && READ_ONCE(writer->done)) {
+            kthread_stop(writer->task);
+            writer->task = NULL;
+            memunmap(writer->virt);
+            writer->virt = NULL;
+        }
+        if (writer->task == NULL)
+            memset(writer, 0, sizeof(*writer));
+        else
+            last = index;
+    }
+    nr_mem_writers = last + 1;
+    if (nr_mem_writers == 0)
+        next_writer_cpu = -1;
+}
+
+// Start count writers of size bytes each, stride bytes apart from start, on the CPUs of cpus.
+// All writers are released together once created and stop on their own after duration_ms (0 runs
+// until stopped), writers of earlier requests are left alone. The caller holds mem_writers_lock.
+static int mem_writers_start(uint64_t start, uint64_t size, uint64_t stride, uint32_t count,
+                             const struct cpumask *cpus, uint32_t duration_ms)
+{
+    struct mem_writer *writer;
     struct task_struct *k_thread;
+    uint32_t index, used = 0;
+    int slot = 0;
+    ktime_t release_time;
+    int ret = 0;
+
+    mem_writers_reap();
+    // A writer that reached its deadline since the reap still holds its slot
+    for (index = 0; index < nr_mem_writers; index++)
+        used += mem_writers[index].task != NULL;
+    if (used + count > MAX_MEM_WRITERS) {
+        printk(KERN_INFO "Failed to start %u writers, %u of %d slots in use\n", count, used, MAX_MEM_WRITERS);
+        return -EBUSY;
+    }
+    if (!cpumask_intersects(cpus, cpu_online_mask)) {
+        printk(KERN_INFO "Failed to start writers, none of the requested CPUs is online\n");
+        return -EINVAL;
+    }
 
-    k_thread = kthread_create(mem_write, NULL, "mem_write_kthread");
-    if (k_thread == NULL) {
-        printk(KERN_INFO "Failed to create kthread to start mem_write from physical_address: 0x%016llx\n", physical_start_address);
-        return count;
+    for (index = 0; index < count; index++) {
+        // Reuse the slots freed by mem_writers_reap() before growing the table
+        while (slot < MAX_MEM_WRITERS && mem_writers[slot].task != NULL)
+            slot++;
+        if (slot == MAX_MEM_WRITERS) {
+            ret = -EBUSY;
+            break;
+        }
+        writer = &mem_writers[slot];
+        memset(writer, 0, sizeof(*writer));
+        writer->phys_start = start + index * stride;
+        writer->size = size;
+        writer->flush = flush_method;
+        writer->pace_us = pace_us;
+
+        writer->virt = memremap(writer->phys_start, writer->size, MEMREMAP_WB);
+        if (writer->virt == NULL) {
+            printk(KERN_INFO "Failed to map physical_address: 0x%016llx, size: 0x%llx\n", writer->phys_start, writer->size);
+            memset(writer, 0, sizeof(*writer));
+            ret = -ENOMEM;
+            break;
+        }
+
+        // Spread writers round-robin over the requested online CPUs
+        next_writer_cpu = cpumask_next_and(next_writer_cpu, cpus, cpu_online_mask);
+        if (next_writer_cpu >= nr_cpu_ids)
+            next_writer_cpu = cpumask_first_and(cpus, cpu_online_mask);
+        writer->cpu = next_writer_cpu;
+
+        k_thread = kthread_create_on_node(mem_write, writer, cpu_to_node(writer->cpu), "mem_write/%d", slot);
+        if (IS_ERR(k_thread)) {
+            printk(KERN_INFO "Failed to create kthread to start mem_write from physical_address: 0x%016llx\n", writer->phys_start);
+            memunmap(writer->virt);
+            memset(writer, 0, sizeof(*writer));
+            ret = PTR_ERR(k_thread);
+            break;
+        }
+        kthread_bind(k_thread, writer->cpu);
+        writer->task = k_thread;
+        nr_mem_writers = max(nr_mem_writers, slot + 1);
+
+        wake_up_process(k_thread);
+        printk(KERN_INFO "K_THREAD#%d was created successfully on CPU%d to start mem_write from physical_address: 0x%016llx\n",
+               k_thread->pid, writer->cpu, writer->phys_start);
+    }
+
+    // Release the writers that were created, even if the request could not be completed
+    release_time = ktime_get();
+    for (index = 0; index < nr_mem_writers; index++) {
+        writer = &mem_writers[index];
+        if (writer->task == NULL || writer->released)
+            continue;
+        if (duration_ms)
+            writer->deadline = ktime_add_ms(release_time, duration_ms);
+        WRITE_ONCE(writer->released, true);
+    }
+    wake_up_all(&mem_writers_wq);
+
+    return ret;
+}
+
+// Stop every running writer at once, their statistics stay readable until the next start
+static void mem_writers_stop(void)
+{
+    int index;
+
+    WRITE_ONCE(mem_writers_halt, true);
+    for (index = 0; index < nr_mem_writers; index++) {
+        if (mem_writers[index].task == NULL)
+            continue;
+        kthread_stop(mem_writers[index].task);
+        mem_writers[index].task = NULL;
+        memunmap(mem_writers[index].virt);
+        mem_writers[index].virt = NULL;
     }
+    WRITE_ONCE(mem_writers_halt, false);
+}
 
-    wake_up_process(k_thread);
-    printk(KERN_INFO "K_THREAD#%d was created successfully to start mem_write from physical_address: 0x%016llx\n", k_thread->pid, physical_start_address);
+// Sysfs to trigger mem_write request, 0 stops all writers
+static ssize_t mem_write_request_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count)
+{
+    uint32_t request = 1;
+    uint32_t writers;
+    uint64_t slice;
+
+    if (kstrtouint(buff, 0, &request))
+        request = 1;
+
+    mutex_lock(&mem_writers_lock);
+    if (request == 0) {
+        mem_writers_stop();
+    } else {
+        // Split [physical_start_address, +range_size) between nr_writers, running writers are kept
+        writers = min_t(uint64_t, nr_writers, range_size / PAGE_SIZE);
+        slice = round_down(range_size / writers, PAGE_SIZE);
+        mem_writers_start(physical_start_address, slice, slice, writers, cpu_online_mask, 0);
+    }
+    mutex_unlock(&mem_writers_lock);
+
+    return count;
+}
+
+// Sysfs to show the last job launched through mem_write_job
+static ssize_t mem_write_job_show(struct kobject *kobj, struct kobj_attribute *attr, char *buff)
+{
+    return sprintf(buff, "base=0x%llx stride=0x%llx count=%u size=0x%llx cpus=%*pbl duration_ms=%u\n",
+                   mem_write_job.base, mem_write_job.stride, mem_write_job.count, mem_write_job.size,
+                   cpumask_pr_args(&mem_write_job.cpus), mem_write_job.duration_ms);
+}
+
+// Sysfs to launch a whole set of writers with one request:
+// "base=<addr> stride=<bytes> count=<n> [size=<bytes>] [cpus=<cpulist>] [duration_ms=<ms>]"
+static ssize_t mem_write_job_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count)
+{
+    // Parsed under mem_writers_lock, the cpumask is too large for the stack
+    static struct mem_write_job_desc job;
+    char *line, *cursor, *token, *value;
+    int ret = 0;
+
+    line = kstrndup(buff, count, GFP_KERNEL);
+    if (line == NULL)
+        return -ENOMEM;
+
+    mutex_lock(&mem_writers_lock);
+    job.base = physical_start_address;
+    job.stride = PAGE_SIZE;
+    job.count = 1;
+    job.size = 0;
+    job.duration_ms = 0;
+    cpumask_copy(&job.cpus, cpu_online_mask);
+
+    cursor = strim(line);
+    while (ret == 0 && (token = strsep(&cursor, " \t")) != NULL) {
+        if (*token == '\0')
+            continue;
+        value = strchr(token, '=');
+        if (value == NULL) {
+            ret = -EINVAL;
+            break;
+        }
+        *value++ = '\0';
+
+        if (!strcmp(token, "base"))
+            ret = kstrtoull(value, 0, &job.base);
+        else if (!strcmp(token, "stride"))
+            ret = kstrtoull(value, 0, &job.stride);
+        else if (!strcmp(token, "count"))
+            ret = kstrtouint(value, 0, &job.count);
+        else if (!strcmp(token, "size"))
+            ret = kstrtoull(value, 0, &job.size);
+        else if (!strcmp(token, "cpus"))
+            ret = cpulist_parse(value, &job.cpus);
+        else if (!strcmp(token, "duration_ms"))
+            ret = kstrtouint(value, 0, &job.duration_ms);
+        else
+            ret = -EINVAL;
+    }
+    kfree(line);
+
+    // Each writer covers the whole stride unless told otherwise
+    if (job.size == 0)
+        job.size = job.stride;
+    if (ret == 0 && (job.count == 0 || job.count > MAX_MEM_WRITERS || job.size < 8 || (job.size & 0x7)))
+        ret = -EINVAL;
+    if (ret) {
+        printk(KERN_INFO "Failed to parse mem_write_job %s\n", buff);
+        goto out;
+    }
+
+    if (mem_writers_running() > 0) {
+        printk(KERN_INFO "Failed to start mem_write_job, writers are still running\n");
+        ret = -EBUSY;
+        goto out;
+    }
+    mem_write_job = job;
+    ret = mem_writers_start(job.base, job.size, job.stride, job.count, &job.cpus, job.duration_ms);
+
+out:
+    mutex_unlock(&mem_writers_lock);
+    return ret ? ret : count;
+}
+
+// Sysfs to report per-writer and aggregate write bandwidth. The TOTAL line comes first, per-writer
+// lines are cut short once the page is nearly full.
+static uint64_t writer_mbps(const struct mem_writer *writer, uint64_t *bytes, uint64_t *elapsed_us)
+{
+    *bytes = READ_ONCE(writer->bytes_written);
+    *elapsed_us = *bytes ? ktime_us_delta(READ_ONCE(writer->last_time), writer->start_time) : 0;
+    return *elapsed_us ? *bytes / *elapsed_us : 0;
+}
+
+static ssize_t writer_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buff)
+{
+    struct mem_writer *writer;
+    uint64_t bytes, elapsed_us, mbps;
+    uint64_t total_bytes = 0, min_mbps = U64_MAX, max_mbps = 0, wall_us = 0;
+    ktime_t first_start = 0, last_end = 0;
+    ssize_t count = 0;
+    int index, writers = 0, running = 0, shown = 0;
+
+    mutex_lock(&mem_writers_lock);
+    for (index = 0; index < nr_mem_writers; index++) {
+        writer = &mem_writers[index];
+        if (writer->size == 0)
+            continue;
+        writers++;
+        running += writer->task != NULL && !READ_ONCE(writer->done);
+        mbps = writer_mbps(writer, &bytes, &elapsed_us);
+        if (bytes == 0)
+            continue;
+        total_bytes += bytes;
+        min_mbps = min(min_mbps, mbps);
+        max_mbps = max(max_mbps, mbps);
+        if (first_start == 0 || ktime_before(writer->start_time, first_start))
+            first_start = writer->start_time;
+        if (ktime_after(writer->last_time, last_end))
+            last_end = writer->last_time;
+    }
+    if (total_bytes)
+        wall_us = ktime_us_delta(last_end, first_start);
+    count += scnprintf(buff + count, PAGE_SIZE - count,
+                       "TOTAL\t%d writers (%d running)\tbytes: 0x%llx\twall_us: %llu\tMB/s: %llu\tmin MB/s: %llu\tmax MB/s: %llu\n",
+                       writers, running, total_bytes, wall_us, wall_us ? total_bytes / wall_us : 0,
+                       total_bytes ? min_mbps : 0, max_mbps);
+
+    count += scnprintf(buff + count, PAGE_SIZE - count, "WRITER\tCPU\tPHYS_START\t\tSIZE\t\tBYTES\t\tELAPSED_US\tMB/s\n");
+    for (index = 0; index < nr_mem_writers; index++) {
+        writer = &mem_writers[index];
+        if (writer->size == 0)
+            continue;
+        // Keep room for the line telling how many writers were left out
+        if (PAGE_SIZE - count < (shown < writers - 1 ? 2 : 1) * WRITER_STATS_LINE)
+            break;
+        mbps = writer_mbps(writer, &bytes, &elapsed_us);
+        count += scnprintf(buff + count, PAGE_SIZE - count, "%d\t%d\t0x%016llx\t0x%llx\t0x%llx\t%llu\t\t%llu\n",
+                           index, writer->cpu, writer->phys_start, writer->size, bytes, elapsed_us, mbps);
+        shown++;
+    }
+    if (shown < writers)
+        count += scnprintf(buff + count, PAGE_SIZE - count, "... %d more writers not shown\n", writers - shown);
+    mutex_unlock(&mem_writers_lock);
 
     return count;
 }
@@ -114,6 +628,190 @@ static ssize_t mem_dump_show(struct kobject *kobj, struct kobj_attribute *attr,
     return count;
 }
 
+// Like /dev/mem, the window reaches any physical address
+static int mem_debug_open(struct inode *inode, struct file *file)
+{
+    if (!capable(CAP_SYS_RAWIO))
+        return -EPERM;
+    return 0;
+}
+
+// REGION_INTERSECTS if [phys, phys + len) is all system RAM, REGION_DISJOINT if none of it is
+static int mem_debug_region(uint64_t phys, uint64_t len)
+{
+    return region_intersects(phys, len, IORESOURCE_SYSTEM_RAM, IORES_DESC_NONE);
+}
+
+// Read the window through the character device, file offset 0 is physical_start_address
+static ssize_t mem_debug_read(struct file *file, char __user *buf, size_t len, loff_t *ppos)
+{
+    uint64_t start = READ_ONCE(physical_start_address);
+    uint64_t size = READ_ONCE(range_size);
+    void __iomem *io;
+    void *virt;
+    int region;
+
+    if (*ppos < 0)
+        return -EINVAL;
+    if (*ppos >= size)
+        return 0;
+    len = min_t(uint64_t, len, size - *ppos);
+    len = min_t(size_t, len, MEM_DEBUG_CHUNK);
+
+    region = mem_debug_region(start + *ppos, len);
+    if (region == REGION_MIXED)
+        return -EINVAL;
+
+    if (region == REGION_INTERSECTS) {
+        virt = memremap(start + *ppos, len, MEMREMAP_WB);
+        if (virt == NULL)
+            return -EIO;
+        if (copy_to_user(buf, virt, len)) {
+            memunmap(virt);
+            return -EFAULT;
+        }
+        memunmap(virt);
+    } else {
+        // Anything but RAM is read uncached a page at a time through a bounce buffer
+        len = min_t(size_t, len, PAGE_SIZE - ((start + *ppos) & ~PAGE_MASK));
+        virt = kmalloc(len, GFP_KERNEL);
+        if (virt == NULL)
+            return -ENOMEM;
+        io = ioremap(start + *ppos, len);
+        if (io == NULL) {
+            kfree(virt);
+            return -EIO;
+        }
+        memcpy_fromio(virt, io, len);
+        iounmap(io);
+        if (copy_to_user(buf, virt, len)) {
+            kfree(virt);
+            return -EFAULT;
+        }
+        kfree(virt);
+    }
+
+    *ppos += len;
+    return len;
+}
+
+// Map the window into user space, the mmap offset is relative to physical_start_address
+static int mem_debug_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    uint64_t start = READ_ONCE(physical_start_address);
+    uint64_t size = READ_ONCE(range_size);
+    uint64_t offset = (uint64_t)vma->vm_pgoff << PAGE_SHIFT;
+    uint64_t len = vma->vm_end - vma->vm_start;
+
+    if (start & ~PAGE_MASK)
+        return -EINVAL;
+    if (offset >= size || len > size - offset)
+        return -EINVAL;
+
+    // Only system RAM is mapped cached
+    switch (mem_debug_region(start + offset, len)) {
+        case REGION_INTERSECTS:
+            break;
+        case REGION_DISJOINT:
+            vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    return remap_pfn_range(vma, vma->vm_start, (start + offset) >> PAGE_SHIFT, len, vma->vm_page_prot);
+}
+
+static long mem_debug_verify_range(struct mem_debug_verify *request, uint64_t *failures)
+{
+    uint64_t offset, len, phys, index;
+    uint64_t *data;
+    ktime_t start_time = ktime_get();
+
+    request->seed = pattern_seed;
+    for (offset = 0; offset < request->size; offset += len) {
+        len = min_t(uint64_t, MEM_DEBUG_CHUNK, request->size - offset);
+        data = memremap(request->phys_start + offset, len, MEMREMAP_WB);
+        if (data == NULL) {
+            printk(KERN_INFO "Failed to map physical_address: 0x%016llx for verify\n", request->phys_start + offset);
+            return -EIO;
+        }
+
+        phys = request->phys_start + offset;
+        for (index = 0; index < len / 8; index++, phys += 8) {
+            if (likely(data[index] == mem_debug_pattern(phys)))
+                continue;
+            if (request->nr_failures < request->max_failures)
+                failures[request->nr_failures++] = phys;
+            request->mismatches++;
+        }
+        memunmap(data);
+
+        if (fatal_signal_pending(current))
+            return -EINTR;
+        cond_resched();
+    }
+    request->elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), start_time));
+
+    return 0;
+}
+
+static long mem_debug_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct mem_debug_verify request;
+    uint64_t *failures = NULL;
+    long ret;
+
+    if (cmd != MEM_DEBUG_IOC_VERIFY)
+        return -ENOTTY;
+    if (copy_from_user(&request, (void __user *)arg, sizeof(request)))
+        return -EFAULT;
+
+    if (request.phys_start == 0 && request.size == 0) {
+        request.phys_start = READ_ONCE(physical_start_address);
+        request.size = READ_ONCE(range_size);
+    }
+    if ((request.phys_start | request.size) & 0x7)
+        return -EINVAL;
+    // Mapped write-back like the writers map it, which includes soft reserved or devdax CXL windows
+    if (request.size && mem_debug_region(request.phys_start, request.size) == REGION_MIXED)
+        return -EINVAL;
+    request.max_failures = min_t(uint32_t, request.max_failures, MEM_DEBUG_MAX_FAILURES);
+    request.nr_failures = 0;
+    request.mismatches = 0;
+
+    if (request.max_failures) {
+        failures = kmalloc_array(request.max_failures, sizeof(*failures), GFP_KERNEL);
+        if (failures == NULL)
+            return -ENOMEM;
+    }
+
+    ret = mem_debug_verify_range(&request, failures);
+    if (ret == 0 && request.nr_failures &&
+        copy_to_user(u64_to_user_ptr(request.failures), failures, request.nr_failures * sizeof(*failures)))
+        ret = -EFAULT;
+    if (ret == 0 && copy_to_user((void __user *)arg, &request, sizeof(request)))
+        ret = -EFAULT;
+
+    kfree(failures);
+    return ret;
+}
+
+static const struct file_operations mem_debug_fops = {
+    .owner          = THIS_MODULE,
+    .open           = mem_debug_open,
+    .read           = mem_debug_read,
+    .mmap           = mem_debug_mmap,
+    .unlocked_ioctl = mem_debug_ioctl,
+    .llseek         = no_seek_end_llseek,
+};
+
+static struct miscdevice mem_debug_device = {
+    .minor  = MISC_DYNAMIC_MINOR,
+    .name   = MEM_DEBUG_DEVICE_NAME,
+    .fops   = &mem_debug_fops,
+};
+
 // Define mem_debug sysfs attributes
 static struct kobj_attribute physical_start_address_attribute =
     __ATTR(physical_start_address, S_IRUGO | S_IWUSR, physical_start_address_show, physical_start_address_store);
@@ -124,10 +822,38 @@ static struct kobj_attribute mem_write_request_attribute =
 static struct kobj_attribute mem_dump_attribute =
     __ATTR(mem_dump, S_IRUGO | S_IWUSR, mem_dump_show, NULL);
 
+static struct kobj_attribute range_size_attribute =
+    __ATTR(range_size, S_IRUGO | S_IWUSR, range_size_show, range_size_store);
+
+static struct kobj_attribute nr_writers_attribute =
+    __ATTR(nr_writers, S_IRUGO | S_IWUSR, nr_writers_show, nr_writers_store);
+
+static struct kobj_attribute pace_us_attribute =
+    __ATTR(pace_us, S_IRUGO | S_IWUSR, pace_us_show, pace_us_store);
+
+static struct kobj_attribute flush_method_attribute =
+    __ATTR(flush_method, S_IRUGO | S_IWUSR, flush_method_show, flush_method_store);
+
+static struct kobj_attribute pattern_seed_attribute =
+    __ATTR(pattern_seed, S_IRUGO | S_IWUSR, pattern_seed_show, pattern_seed_store);
+
+static struct kobj_attribute mem_write_job_attribute =
+    __ATTR(mem_write_job, S_IRUGO | S_IWUSR, mem_write_job_show, mem_write_job_store);
+
+static struct kobj_attribute writer_stats_attribute =
+    __ATTR(writer_stats, S_IRUGO, writer_stats_show, NULL);
+
 static struct attribute *attrs[] = {
     &physical_start_address_attribute.attr,
     &mem_write_request_attribute.attr,
     &mem_dump_attribute.attr,
+    &range_size_attribute.attr,
+    &nr_writers_attribute.attr,
+    &pace_us_attribute.attr,
+    &flush_method_attribute.attr,
+    &pattern_seed_attribute.attr,
+    &mem_write_job_attribute.attr,
+    &writer_stats_attribute.attr,
     NULL,
 };
 
@@ -143,6 +869,8 @@ static int __init mem_debug_init(void)
 
     printk(KERN_INFO "Loading kernel module mem_debug\n");
 
+    pattern_seed = get_random_u64();
+
     kobj_mem_debug = kobject_create_and_add("mem_debug", kernel_kobj);
     if (!kobj_mem_debug) {
         printk(KERN_INFO "Failed to create kernel object for mem_debug module\n");
@@ -155,6 +883,13 @@ static int __init mem_debug_init(void)
         return -1;
     }
 
+    ret = misc_register(&mem_debug_device);
+    if (ret) {
+        printk(KERN_INFO "Failed to register /dev/%s for mem_debug module\n", MEM_DEBUG_DEVICE_NAME);
+        kobject_put(kobj_mem_debug);
+        return ret;
+    }
+
     printk(KERN_INFO "Kernel module mem_debug was loaded successfully\n");
 
     return 0;
@@ -165,6 +900,12 @@ static void __exit mem_debug_exit(void)
 {
     printk(KERN_INFO "Trying to remove kernel module mem_debug\n");
 
+    misc_deregister(&mem_debug_device);
+
+    mutex_lock(&mem_writers_lock);
+    mem_writers_stop();
+    mutex_unlock(&mem_writers_lock);
+
     kobject_put(kobj_mem_debug);
 
     printk(KERN_INFO "Kernel module mem_debug was removed successfully\n");
@@ -0,0 +1,27 @@
+#ifndef MEM_DEBUG_IOCTL_H
+#define MEM_DEBUG_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// Character device exposing the window [physical_start_address, +range_size)
+#define MEM_DEBUG_DEVICE_NAME   "mem_debug"
+#define MEM_DEBUG_MAX_FAILURES  4096
+
+// Verify [phys_start, phys_start + size) against the pattern written by mem_write,
+// phys_start = size = 0 selects the configured window
+struct mem_debug_verify {
+    __u64 phys_start;       // in: physical start address, 8 bytes aligned
+    __u64 size;             // in: bytes to verify, multiple of 8
+    __u64 failures;         // in: user pointer to an array of max_failures __u64
+    __u32 max_failures;     // in: at most MEM_DEBUG_MAX_FAILURES addresses are reported
+    __u32 nr_failures;      // out: failing addresses stored in failures
+    __u64 mismatches;       // out: total number of mismatching qwords
+    __u64 seed;             // out: pattern seed the range was verified against
+    __u64 elapsed_ns;       // out: time spent verifying
+};
+
+#define MEM_DEBUG_IOC_MAGIC     'm'
+#define MEM_DEBUG_IOC_VERIFY    _IOWR(MEM_DEBUG_IOC_MAGIC, 1, struct mem_debug_verify)
+
+#endif
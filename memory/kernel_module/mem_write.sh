@@ -1,11 +1,12 @@
-phys_addr=0x1100000000
-index=0
-max=100
+# Start 100 writers 0x8000 apart with a single request, released together and
+# stopped together after duration_ms, then print per-writer and aggregate stats
+base=0x1100008000
+stride=0x8000
+size=0x1000
+count=100
+cpus=`cat /sys/devices/system/cpu/online`
+duration_ms=10000
 
-while [ $index -le $max ]
-do
-    let phys_addr=$phys_addr+0x8000
-    let index+=1
-    `echo "obase=16;$phys_addr"|bc > /sys/kernel/mem_debug/physical_start_address`
-    `echo 1 > /sys/kernel/mem_debug/mem_write_request`
-done
\ No newline at end of file
+echo "base=$base stride=$stride count=$count size=$size cpus=$cpus duration_ms=$duration_ms" > /sys/kernel/mem_debug/mem_write_job
+sleep `echo "$duration_ms/1000 + 1"|bc`
+cat /sys/kernel/mem_debug/writer_stats
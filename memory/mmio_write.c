@@ -7,50 +7,206 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MMIO_PATCH_MAGIC      0x4d4d5054   /* "MMPT" */
+#define MMIO_PATCH_VERSION    1
 
 typedef struct mmio_region {
     uint64_t start_addr;
     uint64_t end_addr;
 } mmio_region_t;
 
-#define __get_unaligned_t(type, ptr) ({                                                     \
-    const struct __attribute__ ((__packed__)) { type x; } *__pptr = (typeof(__pptr))(ptr);  \
-    __pptr->x;                                                                              \
-})
+/*
+ * Patch file layout: one mmio_patch_header_t followed by num_entries
+ * mmio_patch_entry_t, all little endian. Each entry is a single aligned
+ * store of 'width' bytes at 'offset' within the region.
+ */
+typedef struct mmio_patch_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t region_id;
+    uint32_t num_entries;
+} mmio_patch_header_t;
 
-#define get_unaligned(ptr)  __get_unaligned_t(typeof(*(ptr)), (ptr))
+typedef struct mmio_patch_entry {
+    uint32_t offset;
+    uint32_t width;
+    uint64_t value;
+} mmio_patch_entry_t;
 
 static uint32_t region_id = 0;
+static int region_id_set = 0;
 static char *default_bdf = "0000:00:00.0";
 static char *actual_bdf = NULL;
 static char *mmio_reg_bin = NULL;
 static char *mmio_reg_bin_bak = "tpmi_dump.bin.bak";
+static char *patch_in = NULL;
+static char *patch_out = NULL;
+static uint32_t write_width = 4;
+static int verify = 0;
 
 static void usage(const char *prog_name) {
-    fprintf(stderr, "Usage: %s [-d BDF] [-r region_id] [-f bin_file] [-b original_file] [-h] \n\n", prog_name);
+    fprintf(stderr, "Usage: %s [-d BDF] [-r region_id] [-f bin_file] [-b original_file] [-w width] [-o patch_file] [-p patch_file] [-v] [-h] \n\n", prog_name);
     fprintf(stderr, "Command Option Description:\n");
-    fprintf(stderr, "       [-d BDF]       BDF format should be 'DDDD:BB:DD.F' which staged under /sys/bus/pci/devices, default: 0000:00:03.1\n");
-    fprintf(stderr, "       [-r region_id] Target region which required to be writen and could be obtained via 'lspci -vvvv -s BDF', default: 0\n");
-    fprintf(stderr, "       [-f bin_file]  BIN file used to overwrite MMIO registers\n");
-    fprintf(stderr, "       [-b bin_file]  The original bin file\n");
-    fprintf(stderr, "       [-h]           Print command usage\n");
+    fprintf(stderr, "       [-d BDF]        BDF format should be 'DDDD:BB:DD.F' which staged under /sys/bus/pci/devices, default: 0000:00:03.1\n");
+    fprintf(stderr, "       [-r region_id]  Target region which required to be writen and could be obtained via 'lspci -vvvv -s BDF', default: 0\n");
+    fprintf(stderr, "       [-f bin_file]   BIN file used to overwrite MMIO registers\n");
+    fprintf(stderr, "       [-b bin_file]   The original bin file\n");
+    fprintf(stderr, "       [-w width]      Register width in bytes (4 or 8) used for the diff and the stores, default: 4\n");
+    fprintf(stderr, "       [-o patch_file] Save the diff of -f/-b as a patch file instead of writing it\n");
+    fprintf(stderr, "       [-p patch_file] Apply a patch file saved with -o, -f/-b are not needed\n");
+    fprintf(stderr, "       [-v]            Read every written register back and report mismatches\n");
+    fprintf(stderr, "       [-h]            Print command usage\n");
 }
 
-static uint32_t get_mmio_bin_size(char *file_path)
+static unsigned char *load_mmio_bin(const char *file_path, uint32_t *size)
 {
-    uint32_t size = 0;
+    unsigned char *buf;
     FILE *fp = fopen(file_path, "rb");
 
     if (fp == NULL) {
-        fprintf(stderr, "ERROR: Couldn't open %s due to \"%s\"\n", mmio_reg_bin, strerror(errno));
-        return 0;
+        fprintf(stderr, "ERROR: Couldn't open %s due to \"%s\"\n", file_path, strerror(errno));
+        return NULL;
     }
 
     fseek(fp, 0, SEEK_END);
-    size = ftell(fp);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    printf("INFO: The file size of %s is 0x%x\n", file_path, *size);
+
+    buf = (unsigned char *)malloc(*size ? *size : 1);
+    if (buf == NULL || fread(buf, 1, *size, fp) != *size) {
+        fprintf(stderr, "ERROR: Couldn't read %s\n", file_path);
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    return buf;
+}
+
+/*
+ * Compare the new and original dumps one register (write_width bytes) at a
+ * time and emit one patch entry per changed register, carrying the full new
+ * register value so it can be written with a single store.
+ */
+static mmio_patch_entry_t *build_patch(uint32_t *num_entries)
+{
+    unsigned char *new_bin, *bak_bin;
+    uint32_t new_size, bak_size, size, offset;
+    mmio_patch_entry_t *entries = NULL;
+    uint32_t count = 0;
+    uint64_t value;
+
+    new_bin = load_mmio_bin(mmio_reg_bin, &new_size);
+    bak_bin = load_mmio_bin(mmio_reg_bin_bak, &bak_size);
+    if (new_bin == NULL || bak_bin == NULL)
+        goto exit;
+
+    size = new_size < bak_size ? new_size : bak_size;
+    size &= ~(write_width - 1);
+    entries = (mmio_patch_entry_t *)malloc((size / write_width + 1) * sizeof(*entries));
+    if (entries == NULL)
+        goto exit;
+
+    for (offset = 0; offset < size; offset += write_width) {
+        if (memcmp(new_bin + offset, bak_bin + offset, write_width) == 0)
+            continue;
+        value = 0;
+        memcpy(&value, new_bin + offset, write_width);
+        entries[count].offset = offset;
+        entries[count].width = write_width;
+        entries[count].value = value;
+        count++;
+    }
+    printf("INFO: Found %u changed %u-bit registers\n", count, write_width * 8);
+
+exit:
+    free(new_bin);
+    free(bak_bin);
+    *num_entries = count;
+    return entries;
+}
+
+static int save_patch(const char *file_path, const mmio_patch_entry_t *entries, uint32_t num_entries)
+{
+    mmio_patch_header_t header;
+    FILE *fp = fopen(file_path, "wb");
+
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: Couldn't open %s due to \"%s\"\n", file_path, strerror(errno));
+        return -1;
+    }
+
+    header.magic = MMIO_PATCH_MAGIC;
+    header.version = MMIO_PATCH_VERSION;
+    header.region_id = region_id;
+    header.num_entries = num_entries;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(entries, sizeof(*entries), num_entries, fp) != num_entries) {
+        fprintf(stderr, "ERROR: Couldn't write %s\n", file_path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    printf("INFO: Saved %u patch entries for region %u to %s\n", num_entries, region_id, file_path);
+    return 0;
+}
+
+static mmio_patch_entry_t *load_patch(const char *file_path, uint32_t *num_entries)
+{
+    mmio_patch_header_t header;
+    mmio_patch_entry_t *entries = NULL;
+    struct stat st;
+    uint32_t i;
+    FILE *fp = fopen(file_path, "rb");
+
+    *num_entries = 0;
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: Couldn't open %s due to \"%s\"\n", file_path, strerror(errno));
+        return NULL;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != MMIO_PATCH_MAGIC || header.version != MMIO_PATCH_VERSION) {
+        fprintf(stderr, "ERROR: %s is not a valid MMIO patch file\n", file_path);
+        goto exit;
+    }
+
+    // the entries must fill the rest of the file exactly
+    if (fstat(fileno(fp), &st) != 0 ||
+        (uint64_t)st.st_size != sizeof(header) + (uint64_t)header.num_entries * sizeof(*entries)) {
+        fprintf(stderr, "ERROR: %s size doesn't match its %u patch entries\n", file_path, header.num_entries);
+        goto exit;
+    }
+
+    entries = (mmio_patch_entry_t *)malloc(((size_t)header.num_entries + 1) * sizeof(*entries));
+    if (entries == NULL || fread(entries, sizeof(*entries), header.num_entries, fp) != header.num_entries) {
+        fprintf(stderr, "ERROR: %s is truncated\n", file_path);
+        free(entries);
+        entries = NULL;
+        goto exit;
+    }
+
+    for (i = 0; i < header.num_entries; i++) {
+        if ((entries[i].width != 4 && entries[i].width != 8) || (entries[i].offset & (entries[i].width - 1))) {
+            fprintf(stderr, "ERROR: Patch entry %u has invalid offset 0x%x / width %u\n", i, entries[i].offset, entries[i].width);
+            free(entries);
+            entries = NULL;
+            goto exit;
+        }
+    }
+
+    if (!region_id_set)
+        region_id = header.region_id;
+    else if (region_id != header.region_id)
+        printf("WARNING: Patch was saved for region %u, applying to region %u\n", header.region_id, region_id);
+    *num_entries = header.num_entries;
+    printf("INFO: Loaded %u patch entries from %s\n", *num_entries, file_path);
+
+exit:
     fclose(fp);
-    printf("INFO: The file size of %s is 0x%x\n", file_path, size);
-    return size;
+    return entries;
 }
 
 static uint64_t get_region_size(void)
@@ -83,83 +239,92 @@ static uint64_t get_region_size(void)
     return region_size;
 }
 
-static void mmio_write(void)
+/*
+ * Write each patch entry with one volatile store of its width. Adjacent
+ * entries are only grouped for reporting; every register still sees exactly
+ * one full-width access.
+ */
+static void mmio_write(const mmio_patch_entry_t *entries, uint32_t num_entries)
 {
     char region_path[PATH_MAX];
     uint64_t region_size = 0;
-    uint32_t mmio_bin_size = 0;
-    FILE *fp, *fp1;
+    uint64_t readback;
     int fd;
-    int index = 0;
+    uint32_t index, run_start = 0;
+    uint32_t mismatches = 0;
     char *bdf = actual_bdf != NULL ? actual_bdf : default_bdf;
+    volatile uint8_t *mmio_base;
     void *mmap_base;
 
-    // Read MMIO field changes from MMIO BIN file
-    mmio_bin_size = get_mmio_bin_size(mmio_reg_bin);
-    if (mmio_bin_size == 0)
-    {
-        fprintf(stderr, "ERROR: Failed to get BIN size with %s due to \"%s\"\n", mmio_reg_bin, strerror(errno));
-        return;
-    }
-
-    fp = fopen(mmio_reg_bin, "rb");
-    fp1 = fopen(mmio_reg_bin_bak, "rb");
-    if (fp == NULL || fp1 == NULL) {
-        char *file = (fp == NULL) ? "mmio_reg_bin_bak" : "mmio_reg_bin";
-        fprintf(stderr, "ERROR: Couldn't open %s due to \"%s\"\n", file, strerror(errno));
-        return;
-    }
-    unsigned char *new_mmio_reg_values = (unsigned char *)malloc(mmio_bin_size);
-    unsigned char *mmio_bak_head = (unsigned char *)malloc(mmio_bin_size);
-    unsigned char *mmio_reg_ptr;
-    unsigned char *new_mmio_reg_ptr = new_mmio_reg_values;
-    unsigned char *mmio_bak = mmio_bak_head;
-    fread(new_mmio_reg_ptr, sizeof(unsigned char), mmio_bin_size, fp);
-    fread(mmio_bak, sizeof(unsigned char), mmio_bin_size, fp1);
-    fclose(fp);
-    fclose(fp1);
-
     // Open PCIe device resource to get MMIO region data
     region_size = get_region_size();
+    if (region_size == 0) {
+        printf("ERROR: Region %u not found on %s\n", region_id, bdf);
+        return;
+    }
     snprintf(region_path, sizeof(region_path), "/sys/bus/pci/devices/%s/resource%d", bdf, region_id);
-    fd = open(region_path, O_RDWR);
+    fd = open(region_path, O_RDWR | O_SYNC);
     if (fd < 0) {
         printf("ERROR: Could not open %s due to \"%s\"\n", region_path, strerror(errno));
         return;
     }
 
-    mmap_base = mmap(NULL, region_size, PROT_WRITE, MAP_SHARED, fd, 0);
+    mmap_base = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (mmap_base == MAP_FAILED) {
         printf("ERROR: MMAP failed due to \"%s\"\n", strerror(errno));
-        goto exit;
+        close(fd);
+        return;
     }
+    mmio_base = (volatile uint8_t *)mmap_base;
 
     // Start to overwrite MMIO regs
-    mmio_reg_ptr = (unsigned char *)mmap_base;
-    while (index < region_size && index < mmio_bin_size) {
-        //printf("INFO: Checking REG#0x%08x, OLD_VALUE->0x%02x, NEW_VALUE->0x%02x \n", index, *mmio_reg_ptr, *new_mmio_reg_ptr);
-        if (*mmio_bak != *new_mmio_reg_ptr) {
-            printf("INFO: Try to change REG#0x%08x from 0x%02x to 0x%02x\n", index, *mmio_bak, *new_mmio_reg_ptr);
-            memcpy(mmio_reg_ptr, new_mmio_reg_ptr, 1);
+    for (index = 0; index < num_entries; index++) {
+        const mmio_patch_entry_t *entry = &entries[index];
+
+        if ((uint64_t)entry->offset + entry->width > region_size) {
+            printf("ERROR: REG#0x%08x is outside of the region, stop writing\n", entry->offset);
+            break;
+        }
+
+        if (entry->width == 8)
+            *(volatile uint64_t *)(mmio_base + entry->offset) = entry->value;
+        else
+            *(volatile uint32_t *)(mmio_base + entry->offset) = (uint32_t)entry->value;
+
+        if (verify) {
+            if (entry->width == 8)
+                readback = *(volatile uint64_t *)(mmio_base + entry->offset);
+            else
+                readback = *(volatile uint32_t *)(mmio_base + entry->offset);
+            if (readback != entry->value) {
+                printf("WARNING: REG#0x%08x reads back 0x%lx, expected 0x%lx\n", entry->offset, readback, entry->value);
+                mismatches++;
+            }
+        }
+
+        if (index + 1 == num_entries ||
+            entries[index + 1].offset != entry->offset + entry->width ||
+            entries[index + 1].width != entry->width) {
+            printf("INFO: Wrote REG#0x%08x-0x%08x with %u %u-bit stores\n", entries[run_start].offset,
+                   entry->offset + entry->width - 1, index - run_start + 1, entry->width * 8);
+            run_start = index + 1;
         }
-        index++;
-        mmio_reg_ptr++;
-        new_mmio_reg_ptr++;
-        mmio_bak++;
     }
 
-exit:
+    if (verify)
+        printf("INFO: Read back %u registers, %u mismatched\n", index, mismatches);
+
     munmap(mmap_base, region_size);
     close(fd);
-    free(new_mmio_reg_values);
-    free(mmio_bak_head);
 }
 
 int main(int argc, char *argv[])
 {
     int opt;
     uint32_t domain, bus, dev, func;
-    const char *optstring = "hr:d:f:b:";
+    uint32_t num_entries = 0;
+    mmio_patch_entry_t *entries;
+    const char *optstring = "hr:d:f:b:w:o:p:v";
 
     if (argc < 2) {
         usage(argv[0]);
@@ -180,6 +345,7 @@ int main(int argc, char *argv[])
                 break;
             case 'r':
                 region_id = (uint32_t)strtoul(optarg, NULL, 0);
+                region_id_set = 1;
                 printf("INFO: Get new TPMI_REGION_ID -- %d\n", region_id);
                 break;
             case 'f':
@@ -190,6 +356,23 @@ int main(int argc, char *argv[])
                 mmio_reg_bin_bak = (char *)optarg;
                 printf("INFO: Use %s as the original bin file\n", mmio_reg_bin_bak);
                 break;
+            case 'w':
+                write_width = (uint32_t)strtoul(optarg, NULL, 0);
+                if (write_width != 4 && write_width != 8) {
+                    printf("ERROR: %s - Invalid register width\n", (char *)optarg);
+                    usage(argv[0]);
+                    return 0;
+                }
+                break;
+            case 'o':
+                patch_out = (char *)optarg;
+                break;
+            case 'p':
+                patch_in = (char *)optarg;
+                break;
+            case 'v':
+                verify = 1;
+                break;
             case 'h':
             default:
                 usage(argv[0]);
@@ -197,12 +380,26 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (mmio_reg_bin == NULL || mmio_reg_bin_bak == NULL) {
-        printf("ERROR: Please add MMIO BIN files according to following rules...");
-        usage(argv[0]);
+    if (patch_in != NULL) {
+        entries = load_patch(patch_in, &num_entries);
+    } else {
+        if (mmio_reg_bin == NULL || mmio_reg_bin_bak == NULL) {
+            printf("ERROR: Please add MMIO BIN files according to following rules...\n");
+            usage(argv[0]);
+            return -1;
+        }
+        entries = build_patch(&num_entries);
+    }
+    if (entries == NULL)
+        return -1;
+
+    if (patch_out != NULL) {
+        save_patch(patch_out, entries, num_entries);
+    } else if (num_entries != 0) {
+        mmio_write(entries, num_entries);
     }
 
-    mmio_write();
+    free(entries);
 
     return 0;
 }
@@ -7,10 +7,25 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <sys/mman.h>
-#include <pcre.h>
+#include <sys/stat.h>
+#include <regex.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #define NUM_TPMI_REG 217
 #define NUM_TPMI_PFS 14
+#define MAX_TPMI_INSTANCES 5
+#define MAX_TPMI_DEVICES 32
+
+// PCIe extended capability walk for the Intel TPMI VSEC/DVSEC
+#define PCI_EXT_CAP_START       0x100
+#define PCI_EXT_CAP_ID_VNDR     0x0b
+#define PCI_EXT_CAP_ID_DVSEC    0x23
+#define PCI_VENDOR_ID_INTEL     0x8086
+#define INTEL_VSEC_ID_TPMI      0x42
+#define INTEL_DVSEC_TABLE       0xc
 
 typedef struct {
     uint64_t start_addr;
@@ -23,6 +38,12 @@ typedef struct {
     uint64_t register_offset;
 } tpmi_instance_t;
 
+// TPMI registers as seen through a live resourceN mapping or a mapped dump file
+typedef struct {
+    const volatile uint8_t *base;
+    uint64_t size;
+} tpmi_view_t;
+
 typedef struct {
     char name[50];
     uint64_t tpmi_id;
@@ -35,28 +56,162 @@ typedef struct {
     uint64_t tpmi_id;
     uint64_t entry_num;
     uint64_t entry_size;
+    char feature[16];
 } tpmi_pfs_t;
 
+// Named bit field of a TPMI reg, decoded in structured outputs
+typedef struct {
+    char reg[50];
+    char name[30];
+    uint32_t msb;
+    uint32_t lsb;
+} tpmi_field_t;
+
+// Binary snapshot: one header followed by num_records records, appended per run
+#define TPMI_BIN_MAGIC      0x524d5054  /* "TPMR" */
+#define TPMI_BIN_VERSION    2   /* 2: die_id in the records */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t timestamp_ns;
+    uint32_t num_records;
+    uint32_t reserved;
+} tpmi_bin_header_t;
+
+typedef struct {
+    uint16_t socket_id;
+    uint16_t reg;
+    uint16_t tpmi_id;
+    uint16_t instance_id;
+    uint32_t address;
+    uint32_t die_id;
+    uint64_t value;
+} tpmi_bin_record_t;
+
+typedef enum {
+    TPMI_FORMAT_TEXT,
+    TPMI_FORMAT_JSON,
+    TPMI_FORMAT_CSV,
+    TPMI_FORMAT_BIN,
+} tpmi_format_t;
+
+// Instance id and 4 * entry_size slot of each PFS entry, by entry_num
+typedef struct {
+    uint64_t entry_num;
+    uint64_t id[MAX_TPMI_INSTANCES];
+    uint64_t slot[MAX_TPMI_INSTANCES];
+} tpmi_layout_t;
+
+typedef struct {
+    int reg;
+    uint64_t instance_id;
+    uint64_t address;
+    uint64_t value;
+} tpmi_record_t;
+
+// One TPMI PCI function, its mapping and the regs decoded from it
+typedef struct {
+    char bdf[16];
+    uint32_t region_id;
+    uint32_t table_offset;
+    int64_t socket_id;
+    int die_id;
+    tpmi_view_t view;
+    tpmi_record_t *records;
+    int num_records;
+} tpmi_device_t;
+
+// One watched register instance, with running statistics of its field
+typedef struct {
+    const tpmi_device_t *dev;
+    int reg;
+    uint64_t instance_id;
+    uint64_t address;
+    uint64_t last;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} tpmi_watch_t;
+
+// Per-register lookup results, resolved once before parsing
+typedef struct {
+    const tpmi_pfs_t *pfs;
+    uint32_t pp_level;
+    uint32_t selected;
+    int field_first;
+    int field_count;
+} tpmi_reg_index_t;
+
 static uint32_t tpmi_region_id = 1;
 static char *tpmi_default_bdf = "0000:00:03.1";
-static char *tpmi_dump_file = "tpmi_dump.bin";
+static char *tpmi_dump_file = NULL;
+static char *tpmi_input_file = NULL;
+static char *tpmi_report_file = NULL;
 static char *tpmi_actual_bdf = NULL;
+static char *tpmi_reg_pattern = NULL;
+static int64_t tpmi_id_filter = -1;
+static int64_t tpmi_instance_filter = -1;
+static uint32_t tpmi_watch_interval_ms = 0;
+static uint64_t tpmi_watch_samples = 0;
+static uint32_t tpmi_field_msb = 63;
+static uint32_t tpmi_field_lsb = 0;
+static volatile sig_atomic_t tpmi_watch_stop = 0;
+static tpmi_format_t tpmi_format = TPMI_FORMAT_TEXT;
+static FILE *tpmi_out = NULL;
+static tpmi_reg_index_t TPMI_REG_INDEX[NUM_TPMI_REG];
+static tpmi_device_t tpmi_devices[MAX_TPMI_DEVICES];
+static int num_tpmi_devices = 0;
+static const tpmi_layout_t TPMI_LAYOUT_MAP[] = {
+    //ENTRY_NUM     INSTANCE_ID             SLOT
+    {1,             {0},                    {0}},
+    {2,             {1, 2},                 {0, 1}},
+    {3,             {1, 2, 3},              {0, 1, 2}},
+    {5,             {0, 1, 2, 3, 4},        {4, 0, 1, 2, 3}},
+};
 static tpmi_pfs_t TPMI_PFS_MAP[NUM_TPMI_PFS] = {
-    //TPMI_ID           ENTRY_NUM           ENTRY_SIZE
-    {0x0,               1,                  96},
-    {0x1,               5,                  10},
-    {0x2,               5,                  12},
-    {0x3,               2,                  6},
-    {0x4,               1,                  20},
-    {0x5,               5,                  254},
-    {0xa,               5,                  10},
-    {0x6,               1,                  6},
-    {0xc,               5,                  10},
-    {0xd,               1,                  6},
-    {0x81,              1,                  4},
-    {0xfd,              5,                  291},
-    {0xfe,              3,                  291},
-    {0xff,              1,                  291},
+    //TPMI_ID           ENTRY_NUM           ENTRY_SIZE          FEATURE
+    {0x0,               1,                  96,                 "RAPL"},
+    {0x1,               5,                  10,                 "PEM"},
+    {0x2,               5,                  12,                 "UFS"},
+    {0x3,               2,                  6,                  "PMAX"},
+    {0x4,               1,                  20,                 "DRC"},
+    {0x5,               5,                  254,                "SST"},
+    {0xa,               5,                  10,                 "FHM"},
+    {0x6,               1,                  6,                  "MISC_CTRL"},
+    {0xc,               5,                  10,                 "PLR"},
+    {0xd,               1,                  6,                  "BMC_CTL"},
+    {0x81,              1,                  4,                  "TPMI_INFO"},
+    {0xfd,              5,                  291,                "TPMI_0xFD"},
+    {0xfe,              3,                  291,                "TPMI_0xFE"},
+    {0xff,              1,                  291,                "TPMI_0xFF"},
+};
+
+// Entries of one reg must be adjacent
+static const tpmi_field_t TPMI_FIELD_MAP[] = {
+    //REG_NAME                          FIELD_NAME                  MSB     LSB
+    {"UFS_HEADER",                      "INTERFACE_VERSION",        7,      0},
+    {"UFS_HEADER",                      "LOCAL_FABRIC_CLUSTER_ID",  15,     8},
+    {"UFS_STATUS",                      "CURRENT_RATIO",            6,      0},
+    {"UFS_CONTROL",                     "MAX_RATIO",                14,     8},
+    {"UFS_CONTROL",                     "MIN_RATIO",                21,     15},
+    {"SST_HEADER",                      "INTERFACE_VERSION",        7,      0},
+    {"SST_HEADER",                      "CAP_MASK",                 15,     8},
+    {"SST_HEADER",                      "CP_OFFSET",                23,     16},
+    {"SST_HEADER",                      "PP_OFFSET",                31,     24},
+    {"SST_PP_OFFSET_0",                 "PP_OFFSET",                7,      0},
+    {"SST_PP_OFFSET_0",                 "BF_OFFSET",                15,     8},
+    {"SST_PP_OFFSET_0",                 "TF_OFFSET",                23,     16},
+    {"SST_PP_OFFSET_1",                 "PP0_OFFSET",               7,      0},
+    {"SST_PP_OFFSET_1",                 "PP1_OFFSET",               15,     8},
+    {"SST_PP_OFFSET_1",                 "PP2_OFFSET",               23,     16},
+    {"SST_PP_OFFSET_1",                 "PP3_OFFSET",               31,     24},
+    {"SST_PP_OFFSET_1",                 "PP4_OFFSET",               39,     32},
+    {"TPMI_BUS_INFO",                   "FUNCTION",                 2,      0},
+    {"TPMI_BUS_INFO",                   "DEVICE",                   7,      3},
+    {"TPMI_BUS_INFO",                   "BUS",                      15,     8},
+    {"TPMI_BUS_INFO",                   "PACKAGE",                  23,     16},
+    {"TPMI_BUS_INFO",                   "LOCK",                     63,     63},
 };
 
 static tpmi_reg_t TPMI_REG_MAP[NUM_TPMI_REG] = {
@@ -281,351 +436,608 @@ static tpmi_reg_t TPMI_REG_MAP[NUM_TPMI_REG] = {
 };
 
 static void usage(const char *prog_name) {
-    fprintf(stderr, "Usage: %s [-d BDF] [-r region_id] [-h] \n\n", prog_name);
+    fprintf(stderr, "Usage: %s [-d BDF] [-r region_id] [-f dump_file] [-o dump_file] [-t report_file] [-F format] [-i tpmi_id] [-n instance_id] [-p pattern] [-w interval_ms] [-c samples] [-b msb:lsb] [-h] \n\n", prog_name);
     fprintf(stderr, "Command Option Description:\n");
-    fprintf(stderr, "       [-d BDF]       BDF format should be 'DDDD:BB:DD.F' which staged under /sys/bus/pci/devices, default: 0000:00:03.1\n");
+    fprintf(stderr, "       [-d BDF]       BDF format should be 'DDDD:BB:DD.F' which staged under /sys/bus/pci/devices, default: all TPMI devices found\n");
     fprintf(stderr, "       [-r region_id] Use to identify region to stage TPMI regs which showed via 'lspci -vvvv -s TPMI_BDF', default: 1\n");
+    fprintf(stderr, "       [-f dump_file] Parse a previously saved TPMI region dump instead of the live region\n");
+    fprintf(stderr, "       [-o dump_file] Save the raw TPMI region to dump_file\n");
+    fprintf(stderr, "       [-t txt_file]  Also write the TPMI reg list to txt_file, or write the -F output there instead of stdout\n");
+    fprintf(stderr, "       [-F format]    Output format: text, json, csv or bin (appends a snapshot), default: text\n");
+    fprintf(stderr, "       [-i tpmi_id]   Only dump TPMI regs of this TPMI ID\n");
+    fprintf(stderr, "       [-n instance]  Only dump this instance ID\n");
+    fprintf(stderr, "       [-p pattern]   Only dump TPMI regs whose name matches the extended regex pattern\n");
+    fprintf(stderr, "       [-w interval]  Watch the selected TPMI regs every interval ms and print changes only\n");
+    fprintf(stderr, "       [-c samples]   Stop watching after this many samples, default: until Ctrl-C\n");
+    fprintf(stderr, "       [-b msb:lsb]   Only watch bits msb..lsb of each TPMI reg, default: 63:0\n");
     fprintf(stderr, "       [-h]           Print command usage\n");
 }
 
-void get_tpmi_pfs(uint64_t tpmi_id, tpmi_pfs_t *tpmi_pfs)
+static const tpmi_pfs_t *get_tpmi_pfs(uint64_t tpmi_id)
 {
     int i;
 
     for (i = 0; i < NUM_TPMI_PFS; i++) {
-        if (TPMI_PFS_MAP[i].tpmi_id == tpmi_id) {
-            tpmi_pfs->tpmi_id = TPMI_PFS_MAP[i].tpmi_id;
-            tpmi_pfs->entry_num = TPMI_PFS_MAP[i].entry_num;
-            tpmi_pfs->entry_size = TPMI_PFS_MAP[i].entry_size;
-            return;
-        }
+        if (TPMI_PFS_MAP[i].tpmi_id == tpmi_id)
+            return &TPMI_PFS_MAP[i];
     }
 
+    return NULL;
 }
 
-void region_dump(mmio_region_t *mmio_region)
+/*
+ * Resolve the PFS entry, SST perf level ("PPn_" name prefix) and the user
+ * filter of every TPMI reg once, so that parsing is plain table lookups.
+ */
+static int build_tpmi_reg_index(void)
 {
-    int fd;
-    void *mmap_base;
-    FILE *fp;
-    char region_path[PATH_MAX];
-    uint64_t region_size = mmio_region->end_addr - mmio_region->start_addr + 1;
-    char *tpmi_bdf = tpmi_actual_bdf != NULL ? tpmi_actual_bdf : tpmi_default_bdf;
+    regex_t re;
+    char errbuf[128];
+    const char *name;
+    int i, j, rc;
 
-    snprintf(region_path, sizeof(region_path), "/sys/bus/pci/devices/%s/resource%d", tpmi_bdf, tpmi_region_id);
-    fd = open(region_path, O_RDWR);
-    if (fd < 0) {
-        printf("ERROR: Could not open %s due to \"%s\"\n", region_path, strerror(errno));
-        return;
+    if (tpmi_reg_pattern != NULL) {
+        rc = regcomp(&re, tpmi_reg_pattern, REG_EXTENDED | REG_NOSUB);
+        if (rc != 0) {
+            regerror(rc, &re, errbuf, sizeof(errbuf));
+            printf("ERROR: Invalid pattern \"%s\": %s\n", tpmi_reg_pattern, errbuf);
+            return -1;
+        }
     }
 
-    mmap_base = mmap(NULL, region_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (mmap_base == MAP_FAILED) {
-        printf("ERROR: MMAP failed due to \"%s\"\n", strerror(errno));
-        goto exit;
+    for (i = 0; i < NUM_TPMI_REG; i++) {
+        name = TPMI_REG_MAP[i].name;
+        TPMI_REG_INDEX[i].pfs = get_tpmi_pfs(TPMI_REG_MAP[i].tpmi_id);
+        TPMI_REG_INDEX[i].pp_level = 0;
+        if (name[0] == 'P' && name[1] == 'P' && name[2] >= '1' && name[2] <= '4' && name[3] == '_')
+            TPMI_REG_INDEX[i].pp_level = name[2] - '0';
+        TPMI_REG_INDEX[i].field_first = 0;
+        TPMI_REG_INDEX[i].field_count = 0;
+        for (j = 0; j < sizeof(TPMI_FIELD_MAP) / sizeof(TPMI_FIELD_MAP[0]); j++) {
+            if (strcmp(TPMI_FIELD_MAP[j].reg, name) != 0)
+                continue;
+            if (TPMI_REG_INDEX[i].field_count == 0)
+                TPMI_REG_INDEX[i].field_first = j;
+            TPMI_REG_INDEX[i].field_count++;
+        }
+        TPMI_REG_INDEX[i].selected = (tpmi_id_filter < 0 || TPMI_REG_MAP[i].tpmi_id == (uint64_t)tpmi_id_filter) &&
+                                     (tpmi_reg_pattern == NULL || regexec(&re, name, 0, NULL, 0) == 0);
     }
 
-    fp = fopen(tpmi_dump_file, "wb+");
-    if (fp == NULL) {
-        fprintf(stderr, "ERROR: Couldn't open %s due to \"%s\"\n", tpmi_dump_file, strerror(errno));
-        goto exit;
+    if (tpmi_reg_pattern != NULL)
+        regfree(&re);
+
+    return 0;
+}
+
+static int tpmi_read64(const tpmi_view_t *view, uint64_t offset, uint64_t *value)
+{
+    if (offset > view->size || view->size - offset < sizeof(uint64_t))
+        return -1;
+
+    *value = *(const volatile uint64_t *)(view->base + offset);
+    return 0;
+}
+
+// Translate the n-th PFS entry of a TPMI ID into its instance id and offset
+static int get_tpmi_instance(const tpmi_pfs_t *tpmi_pfs, uint64_t n, tpmi_instance_t *tpmi_instance)
+{
+    int i;
+
+    tpmi_instance->register_offset = 0x0;
+    for (i = 0; i < sizeof(TPMI_LAYOUT_MAP) / sizeof(TPMI_LAYOUT_MAP[0]); i++) {
+        if (TPMI_LAYOUT_MAP[i].entry_num == tpmi_pfs->entry_num && n < tpmi_pfs->entry_num) {
+            tpmi_instance->id = TPMI_LAYOUT_MAP[i].id[n];
+            tpmi_instance->offset = 4 * tpmi_pfs->entry_size * TPMI_LAYOUT_MAP[i].slot[n];
+            return 0;
+        }
     }
-    fwrite(mmap_base, 1, region_size, fp);
-    fclose(fp);
 
-exit:
-    munmap(mmap_base, region_size);
-    close(fd);
+    printf("ERROR: Invalid TPMI_PFS_ENTRY_NUM - %ld\n", tpmi_pfs->entry_num);
+    return -1;
 }
 
-int pattern_check(const char *pattern, char *content)
+/*
+ * Resolve the register offset of TPMI reg i inside one instance. Only UFS
+ * fabric cluster regs and SST regs are relative to pointers held in the
+ * region, so at most three loads are done per instance.
+ */
+static int get_tpmi_register_offset(const tpmi_device_t *dev, int i, tpmi_instance_t *tpmi_instance)
 {
-    const char *error;
-    int erroffset;
-    pcre *re = pcre_compile(pattern, 0, &error, &erroffset, NULL);
-    if (re == NULL) {
-        printf("PCRE compilation failed at offset %d: %s\n", erroffset, error);
-        return 1;
-    }
-
-    int ovector[30];
-    int rc = pcre_exec(re, NULL, content, strlen(content), 0, 0, ovector, sizeof(ovector));
-    if (rc >= 0) {
-//printf("Match found: '%.*s'\n", ovector[1] - ovector[0], content + ovector[0]);
+    const tpmi_view_t *view = &dev->view;
+    const tpmi_reg_t *reg = &TPMI_REG_MAP[i];
+    uint64_t cap_offset = dev->table_offset + reg->cap_offset;
+    uint64_t ufs_fabric_cluster_offset;
+    uint64_t sst_header, sst_pp_offset_0, sst_pp_offset_1;
+    uint64_t sst_header_sst_cp_offset, sst_header_sst_pp_offset;
+    uint64_t sst_pp_level, sst_feature_offset;
+    uint64_t mask0_7 = 0xFF;
+    uint64_t mask16_23 = 0xFF0000;
+    uint64_t mask24_31 = 0xFF000000;
+
+    tpmi_instance->register_offset = 0x0;
+    if (TPMI_REG_INDEX[i].pfs == NULL || TPMI_REG_INDEX[i].pfs->entry_num != 5)
         return 0;
-    } else if (rc == PCRE_ERROR_NOMATCH) {
-//printf("No match found for pattern: %s.\n", pattern);
-        return 1;
-    } else {
-        printf("PCRE matching error: %d\n", rc);
-        return -1;
+
+    switch (reg->tpmi_id) {
+        case 2:
+            if (reg->sub_id == 0x1) {
+                if (tpmi_read64(view, cap_offset + 0x8 + tpmi_instance->offset, &ufs_fabric_cluster_offset))
+                    return -1;
+                tpmi_instance->register_offset = ufs_fabric_cluster_offset * 8;
+            }
+            break;
+        case 5:
+            if (reg->sub_id < 1 || reg->sub_id > 5)
+                break;
+            if (tpmi_read64(view, cap_offset + tpmi_instance->offset, &sst_header))
+                return -1;
+            sst_header_sst_cp_offset = (sst_header & mask16_23) >> 16;
+            sst_header_sst_pp_offset = (sst_header & mask24_31) >> 24;
+            if (reg->sub_id == 1) {
+                tpmi_instance->register_offset = sst_header_sst_cp_offset * 8;
+                break;
+            }
+            if (reg->sub_id == 2) {
+                tpmi_instance->register_offset = sst_header_sst_pp_offset * 8;
+                break;
+            }
+
+            if (tpmi_read64(view, cap_offset + sst_header_sst_pp_offset * 8 + 0x8 + tpmi_instance->offset, &sst_pp_offset_0) ||
+                tpmi_read64(view, cap_offset + sst_header_sst_pp_offset * 8 + 0x10 + tpmi_instance->offset, &sst_pp_offset_1))
+                return -1;
+            // PP0..PP4 level offsets are packed one byte each, PP/BF/TF feature offsets likewise
+            sst_pp_level = (sst_pp_offset_1 >> (8 * TPMI_REG_INDEX[i].pp_level)) & mask0_7;
+            sst_feature_offset = (sst_pp_offset_0 >> (8 * (reg->sub_id - 3))) & mask0_7;
+            tpmi_instance->register_offset = sst_header_sst_pp_offset * 8 + sst_pp_level * 8 + sst_feature_offset * 8;
+            break;
     }
 
+    return 0;
 }
-void parse_tpmi_dump(mmio_region_t *mmio_region)
+
+/*
+ * Decode the selected regs and instances of one device into dev->records.
+ * Only the regs asked for are loaded from the view.
+ */
+static int collect_tpmi_regs(tpmi_device_t *dev)
 {
-    FILE *fp;
     int i, j;
-    // int fd, s_fd, n_fd;
-    uint64_t tpmi_reg_value;
-    uint64_t region_size = mmio_region->end_addr - mmio_region->start_addr + 1;
-    char tpmi_regs_buffer[region_size];
-    tpmi_pfs_t tpmi_pfs = {0x0, 1, 96};
+    uint64_t address, tpmi_reg_value;
+    const tpmi_pfs_t *tpmi_pfs;
+    tpmi_instance_t tpmi_instance;
 
-    fp = fopen(tpmi_dump_file, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "ERROR: Couldn't open %s due to \"%s\"\n", tpmi_dump_file, strerror(errno));
-        return;
+    dev->num_records = 0;
+    dev->records = (tpmi_record_t *)malloc(NUM_TPMI_REG * MAX_TPMI_INSTANCES * sizeof(tpmi_record_t));
+    if (dev->records == NULL) {
+        printf("ERROR: Couldn't allocate TPMI records for %s\n", dev->bdf);
+        return -1;
     }
-    fread(tpmi_regs_buffer, 1, region_size, fp);
-    fclose(fp);
 
-    // fd = open("tpmi_regs.txt", O_WRONLY | O_CREAT | O_TRUNC);
-    // if (fd < 0) {
-    //     fprintf(stderr, "ERROR: Couldn't open tpmi_regs.txt due to \"%s\"\n", strerror(errno));
-    //     return;
-    // }
-    fp = fopen("tpmi_regs.txt", "w+");
-    if (fp == NULL) {
-        fprintf(stderr, "ERROR: Couldn't open tpmi_regs.txt due to \"%s\"\n", strerror(errno));
-        return;
+    for (i = 0; i < NUM_TPMI_REG; i++) {
+        if (!TPMI_REG_INDEX[i].selected)
+            continue;
+        tpmi_pfs = TPMI_REG_INDEX[i].pfs != NULL ? TPMI_REG_INDEX[i].pfs : &TPMI_PFS_MAP[0];
+
+        for (j = 0; j < tpmi_pfs->entry_num; j++) {
+            // Translate instance id and offset via tpmi_pfs
+            if (get_tpmi_instance(tpmi_pfs, j, &tpmi_instance))
+                return -1;
+            if (tpmi_instance_filter >= 0 && tpmi_instance.id != (uint64_t)tpmi_instance_filter)
+                continue;
+
+            if (get_tpmi_register_offset(dev, i, &tpmi_instance)) {
+                printf("ERROR: %s: Couldn't resolve %s instance %ld\n", dev->bdf, TPMI_REG_MAP[i].name, tpmi_instance.id);
+                continue;
+            }
+            // Capability offsets are relative to the PFS table of the region
+            address = dev->table_offset + TPMI_REG_MAP[i].cap_offset + tpmi_instance.offset + TPMI_REG_MAP[i].tpmi_offset + tpmi_instance.register_offset;
+            if (tpmi_read64(&dev->view, address, &tpmi_reg_value)) {
+                printf("ERROR: %s: %s instance %ld at 0x%lx is outside of the region\n", dev->bdf, TPMI_REG_MAP[i].name, tpmi_instance.id, address);
+                continue;
+            }
+            dev->records[dev->num_records].reg = i;
+            dev->records[dev->num_records].instance_id = tpmi_instance.id;
+            dev->records[dev->num_records].address = address;
+            dev->records[dev->num_records].value = tpmi_reg_value;
+            dev->num_records++;
+        }
     }
 
-    printf("=========================================REG DUMP IN PROGRESS===========================================\n");
-    printf("Please wait for a moment......\n\n");
-    // sleep(1);
-    // s_fd = dup(STDOUT_FILENO);
-    // n_fd = dup2(fd, STDOUT_FILENO);
+    return 0;
+}
+
+static uint64_t tpmi_field_value(const tpmi_field_t *field, uint64_t value)
+{
+    uint32_t width = field->msb - field->lsb + 1;
+
+    value >>= field->lsb;
+    return width >= 64 ? value : value & ((1ULL << width) - 1);
+}
+
+static void print_tpmi_text(FILE *fp)
+{
+    int d, k;
+    const tpmi_device_t *dev;
+    const tpmi_record_t *rec;
+
     printf("============================================TPMI REG LIST===============================================\n");
-    fprintf(fp, "==============================================TPMI REG LIST=============================================\n");
-    printf("Number\t|\t%-*s\t|\t%-*s\t|\tAddress|TPMI_REG_VALUE\n", 30, "TPMI_REG_NAME", 10, "INSTANCE_ID");
-    fprintf(fp, "Number\t|\t%-*s\t|\t%-*s\t|\tAddress|TPMI_REG_VALUE\n", 30, "TPMI_REG_NAME", 10, "INSTANCE_ID");
+    printf("Socket\t|\tDie\t|\tNumber\t|\t%-*s\t|\t%-*s\t|\tAddress|TPMI_REG_VALUE\n", 30, "TPMI_REG_NAME", 10, "INSTANCE_ID");
     printf("--------------------------------------------------------------------------------------------------------\n");
-    fprintf(fp, "--------------------------------------------------------------------------------------------------------\n");
+    if (fp != NULL) {
+        fprintf(fp, "==============================================TPMI REG LIST=============================================\n");
+        fprintf(fp, "Socket\t|\tDie\t|\tNumber\t|\t%-*s\t|\t%-*s\t|\tAddress|TPMI_REG_VALUE\n", 30, "TPMI_REG_NAME", 10, "INSTANCE_ID");
+        fprintf(fp, "--------------------------------------------------------------------------------------------------------\n");
+    }
 
-    for (i = 0; i < NUM_TPMI_REG; i++) {
-        get_tpmi_pfs(TPMI_REG_MAP[i].tpmi_id, &tpmi_pfs);
-
-        // Translate instance id and offset via tpmi_pfs
-        tpmi_instance_t tpmi_instance[tpmi_pfs.entry_num];
-        switch (tpmi_pfs.entry_num) {
-            case 1:
-                tpmi_instance[0].id = 0;
-                tpmi_instance[0].offset = 0x0;
-                tpmi_instance[0].register_offset = 0x0;
-                break;
-            case 2:
-                tpmi_instance[0].id = 1;
-                tpmi_instance[0].offset = 0x0;
-                tpmi_instance[0].register_offset = 0x0;
-                tpmi_instance[1].id = 2;
-                tpmi_instance[1].offset = 4 * tpmi_pfs.entry_size;
-                tpmi_instance[1].register_offset = 0x0;
-                break;
-            case 3:
-                tpmi_instance[0].id = 1;
-                tpmi_instance[0].offset = 0x0;
-                tpmi_instance[0].register_offset = 0x0;
-                tpmi_instance[1].id = 2;
-                tpmi_instance[1].offset = 4 * tpmi_pfs.entry_size;
-                tpmi_instance[1].register_offset = 0x0;
-                tpmi_instance[2].id = 3;
-                tpmi_instance[2].offset = 4 * tpmi_pfs.entry_size * 2;
-                tpmi_instance[2].register_offset = 0x0;
-                break;
-            case 5:
-                tpmi_instance[0].id = 0;
-                tpmi_instance[0].offset = 4 * tpmi_pfs.entry_size * 4;
-                tpmi_instance[0].register_offset = 0x0;
-                tpmi_instance[1].id = 1;
-                tpmi_instance[1].offset = 0x0;
-                tpmi_instance[1].register_offset = 0x0;
-                tpmi_instance[2].id = 2;
-                tpmi_instance[2].offset = 4 * tpmi_pfs.entry_size;
-                tpmi_instance[2].register_offset = 0x0;
-                tpmi_instance[3].id = 3;
-                tpmi_instance[3].offset = 4 * tpmi_pfs.entry_size * 2;
-                tpmi_instance[3].register_offset = 0x0;
-                tpmi_instance[4].id = 4;
-                tpmi_instance[4].offset = 4 * tpmi_pfs.entry_size * 3;
-                tpmi_instance[4].register_offset = 0x0;
-                switch (tpmi_pfs.tpmi_id) {
-                    case 2:
-                        if (TPMI_REG_MAP[i].sub_id == 0x1){
-                            uint64_t ufs_fabric_cluster_offset[5];
-                            for (int n=0; n < 5; n++){
-                                ufs_fabric_cluster_offset[n] = *(uint64_t *)(tpmi_regs_buffer + TPMI_REG_MAP[i].cap_offset + 0x8 + tpmi_instance[n].offset);
-                                tpmi_instance[n].register_offset = ufs_fabric_cluster_offset[n] * 8;
-                            }
-                        }
-                        break;
-                    case 5:
-                        //uint64_t instance[5] = {254*4*4, 0,  254*4, 254*4*2, 254*4*3};
-                        uint64_t sst_header[5];
-                        uint64_t sst_pp_offset_0[5];
-                        uint64_t sst_pp_offset_1[5];
-                        uint64_t sst_header_sst_cp_offset[5];
-                        uint64_t sst_header_sst_pp_offset[5];
-                        uint64_t sst_pp_offset[5];
-                        uint64_t sst_pp_bf_offset[5];
-                        uint64_t sst_pp_tf_offset[5];
-                        uint64_t pp0[5];
-                        uint64_t pp1[5];
-                        uint64_t pp2[5];
-                        uint64_t pp3[5];
-                        uint64_t pp4[5];
-                        uint64_t mask0_7 = 0xFF;
-                        uint64_t mask8_15 = 0xFF00;
-                        uint64_t mask16_23 = 0xFF0000;
-                        uint64_t mask24_31 = 0xFF000000;
-                        uint64_t mask32_39 = 0xFF00000000;
-                        const char *pattern_1 = "PP1_*";
-                        const char *pattern_2 = "PP2_*";
-                        const char *pattern_3 = "PP3_*";
-                        const char *pattern_4 = "PP4_*";
-
-                        for (int n=0; n < 5; n++){
-                            sst_header[n] = *(uint64_t *)(tpmi_regs_buffer + TPMI_REG_MAP[i].cap_offset + tpmi_instance[n].offset);
-                            sst_header_sst_cp_offset[n] = (sst_header[n] & mask16_23) >> 16;
-                            sst_header_sst_pp_offset[n] = (sst_header[n] & mask24_31) >> 24;
-                            sst_pp_offset_0[n] =  *(uint64_t *)(tpmi_regs_buffer + TPMI_REG_MAP[i].cap_offset + sst_header_sst_pp_offset[n]*8 + 0x8 + tpmi_instance[n].offset);
-                            sst_pp_offset_1[n] =  *(uint64_t *)(tpmi_regs_buffer + TPMI_REG_MAP[i].cap_offset + sst_header_sst_pp_offset[n]*8 + 0x10 + tpmi_instance[n].offset);
-                            sst_pp_offset[n] = sst_pp_offset_0[n] & mask0_7;
-                            sst_pp_bf_offset[n] = (sst_pp_offset_0[n] & mask8_15) >> 8;
-                            sst_pp_tf_offset[n] = (sst_pp_offset_0[n] & mask16_23) >> 16;
-                            pp0[n] = (sst_pp_offset_1[n] & mask0_7);
-                            pp1[n] = (sst_pp_offset_1[n] & mask8_15) >> 8;
-                            pp2[n] = (sst_pp_offset_1[n] & mask16_23) >> 16;
-                            pp3[n] = (sst_pp_offset_1[n] & mask24_31) >> 24;
-                            pp4[n] = (sst_pp_offset_1[n] & mask32_39) >> 32;
-                        }
-
-                        if (TPMI_REG_MAP[i].sub_id == 1){
-                            for (int n=0; n < 5; n++){
-                                tpmi_instance[n].register_offset = sst_header_sst_cp_offset[n] * 8;
-                            }
-                        } else if (TPMI_REG_MAP[i].sub_id == 2){
-                            for (int n=0; n < 5; n++){
-                                tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8;
-                            }
-                        } else if (TPMI_REG_MAP[i].sub_id == 3){
-                            for (int n=0; n < 5; n++){
-                                int r = pattern_check(pattern_1, TPMI_REG_MAP[i].name);
-                                if (r == 0){
-                                    tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp1[n] * 8 + sst_pp_offset[n] * 8;
-                                }else{
-                                    int r = pattern_check(pattern_2, TPMI_REG_MAP[i].name);
-                                    if (r == 0){
-                                        tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp2[n] * 8 + sst_pp_offset[n] * 8;
-                                    }else{
-                                        int r = pattern_check(pattern_3, TPMI_REG_MAP[i].name);
-                                        if (r == 0){
-                                            tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp3[n] * 8 + sst_pp_offset[n] * 8;
-                                        }else{
-                                            int r = pattern_check(pattern_4, TPMI_REG_MAP[i].name);
-                                            if (r == 0){
-                                                tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp4[n] * 8 + sst_pp_offset[n] * 8;
-                                            }else{
-                                                tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp0[n] * 8 + sst_pp_offset[n] * 8;
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                        } else if (TPMI_REG_MAP[i].sub_id == 4){
-                            for (int n=0; n < 5; n++){
-                                int r = pattern_check(pattern_1, TPMI_REG_MAP[i].name);
-                                if (r == 0){
-                                    tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp1[n] * 8 + sst_pp_bf_offset[n] * 8;
-                                }else{
-                                    int r = pattern_check(pattern_2, TPMI_REG_MAP[i].name);
-                                    if (r == 0){
-                                        tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp2[n] * 8 + sst_pp_bf_offset[n] * 8;
-                                    }else{
-                                        int r = pattern_check(pattern_3, TPMI_REG_MAP[i].name);
-                                        if (r == 0){
-                                            tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp3[n] * 8 + sst_pp_bf_offset[n] * 8;
-                                        }else{
-                                            int r = pattern_check(pattern_4, TPMI_REG_MAP[i].name);
-                                            if (r == 0){
-                                                tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp4[n] * 8 + sst_pp_bf_offset[n] * 8;
-                                            }else{
-                                                tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp0[n] * 8 + sst_pp_bf_offset[n] * 8;
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                        } else if (TPMI_REG_MAP[i].sub_id == 5){
-                            for (int n=0; n < 5; n++){
-                                int r = pattern_check(pattern_1, TPMI_REG_MAP[i].name);
-                                if (r == 0){
-                                    tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp1[n] * 8 + sst_pp_tf_offset[n] * 8;
-                                }else{
-                                    int r = pattern_check(pattern_2, TPMI_REG_MAP[i].name);
-                                    if (r == 0){
-                                        tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp2[n] * 8 + sst_pp_tf_offset[n] * 8;
-                                    }else{
-                                        int r = pattern_check(pattern_3, TPMI_REG_MAP[i].name);
-                                        if (r == 0){
-                                            tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp3[n] * 8 + sst_pp_tf_offset[n] * 8;
-                                        }else{
-                                            int r = pattern_check(pattern_4, TPMI_REG_MAP[i].name);
-                                            if (r == 0){
-                                                tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp4[n] * 8 + sst_pp_tf_offset[n] * 8;
-                                            }else{
-                                                tpmi_instance[n].register_offset = sst_header_sst_pp_offset[n] * 8 + pp0[n] * 8 + sst_pp_tf_offset[n] * 8;
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                        break;
+    for (d = 0; d < num_tpmi_devices; d++) {
+        dev = &tpmi_devices[d];
+        for (k = 0; k < dev->num_records; k++) {
+            rec = &dev->records[k];
+            printf("%ld\t|\t%d\t|\t%d\t|\t%-*s\t|\t%-*ld\t|\t0x%lx|\t0x%lx\n", dev->socket_id, dev->die_id, rec->reg, 30, TPMI_REG_MAP[rec->reg].name,
+                   10, rec->instance_id, rec->address, rec->value);
+            printf("--------------------------------------------------------------------------------------------------------\n");
+            if (fp != NULL) {
+                fprintf(fp, "%ld\t|\t%d\t|\t%d\t\t|\t%-*s\t|\t%-*ld\t|\t0x%lx|\t0x%lx\n", dev->socket_id, dev->die_id, rec->reg, 30, TPMI_REG_MAP[rec->reg].name,
+                        10, rec->instance_id, rec->address, rec->value);
+                fprintf(fp, "--------------------------------------------------------------------------------------------------------\n");
+            }
+        }
+    }
+    printf("=================================================END====================================================\n");
+}
+
+static void print_tpmi_csv(FILE *fp)
+{
+    int d, k, f;
+    const tpmi_device_t *dev;
+    const tpmi_record_t *rec;
+    const tpmi_reg_index_t *index;
+    const tpmi_field_t *field;
+
+    fprintf(fp, "socket,die,bdf,feature,tpmi_id,instance,register,field,address,value\n");
+    for (d = 0; d < num_tpmi_devices; d++) {
+        dev = &tpmi_devices[d];
+        for (k = 0; k < dev->num_records; k++) {
+            rec = &dev->records[k];
+            index = &TPMI_REG_INDEX[rec->reg];
+            fprintf(fp, "%ld,%d,%s,%s,0x%lx,%ld,%s,,0x%lx,0x%lx\n", dev->socket_id, dev->die_id, dev->bdf,
+                    index->pfs != NULL ? index->pfs->feature : "", TPMI_REG_MAP[rec->reg].tpmi_id,
+                    rec->instance_id, TPMI_REG_MAP[rec->reg].name, rec->address, rec->value);
+            for (f = 0; f < index->field_count; f++) {
+                field = &TPMI_FIELD_MAP[index->field_first + f];
+                fprintf(fp, "%ld,%d,%s,%s,0x%lx,%ld,%s,%s,0x%lx,0x%lx\n", dev->socket_id, dev->die_id, dev->bdf,
+                        index->pfs != NULL ? index->pfs->feature : "", TPMI_REG_MAP[rec->reg].tpmi_id,
+                        rec->instance_id, TPMI_REG_MAP[rec->reg].name, field->name, rec->address,
+                        tpmi_field_value(field, rec->value));
+            }
+        }
+    }
+}
+
+/*
+ * socket -> feature -> instance -> register -> field. Records are grouped
+ * by walking the PFS map and the instance ids present for each feature.
+ */
+static void print_tpmi_json(FILE *fp)
+{
+    int d, p, k, f, n;
+    int first_feature, first_instance, first_reg;
+    uint64_t instance_id;
+    const tpmi_device_t *dev;
+    const tpmi_record_t *rec;
+    const tpmi_reg_index_t *index;
+    const tpmi_field_t *field;
+
+    fprintf(fp, "{\"sockets\": [");
+    for (d = 0; d < num_tpmi_devices; d++) {
+        dev = &tpmi_devices[d];
+        fprintf(fp, "%s\n  {\"socket\": %ld, \"die\": %d, \"bdf\": \"%s\", \"features\": [", d ? "," : "", dev->socket_id, dev->die_id, dev->bdf);
+        first_feature = 1;
+        for (p = 0; p < NUM_TPMI_PFS; p++) {
+            first_instance = 1;
+            for (n = 0; n < MAX_TPMI_INSTANCES; n++) {
+                instance_id = n;
+                first_reg = 1;
+                for (k = 0; k < dev->num_records; k++) {
+                    rec = &dev->records[k];
+                    index = &TPMI_REG_INDEX[rec->reg];
+                    if (index->pfs != &TPMI_PFS_MAP[p] || rec->instance_id != instance_id)
+                        continue;
+                    if (first_instance) {
+                        fprintf(fp, "%s\n    {\"feature\": \"%s\", \"tpmi_id\": %lu, \"instances\": [", first_feature ? "" : ",",
+                                TPMI_PFS_MAP[p].feature, TPMI_PFS_MAP[p].tpmi_id);
+                        first_feature = 0;
+                    }
+                    if (first_reg) {
+                        fprintf(fp, "%s\n      {\"instance\": %lu, \"registers\": [", first_instance ? "" : ",", instance_id);
+                        first_instance = 0;
+                    }
+                    fprintf(fp, "%s\n        {\"name\": \"%s\", \"address\": \"0x%016lx\", \"value\": \"0x%016lx\", \"fields\": {",
+                            first_reg ? "" : ",", TPMI_REG_MAP[rec->reg].name, rec->address, rec->value);
+                    first_reg = 0;
+                    for (f = 0; f < index->field_count; f++) {
+                        field = &TPMI_FIELD_MAP[index->field_first + f];
+                        fprintf(fp, "%s\"%s\": \"0x%lx\"", f ? ", " : "", field->name, tpmi_field_value(field, rec->value));
+                    }
+                    fprintf(fp, "}}");
                 }
-                break;
-            default:
-                printf("ERROR: Invalid TPMI_PFS_ENTRY_NUM - %ld\n", tpmi_pfs.entry_num);
-                return;
+                if (!first_reg)
+                    fprintf(fp, "]}");
+            }
+            if (!first_instance)
+                fprintf(fp, "]}");
         }
+        fprintf(fp, "]}");
+    }
+    fprintf(fp, "\n]}\n");
+}
 
-        for (j = 0; j < tpmi_pfs.entry_num; j ++) {
-            // printf("%lx, %lx, %lx\n", TPMI_REG_MAP[i].tpmi_id, tpmi_instance[j].id, tpmi_instance[j].offset);
-            uint64_t address = (uint64_t)(TPMI_REG_MAP[i].cap_offset + tpmi_instance[j].offset + TPMI_REG_MAP[i].tpmi_offset + tpmi_instance[j].register_offset);
-            tpmi_reg_value = *(uint64_t *)(tpmi_regs_buffer + address);
-            printf("%d\t|\t%-*s\t|\t%-*ld\t|\t0x%lx|\t0x%lx\n", i, 30, TPMI_REG_MAP[i].name, 10, tpmi_instance[j].id, address, tpmi_reg_value);
-            fprintf(fp, "%d\t\t|\t%-*s\t|\t%-*ld\t|\t0x%lx|\t0x%lx\n", i, 30, TPMI_REG_MAP[i].name, 10, tpmi_instance[j].id, address, tpmi_reg_value);
-            printf("--------------------------------------------------------------------------------------------------------\n");
-            fprintf(fp, "--------------------------------------------------------------------------------------------------------\n");
+static void print_tpmi_bin(FILE *fp)
+{
+    int d, k;
+    struct timespec now;
+    tpmi_bin_header_t header = {0};
+    tpmi_bin_record_t record = {0};
+    const tpmi_device_t *dev;
+    const tpmi_record_t *rec;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.magic = TPMI_BIN_MAGIC;
+    header.version = TPMI_BIN_VERSION;
+    header.timestamp_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    for (d = 0; d < num_tpmi_devices; d++)
+        header.num_records += tpmi_devices[d].num_records;
+    fwrite(&header, sizeof(header), 1, fp);
+
+    for (d = 0; d < num_tpmi_devices; d++) {
+        dev = &tpmi_devices[d];
+        for (k = 0; k < dev->num_records; k++) {
+            rec = &dev->records[k];
+            record.socket_id = dev->socket_id;
+            record.die_id = dev->die_id;
+            record.reg = rec->reg;
+            record.tpmi_id = TPMI_REG_MAP[rec->reg].tpmi_id;
+            record.instance_id = rec->instance_id;
+            record.address = rec->address;
+            record.value = rec->value;
+            fwrite(&record, sizeof(record), 1, fp);
         }
     }
-    // dup2(s_fd, n_fd);
-    // close(fd);
+}
+
+void parse_tpmi_dump(void)
+{
+    FILE *fp = NULL;
+
+    if (tpmi_report_file != NULL) {
+        fp = fopen(tpmi_report_file, tpmi_format == TPMI_FORMAT_BIN ? "ab" : "w+");
+        if (fp == NULL) {
+            fprintf(stderr, "ERROR: Couldn't open %s due to \"%s\"\n", tpmi_report_file, strerror(errno));
+            return;
+        }
+    } else if (tpmi_format != TPMI_FORMAT_TEXT) {
+        fp = tpmi_out;
+    }
+    if (fp != NULL)
+        setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+    switch (tpmi_format) {
+        case TPMI_FORMAT_JSON:
+            print_tpmi_json(fp);
+            break;
+        case TPMI_FORMAT_CSV:
+            print_tpmi_csv(fp);
+            break;
+        case TPMI_FORMAT_BIN:
+            print_tpmi_bin(fp);
+            break;
+        default:
+            print_tpmi_text(fp);
+            break;
+    }
+
+    if (fp == tpmi_out)
+        fflush(fp);
+    else if (fp != NULL)
+        fclose(fp);
+}
+
+static void tpmi_watch_signal(int sig)
+{
+    tpmi_watch_stop = 1;
+}
+
+static uint64_t tpmi_field(uint64_t value)
+{
+    uint32_t width = tpmi_field_msb - tpmi_field_lsb + 1;
+
+    value >>= tpmi_field_lsb;
+    return width >= 64 ? value : value & ((1ULL << width) - 1);
+}
+
+static double tpmi_elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * Sample the addresses resolved by collect_tpmi_regs() at a fixed rate on
+ * every device. Only changed fields are printed, with the time since the
+ * first sample.
+ */
+void watch_tpmi_regs(void)
+{
+    tpmi_watch_t *watch;
+    const tpmi_device_t *dev;
+    struct timespec start, next;
+    uint64_t value, samples;
+    int num_watch = 0;
+    int d, k;
+
+    for (d = 0; d < num_tpmi_devices; d++)
+        num_watch += tpmi_devices[d].num_records;
+    if (num_watch == 0) {
+        printf("ERROR: No TPMI reg selected to watch\n");
+        return;
+    }
+
+    watch = (tpmi_watch_t *)calloc(num_watch, sizeof(*watch));
+    if (watch == NULL) {
+        printf("ERROR: Couldn't allocate watch list\n");
+        return;
+    }
+
+    num_watch = 0;
+    for (d = 0; d < num_tpmi_devices; d++) {
+        dev = &tpmi_devices[d];
+        for (k = 0; k < dev->num_records; k++) {
+            watch[num_watch].dev = dev;
+            watch[num_watch].reg = dev->records[k].reg;
+            watch[num_watch].instance_id = dev->records[k].instance_id;
+            watch[num_watch].address = dev->records[k].address;
+            watch[num_watch].last = tpmi_field(dev->records[k].value);
+            watch[num_watch].min = watch[num_watch].last;
+            watch[num_watch].max = watch[num_watch].last;
+            watch[num_watch].sum = watch[num_watch].last;
+            num_watch++;
+        }
+    }
+
+    printf("INFO: Watching %d TPMI regs bits %u:%u every %u ms, press Ctrl-C to stop\n",
+           num_watch, tpmi_field_msb, tpmi_field_lsb, tpmi_watch_interval_ms);
+    printf("%-12s|\tSocket\t|\tDie\t|\t%-*s\t|\t%-*s\t|\tOLD_VALUE -> NEW_VALUE\n", "TIME_MS", 30, "TPMI_REG_NAME", 10, "INSTANCE_ID");
+    for (k = 0; k < num_watch; k++) {
+        printf("%-12.3f|\t%ld\t|\t%d\t|\t%-*s\t|\t%-*ld\t|\t0x%lx\n", 0.0, watch[k].dev->socket_id, watch[k].dev->die_id, 30,
+               TPMI_REG_MAP[watch[k].reg].name, 10, watch[k].instance_id, watch[k].last);
+    }
+
+    signal(SIGINT, tpmi_watch_signal);
+    signal(SIGTERM, tpmi_watch_signal);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = start;
+    samples = 1;
+    while (!tpmi_watch_stop && (tpmi_watch_samples == 0 || samples < tpmi_watch_samples)) {
+        next.tv_nsec += (long)tpmi_watch_interval_ms * 1000000L;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        if (tpmi_watch_stop)
+            break;
+
+        for (k = 0; k < num_watch; k++) {
+            value = tpmi_field(*(const volatile uint64_t *)(watch[k].dev->view.base + watch[k].address));
+            if (value != watch[k].last) {
+                printf("%-12.3f|\t%ld\t|\t%d\t|\t%-*s\t|\t%-*ld\t|\t0x%lx -> 0x%lx\n", tpmi_elapsed_ms(&start), watch[k].dev->socket_id,
+                       watch[k].dev->die_id, 30,
+                       TPMI_REG_MAP[watch[k].reg].name, 10, watch[k].instance_id, watch[k].last, value);
+                watch[k].last = value;
+            }
+            if (value < watch[k].min)
+                watch[k].min = value;
+            if (value > watch[k].max)
+                watch[k].max = value;
+            watch[k].sum += value;
+        }
+        samples++;
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    printf("==========================================TPMI WATCH SUMMARY============================================\n");
+    printf("INFO: %lu samples in %.3f ms\n", samples, tpmi_elapsed_ms(&start));
+    printf("Socket\t|\tDie\t|\t%-*s\t|\t%-*s\t|\tMIN|\tMAX|\tMEAN\n", 30, "TPMI_REG_NAME", 10, "INSTANCE_ID");
+    for (k = 0; k < num_watch; k++) {
+        printf("%ld\t|\t%d\t|\t%-*s\t|\t%-*ld\t|\t0x%lx|\t0x%lx|\t%.2f\n", watch[k].dev->socket_id, watch[k].dev->die_id, 30,
+               TPMI_REG_MAP[watch[k].reg].name, 10, watch[k].instance_id, watch[k].min, watch[k].max, watch[k].sum / samples);
+    }
+
+    free(watch);
+}
+
+static int region_save(const tpmi_device_t *dev)
+{
+    FILE *fp;
+    char dump_path[PATH_MAX];
+    uint64_t offset, value;
+
+    // One file per device when several TPMI devices are dumped
+    if (num_tpmi_devices > 1)
+        snprintf(dump_path, sizeof(dump_path), "%s.%s", tpmi_dump_file, dev->bdf);
+    else
+        snprintf(dump_path, sizeof(dump_path), "%s", tpmi_dump_file);
+
+    fp = fopen(dump_path, "wb+");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: Couldn't open %s due to \"%s\"\n", dump_path, strerror(errno));
+        return -1;
+    }
+
+    // Start the dump at the PFS table, as -f expects. TPMI registers are 64-bit, copy them with 64-bit loads
+    for (offset = dev->table_offset; offset + sizeof(uint64_t) <= dev->view.size; offset += sizeof(uint64_t)) {
+        value = *(const volatile uint64_t *)(dev->view.base + offset);
+        fwrite(&value, sizeof(value), 1, fp);
+    }
     fclose(fp);
-    // sleep(1);
-    printf("=================================================END====================================================\n");
+    printf("INFO: Saved TPMI region of %s to %s\n", dev->bdf, dump_path);
+
+    return 0;
 }
 
-void tpmi_dump(void)
+static int tpmi_map_file(const char *path, tpmi_view_t *view)
+{
+    struct stat st;
+    void *mmap_base;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Couldn't open %s due to \"%s\"\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "ERROR: %s is empty or unreadable\n", path);
+        close(fd);
+        return -1;
+    }
+
+    mmap_base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mmap_base == MAP_FAILED) {
+        printf("ERROR: MMAP failed due to \"%s\"\n", strerror(errno));
+        return -1;
+    }
+
+    view->base = (const volatile uint8_t *)mmap_base;
+    view->size = st.st_size;
+    return 0;
+}
+
+static int tpmi_map_region(tpmi_device_t *dev)
 {
     char resource_path[PATH_MAX];
-    mmio_region_t mmio_region;
+    mmio_region_t mmio_region = {0};
     uint64_t start_addr, end_addr, data;
     FILE *fp;
     int index = 0;
-    char *tpmi_bdf = tpmi_actual_bdf != NULL ? tpmi_actual_bdf : tpmi_default_bdf;
 
-    snprintf(resource_path, sizeof(resource_path), "/sys/bus/pci/devices/%s/resource", tpmi_bdf);
+    snprintf(resource_path, sizeof(resource_path), "/sys/bus/pci/devices/%s/resource", dev->bdf);
     // Open TPMI PCIe device resource to get MMIO region address
     fp = fopen(resource_path, "r");
     if (fp == NULL) {
         fprintf(stderr, "ERROR: Couldn't open %s due to \"%s\"\n", resource_path, strerror(errno));
-        return;
+        return -1;
     }
 
     while (fscanf(fp, "%lx %lx %lx\n", &start_addr, &end_addr, &data) == 3) {
-        if ( start_addr != 0 && end_addr != 0 && index == tpmi_region_id ) {
-            printf("INFO: Find valid TPMI MMIO region from %lx to %lx\n", start_addr, end_addr);
+        if ( start_addr != 0 && end_addr != 0 && index == dev->region_id ) {
+            printf("INFO: %s: Find valid TPMI MMIO region from %lx to %lx\n", dev->bdf, start_addr, end_addr);
             mmio_region.start_addr = start_addr;
             mmio_region.end_addr = end_addr;
             break;
@@ -635,29 +1047,194 @@ void tpmi_dump(void)
     fclose(fp);
 
     if (mmio_region.start_addr == 0 && mmio_region.end_addr == 0) {
-        printf("INFO: No valid TPMI MMIO region found!");
-        return;
+        printf("INFO: %s: No valid TPMI MMIO region found!\n", dev->bdf);
+        return -1;
     }
 
-    // Start to dump TPMI MMIO region
-    region_dump(&mmio_region);
+    snprintf(resource_path, sizeof(resource_path), "/sys/bus/pci/devices/%s/resource%d", dev->bdf, dev->region_id);
+    return tpmi_map_file(resource_path, &dev->view);
+}
+
+/*
+ * Walk the PCIe extended capabilities of one function looking for the
+ * Intel TPMI VSEC or DVSEC, and return the BAR holding the TPMI region.
+ */
+static int find_tpmi_vsec(const char *bdf, uint32_t *region_id, uint32_t *table_offset)
+{
+    char config_path[PATH_MAX];
+    uint8_t config[4096];
+    uint32_t header, vsec_id, table;
+    uint32_t pos = PCI_EXT_CAP_START;
+    ssize_t len;
+    int fd, loops = 0;
+
+    snprintf(config_path, sizeof(config_path), "/sys/bus/pci/devices/%s/config", bdf);
+    fd = open(config_path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    len = pread(fd, config, sizeof(config), 0);
+    close(fd);
+
+    // Extended config space is only visible to root
+    if (len < PCI_EXT_CAP_START + 4 || *(uint16_t *)config != PCI_VENDOR_ID_INTEL)
+        return -1;
 
-    // Start to parse TPMI dump
-    parse_tpmi_dump(&mmio_region);
+    while (pos >= PCI_EXT_CAP_START && pos + INTEL_DVSEC_TABLE + 4 <= len && loops++ < 256) {
+        header = *(uint32_t *)(config + pos);
+        if (header == 0 || header == 0xffffffff)
+            break;
+
+        vsec_id = 0;
+        if ((header & 0xffff) == PCI_EXT_CAP_ID_VNDR)
+            vsec_id = *(uint32_t *)(config + pos + 4) & 0xffff;
+        else if ((header & 0xffff) == PCI_EXT_CAP_ID_DVSEC && (*(uint32_t *)(config + pos + 4) & 0xffff) == PCI_VENDOR_ID_INTEL)
+            vsec_id = *(uint32_t *)(config + pos + 8) & 0xffff;
+
+        if (vsec_id == INTEL_VSEC_ID_TPMI) {
+            table = *(uint32_t *)(config + pos + INTEL_DVSEC_TABLE);
+            *region_id = table & 0x7;
+            *table_offset = table & ~0x7;
+            return 0;
+        }
+        pos = (header >> 20) & 0xffc;
+    }
+
+    return -1;
+}
+
+static int compare_tpmi_device(const void *a, const void *b)
+{
+    const tpmi_device_t *da = (const tpmi_device_t *)a;
+    const tpmi_device_t *db = (const tpmi_device_t *)b;
+
+    if (da->socket_id != db->socket_id)
+        return da->socket_id < db->socket_id ? -1 : 1;
+    return strcmp(da->bdf, db->bdf);
+}
+
+static int discover_tpmi_devices(void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    uint32_t region_id, table_offset;
+
+    dir = opendir("/sys/bus/pci/devices");
+    if (dir == NULL) {
+        fprintf(stderr, "ERROR: Couldn't open /sys/bus/pci/devices due to \"%s\"\n", strerror(errno));
+        return 0;
+    }
+
+    while ((entry = readdir(dir)) != NULL && num_tpmi_devices < MAX_TPMI_DEVICES) {
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) >= sizeof(tpmi_devices[0].bdf))
+            continue;
+        if (find_tpmi_vsec(entry->d_name, &region_id, &table_offset) != 0)
+            continue;
+        snprintf(tpmi_devices[num_tpmi_devices].bdf, sizeof(tpmi_devices[0].bdf), "%.15s", entry->d_name);
+        tpmi_devices[num_tpmi_devices].region_id = region_id;
+        tpmi_devices[num_tpmi_devices].table_offset = table_offset;
+        printf("INFO: Find TPMI device %s, region %u, PFS table offset 0x%x\n", entry->d_name, region_id, table_offset);
+        num_tpmi_devices++;
+    }
+    closedir(dir);
+
+    return num_tpmi_devices;
+}
+
+// Package id from TPMI_BUS_INFO bits 23:16, the device index if unreadable
+static int64_t get_tpmi_socket_id(const tpmi_device_t *dev, int index)
+{
+    static int bus_info = -1;
+    uint64_t value;
+    int i;
+
+    if (bus_info < 0) {
+        for (i = 0; i < NUM_TPMI_REG; i++) {
+            if (strcmp(TPMI_REG_MAP[i].name, "TPMI_BUS_INFO") == 0)
+                bus_info = i;
+        }
+    }
+
+    if (bus_info < 0 || tpmi_read64(&dev->view, dev->table_offset + TPMI_REG_MAP[bus_info].cap_offset + TPMI_REG_MAP[bus_info].tpmi_offset, &value))
+        return index;
+    return (value >> 16) & 0xff;
+}
+
+static void *tpmi_device_worker(void *arg)
+{
+    tpmi_device_t *dev = (tpmi_device_t *)arg;
+
+    if (dev->view.base == NULL && tpmi_map_region(dev) != 0)
+        return NULL;
+    collect_tpmi_regs(dev);
+    return NULL;
+}
+
+void tpmi_dump(void)
+{
+    pthread_t threads[MAX_TPMI_DEVICES];
+    uint32_t region_id;
+    int d, created[MAX_TPMI_DEVICES];
+
+    if (tpmi_input_file != NULL) {
+        snprintf(tpmi_devices[0].bdf, sizeof(tpmi_devices[0].bdf), "file");
+        if (tpmi_map_file(tpmi_input_file, &tpmi_devices[0].view) != 0)
+            return;
+        num_tpmi_devices = 1;
+    } else if (tpmi_actual_bdf != NULL || discover_tpmi_devices() == 0) {
+        snprintf(tpmi_devices[0].bdf, sizeof(tpmi_devices[0].bdf), "%.15s", tpmi_actual_bdf != NULL ? tpmi_actual_bdf : tpmi_default_bdf);
+        tpmi_devices[0].region_id = tpmi_region_id;
+        // The PFS table offset still comes from the VSEC when it can be read
+        if (find_tpmi_vsec(tpmi_devices[0].bdf, &region_id, &tpmi_devices[0].table_offset) != 0)
+            tpmi_devices[0].table_offset = 0;
+        num_tpmi_devices = 1;
+    }
+
+    // Map and decode every socket/die concurrently
+    for (d = 0; d < num_tpmi_devices; d++)
+        created[d] = pthread_create(&threads[d], NULL, tpmi_device_worker, &tpmi_devices[d]) == 0;
+    for (d = 0; d < num_tpmi_devices; d++) {
+        if (created[d])
+            pthread_join(threads[d], NULL);
+        else
+            tpmi_device_worker(&tpmi_devices[d]);
+    }
+
+    for (d = 0; d < num_tpmi_devices; d++) {
+        tpmi_devices[d].socket_id = tpmi_devices[d].view.base != NULL ? get_tpmi_socket_id(&tpmi_devices[d], d) : d;
+        if (tpmi_dump_file != NULL && tpmi_devices[d].view.base != NULL)
+            region_save(&tpmi_devices[d]);
+    }
+    qsort(tpmi_devices, num_tpmi_devices, sizeof(tpmi_devices[0]), compare_tpmi_device);
+    // Dies of a socket are numbered in BDF order
+    for (d = 1; d < num_tpmi_devices; d++) {
+        if (tpmi_devices[d].socket_id == tpmi_devices[d - 1].socket_id)
+            tpmi_devices[d].die_id = tpmi_devices[d - 1].die_id + 1;
+    }
+
+    if (tpmi_watch_interval_ms != 0)
+        watch_tpmi_regs();
+    else
+        parse_tpmi_dump();
+
+    for (d = 0; d < num_tpmi_devices; d++) {
+        if (tpmi_devices[d].view.base != NULL)
+            munmap((void *)tpmi_devices[d].view.base, tpmi_devices[d].view.size);
+        free(tpmi_devices[d].records);
+    }
 }
 
 int main(int argc, char *argv[])
 {
     int opt;
     uint32_t domain, bus, dev, func;
-    const char *optstring = "hr:d:";
+    int region_set = 0;
+    const char *optstring = "hr:d:p:f:o:t:i:n:w:c:b:F:";
 
     while ((opt = getopt(argc, argv, optstring)) != -1) {
         switch (opt) {
             case 'd':
                 if (sscanf((char *)optarg, "%4x:%2x:%2x.%x", &domain, &bus, &dev, &func) == 4) {
                     tpmi_actual_bdf = (char *)optarg;
-                    printf("INFO: Get new TPMI_BDF -- %s\n", tpmi_actual_bdf);
                 } else {
                     printf("ERROR: %s - Invalid BDF format\n", (char *)optarg);
                     usage(argv[0]);
@@ -666,7 +1243,54 @@ int main(int argc, char *argv[])
                 break;
             case 'r':
                 tpmi_region_id = (uint32_t)strtoul(optarg, NULL, 0);
-                printf("INFO: Get new TPMI_REGION_ID -- %d\n", tpmi_region_id);
+                region_set = 1;
+                break;
+            case 'f':
+                tpmi_input_file = (char *)optarg;
+                break;
+            case 'o':
+                tpmi_dump_file = (char *)optarg;
+                break;
+            case 't':
+                tpmi_report_file = (char *)optarg;
+                break;
+            case 'F':
+                if (strcmp(optarg, "text") == 0) {
+                    tpmi_format = TPMI_FORMAT_TEXT;
+                } else if (strcmp(optarg, "json") == 0) {
+                    tpmi_format = TPMI_FORMAT_JSON;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    tpmi_format = TPMI_FORMAT_CSV;
+                } else if (strcmp(optarg, "bin") == 0) {
+                    tpmi_format = TPMI_FORMAT_BIN;
+                } else {
+                    printf("ERROR: %s - Invalid output format\n", (char *)optarg);
+                    usage(argv[0]);
+                    return 0;
+                }
+                break;
+            case 'i':
+                tpmi_id_filter = (int64_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                tpmi_instance_filter = (int64_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                tpmi_watch_interval_ms = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                tpmi_watch_samples = strtoull(optarg, NULL, 0);
+                break;
+            case 'b':
+                if (sscanf(optarg, "%u:%u", &tpmi_field_msb, &tpmi_field_lsb) != 2 ||
+                    tpmi_field_msb > 63 || tpmi_field_lsb > tpmi_field_msb) {
+                    printf("ERROR: %s - Invalid bit field\n", (char *)optarg);
+                    usage(argv[0]);
+                    return 0;
+                }
+                break;
+            case 'p':
+                tpmi_reg_pattern = (char *)optarg;
                 break;
             case 'h':
             default:
@@ -675,6 +1299,29 @@ int main(int argc, char *argv[])
         }
     }
 
+    /*
+     * Structured output written to stdout must not be mixed with INFO
+     * messages: keep the original stdout for the data and send every
+     * message to stderr.
+     */
+    if (tpmi_format != TPMI_FORMAT_TEXT && tpmi_report_file == NULL) {
+        fflush(stdout);
+        tpmi_out = fdopen(dup(STDOUT_FILENO), "w");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    if (tpmi_actual_bdf != NULL)
+        printf("INFO: Get new TPMI_BDF -- %s\n", tpmi_actual_bdf);
+    if (region_set)
+        printf("INFO: Get new TPMI_REGION_ID -- %d\n", tpmi_region_id);
+    if (tpmi_input_file != NULL)
+        printf("INFO: Parse TPMI dump from %s\n", tpmi_input_file);
+    if (tpmi_reg_pattern != NULL)
+        printf("INFO: Only dump TPMI regs matching -- %s\n", tpmi_reg_pattern);
+
+    if (build_tpmi_reg_index() != 0)
+        return -1;
+
     tpmi_dump();
 
     return 0;
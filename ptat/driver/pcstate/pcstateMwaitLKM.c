@@ -32,6 +32,10 @@
 \par REVISION HISTORY:
 
 06/23/2014       borisv          Original Draft
+                                 persistent per-core C-state workers
+                                 C-state exit latency benchmark
+                                 per-step C-state residency report
+                                 CPU capacity sized from nr_cpu_ids, hashed MSR cache
 *****************************************************************************/
 
 #define _GNU_SOURCE
@@ -52,6 +56,17 @@
 #include <linux/cpumask.h>
 #include <linux/cdev.h>		/* for cdev for ioctl */
 #include <linux/device.h>	/* for dev for ioctl */
+#include <linux/fs.h>		/* simple_read_from_buffer() */
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/mm.h>		/* kvmalloc_array() */
+#include <linux/seq_file.h>	/* cstate_latency */
+#include <linux/hash.h>		/* hash_32() */
+#include <linux/sort.h>
+#include <linux/workqueue.h>	/* work_on_cpu() */
+#include <asm/tsc.h>		/* rdtsc_ordered(), tsc_khz */
+#include <asm/msr.h>		/* rdmsr_safe() */
 
 // include shared data with application part
 #include "pcstateUserKernelSharedData.h"
@@ -66,32 +81,116 @@ MODULE_SUPPORTED_DEVICE("None");
 #define MY_FIRST_MINOR 0
 #define MY_MINOR_CNT 1
 
-static struct proc_dir_entry *pcstate_dir, *cstate_command_file, *msr_command_file;
-#define CORE_TASK_NAME "pcstateCoreTask"
+static struct proc_dir_entry *pcstate_dir, *cstate_command_file, *msr_command_file, *cstate_latency_file, *cstate_residency_file;
 #define MWAIT_TASK_NAME "pcstateMwaitTask"
 
 #define TRIGGER_MEMORY_SIZE_INT (TRIGGER_MEMORY_DEFAULT_SIZE/(sizeof (int)))
 
-struct mWaitData
+/* Residency counters of one core, snapshot at step start and end */
+#define RESIDENCY_CORE_STATES 3  // C3, C6, C7
+#define RESIDENCY_PKG_STATES 4   // PC2, PC3, PC6, PC7
+#define CSTATE_BUSY_WAIT_MS 100  // grace for workers still ending the previous step
+struct cstateResidency_t
 {
+  uint64_t tsc;
+  uint64_t mperf;
+  uint64_t core[RESIDENCY_CORE_STATES];
+  uint64_t pkg[RESIDENCY_PKG_STATES];
+};
+
+/* Persistent per-core C-state worker, armed for every step without creating threads */
+struct cstateWorker_t
+{
+  struct task_struct *task;
   uint32_t coreId;
-  char *watchedArea;
-  uint32_t longevity;  // in microsec
+  char *watchedArea;         // monitored line, tripped to end the step
   uint8_t state;
+  uint64_t armedGen;         // step this worker is armed for
+  uint64_t doneGen;          // last step it completed
+  struct hrtimer stepTimer;  // ends the step at the same absolute time on every core
+  bool bench;                // exit latency benchmark instead of a step
+  uint64_t *benchSamples;    // wake latencies in TSC cycles
+  uint32_t benchCount;
+  uint32_t benchArmed;       // samples the worker parked for
+  uint32_t benchTaken;       // samples recorded
+  uint32_t benchSpurious;    // wakes not caused by the waker
+  struct cstateResidency_t resStart;  // taken when entering MWAIT
+  struct cstateResidency_t resEnd;    // taken when the step ended
+  uint64_t resGen;           // step the snapshots belong to
 };
 
+static struct cstateWorker_t *cstateWorkers;  // nr_cpu_ids entries
+static uint64_t cstateGen;                    // last step armed
+static uint64_t cstateReleaseGen;             // last step released from the barrier
+static atomic_t cstateReady = ATOMIC_INIT(0); // workers of the current step at the barrier
+static uint64_t cstateLastStep;               // last step started by startCState, 0 if none
+static uint8_t cstateLastState;
+static uint32_t cstateLastTime;
+static struct cpumask cstateLastCpus;         // cores of the last step
+
+/* Exit latency distribution of one core in one C-state, from the last benchmark */
+struct cstateLatency_t
+{
+  uint32_t samples;
+  uint32_t spurious;
+  uint64_t minNs;
+  uint64_t p50Ns;
+  uint64_t p90Ns;
+  uint64_t p99Ns;
+  uint64_t maxNs;
+  uint64_t avgNs;
+};
+
+#define CSTATE_BENCH_STATES 5
+#define CSTATE_BENCH_ABORT U64_MAX   // written by the waker to stop a benchmark
+static const uint8_t cstateBenchStates[CSTATE_BENCH_STATES] = {0, 1, 3, 6, 7};
+static struct cstateLatency_t *cstateLatency;  // CSTATE_BENCH_STATES x nr_cpu_ids
+
 /* run-time flag to dynamically control a volume of debug printouts */
 bool pcstateDebugStatus = false;  
 
 
 /* If application decided not to use /dev/cpu/X/msr pseudo files to read MSRs,
    but instead to call LKM to get that info, then we use msrReq/msrResp.
-   We also assume that we have one MSR request from user at any moment of time */
-static struct msrMsg_t m;
+   Every open of the MSR file is a separate session: the requests written to it
+   are answered into its own result queue, read back in the same order */
+#define MSR_SESSION_QUEUE 64
+
+struct msrSession_t
+{
+  struct mutex lock;
+  struct msrMsg_t results[MSR_SESSION_QUEUE];
+  uint32_t head;   // oldest result not read yet
+  uint32_t count;  // results queued
+};
+
+/* Every open of the cstate command file keeps the outcome of its last command */
+struct cstateSession_t
+{
+  struct mutex lock;
+  char lastType;
+  uint8_t lastState;
+  uint32_t lastTime;
+  uint32_t lastCores;
+  int lastStatus;
+  bool hasResult;
+};
+
+static DEFINE_SPINLOCK(msrArrLock);  // slot allocation in mArr
+static DEFINE_MUTEX(cstateLock);     // C-state steps share coresInMwait and the per-core tasks
 
 // Bunch of MSRs we watch inside MWAIT loop
-static struct msrMsg_t mArr[MSR_COLLECTION_SIZE][MAX_CORES];
-bool coresInMwait[MAX_CORES];
+/* MSRs collected by the MWAIT loop of one core, hashed on the MSR id */
+#define MSR_CACHE_SHIFT 6
+#define MSR_CACHE_SLOTS (1 << MSR_CACHE_SHIFT)  // room for MSR_COLLECTION_SIZE with short probes
+struct msrCache_t
+{
+  uint32_t used;
+  struct msrMsg_t slot[MSR_CACHE_SLOTS];
+};
+
+static struct msrCache_t *mArr;  // nr_cpu_ids entries
+static bool *coresInMwait;       // nr_cpu_ids entries
 
 /*****************************************************************/
 
@@ -139,50 +238,82 @@ uint64_t readTsc(void)
 
 
 /***********************************************************/
-void cleanMsrArray (void)
+void freeMsrArray (void);
+
+int allocMsrArray (void)
+{
+  mArr = kvmalloc_array(nr_cpu_ids, sizeof (*mArr), GFP_KERNEL | __GFP_ZERO);
+  coresInMwait = kcalloc(nr_cpu_ids, sizeof (*coresInMwait), GFP_KERNEL);
+  if (mArr == NULL || coresInMwait == NULL)
+    {
+      freeMsrArray();
+      return -ENOMEM;
+    }
+  return 0;
+}
+
+void freeMsrArray (void)
 {
-  memset(mArr, 0, sizeof (mArr));
+  kvfree(mArr);
+  kfree(coresInMwait);
+  mArr = NULL;
+  coresInMwait = NULL;
 }
 
 
-/* finds either the filled structure with required MSR, or the first empty slot */ 
+/* finds either the filled structure with required MSR, or takes an empty slot,
+   open addressing on the MSR id so a lookup is a probe or two whatever the core count */ 
 struct msrMsg_t *findMsrPlace (uint32_t id, uint32_t core)
 {
-  int i=0;
-  struct msrMsg_t *notOccupied = NULL;
-  
-  if (core <= MAX_CORES)
+  struct msrCache_t *cache;
+  struct msrMsg_t *slot = NULL;
+  uint32_t i, h;
+
+  if (mArr == NULL || core >= nr_cpu_ids || id == 0)
+    return NULL;
+
+  cache = &mArr[core];
+  h = hash_32(id, MSR_CACHE_SHIFT);
+  spin_lock(&msrArrLock);
+  for (i=0; i<MSR_CACHE_SLOTS; i++)
     {
-      for (i=0; i<MSR_COLLECTION_SIZE; i++)
-        {
-          if (mArr[i][core].msrId==id)
-            return &mArr[i][core];
-          else if (notOccupied==NULL && mArr[i][core].msrId==0)
-            {
-              // take this slot
-              notOccupied = &mArr[i][core];
-            }
-        }
-      if (notOccupied)
+      slot = &cache->slot[(h + i) & (MSR_CACHE_SLOTS - 1)];
+      if (slot->msrId == id)
         {
-          memset(notOccupied, 0, sizeof (struct msrMsg_t));
-          notOccupied->msrId = id;
-          notOccupied->coreId = core;
-          return notOccupied;
+          spin_unlock(&msrArrLock);
+          return slot;
         }
+      if (slot->msrId == 0)
+        break;
+    }
+  if (i == MSR_CACHE_SLOTS || cache->used >= MSR_COLLECTION_SIZE)
+    {
+      spin_unlock(&msrArrLock);
+      return NULL;
     }
-  
-  return NULL;
+
+  // take this slot
+  memset(slot, 0, sizeof (struct msrMsg_t));
+  slot->coreId = core;
+  WRITE_ONCE(slot->msrId, id);
+  cache->used++;
+  spin_unlock(&msrArrLock);
+  return slot;
 }
 
 /*-----  read all MSRs needed ------------*/
 void fillMsrArray(uint32_t core)
 {
+  struct msrMsg_t *slot;
   int i;
-  for (i=0; i<MSR_COLLECTION_SIZE; i++)
+
+  if (mArr == NULL || core >= nr_cpu_ids)
+    return;
+  for (i=0; i<MSR_CACHE_SLOTS; i++)
     {
-      if (core < MAX_CORES)
-        msrReadFuncInMwait(&(mArr[i][core]));
+      slot = &mArr[core].slot[i];
+      if (READ_ONCE(slot->msrId) != 0)
+        msrReadFuncInMwait(slot);
     }
 }
 
@@ -241,60 +372,96 @@ static inline void mwait(unsigned long eax, unsigned long ecx)
 /*! 
 *******************************************************************************
 * 
-*  \brief   task to perform MWAIT and MONITOR
+*  \brief   MWAIT hint for a C-state, the same codes as the Windows version
+*           (0xf0 & ((state - 1) << 4) didn't work on C3, C6)
+* 
+*   \return  int, 0 or -EINVAL for an unknown C-state
 * 
 ******************************************************************************/
-int funcMwaitTask (void* data)
+static int cstateHint (uint8_t state, uint32_t *hint)
+{
+  switch (state & 0xf)
+    {
+      case 0:
+        *hint = 0xf0;
+        break;
+      case 1:
+        *hint = 0x00;
+        break;
+      case 3:
+        *hint = 0x10;
+        break;
+      case 6:
+        *hint = 0x20;
+        break;
+      case 7:
+        *hint = 0x30;
+        break;
+      default:
+        return -EINVAL;
+    }
+  return 0;
+}
+
+static const uint32_t residencyCoreMsrs[RESIDENCY_CORE_STATES] = {MSR_CORE_C3_RESIDENCY, MSR_CORE_C6_RESIDENCY, MSR_CORE_C7_RESIDENCY};
+static const uint32_t residencyPkgMsrs[RESIDENCY_PKG_STATES] = {MSR_PKG_C2_RESIDENCY, MSR_PKG_C3_RESIDENCY, MSR_PKG_C6_RESIDENCY, MSR_PKG_C7_RESIDENCY};
+
+/* local MSR read, counters missing on this CPU model read as 0 */
+static uint64_t residencyMsr (uint32_t msr)
+{
+  uint32_t lo, hi;
+
+  if (rdmsr_safe(msr, &lo, &hi))
+    return 0;
+  return (uint64_t) hi << 32 | lo;
+}
+
+/* snapshot of the residency counters of the calling core */
+static void snapshotResidency (struct cstateResidency_t *r)
+{
+  int i;
+
+  r->tsc = rdtsc_ordered();
+  r->mperf = residencyMsr(MSR_IA32_MPERF);
+  for (i=0; i<RESIDENCY_CORE_STATES; i++)
+    r->core[i] = residencyMsr(residencyCoreMsrs[i]);
+  for (i=0; i<RESIDENCY_PKG_STATES; i++)
+    r->pkg[i] = residencyMsr(residencyPkgMsrs[i]);
+}
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   MWAIT and MONITOR until the watched area is tripped
+* 
+******************************************************************************/
+static void mwaitUntilTripped (struct cstateWorker_t *w)
 {
-    struct mWaitData *myData = (struct mWaitData *) data;
     bool stillWaiting = true;
     bool firstReset = true;
     uint32_t countResets = 0;
     uint64_t cstateStats0[11]; // temp objects for debug
     uint64_t cstateStats1[11];
+    uint32_t hint = 0;
+    int i;
 
     if (pcstateDebugStatus)
       {
-        printk(KERN_INFO "pcstate: funcMwaitTask core %d to c%1.1d\n", myData->coreId, myData->state);
+        printk(KERN_INFO "pcstate: mwait core %d to c%1.1d\n", w->coreId, w->state);
         collectCStateStats(cstateStats0);
       }
+    cstateHint(w->state, &hint);  // validated by startCState
+    snapshotResidency(&w->resStart);
+
     while (stillWaiting)
       {
-            int i;
-            uint32_t hint = 0;
-            // go down to C-state
-            
-            /*  those codes didn't work on C3, C6:
-                hint = 0xf0 & (((myData.state&0xf) - 1)<<4);
-                so we use the same as Windows version */
-            switch (myData->state & 0xf)
-              {
-                case 0:
-                  hint = 0xf0;
-                  break;
-                case 1:
-                  hint = 0x00;
-                  break;
-                case 3:
-                  hint = 0x10;
-                  break;
-                case 6:
-                  hint = 0x20;
-                  break;
-                case 7:
-                  hint = 0x30;
-                  break;
-                default:
-                  printk(KERN_WARNING "pcstate: invalid C-State %#x\n",  myData->state);
-                  goto getOut;
-              }
             if (firstReset)
                 {
                   if (pcstateDebugStatus) {
                     printk(KERN_INFO "pcstate: call mwait(%#x,%d) on core %d\n",
-                                                           hint, 0, myData->coreId);
+                                                           hint, 0, w->coreId);
 		  }
-                    monitor(myData->watchedArea, 0, 0);
+                    monitor(w->watchedArea, 0, 0);
                 }
             
             mwait(hint, 0);
@@ -304,11 +471,11 @@ int funcMwaitTask (void* data)
                 printk(KERN_INFO "pcstate: mwait state ended\n");
             for (i=0; i<TRIGGER_MEMORY_SIZE_INT; i++)
                 {
-                    int *ptr = (int*)(myData->watchedArea);
-                    if (ptr[i] != 0)
+                    int *ptr = (int*)(w->watchedArea);
+                    if (READ_ONCE(ptr[i]) != 0)
                         {
                             stillWaiting = false;
-                            coresInMwait[myData->coreId]=false;
+                            coresInMwait[w->coreId]=false;
                             break;
                         }
                 }
@@ -316,20 +483,21 @@ int funcMwaitTask (void* data)
             if (stillWaiting) // no trigger happened, reset the monitor
                 {
                     countResets++;
-                    fillMsrArray(myData->coreId);
-                    monitor(myData->watchedArea, 0, 0);
+                    fillMsrArray(w->coreId);
+                    monitor(w->watchedArea, 0, 0);
                     if (firstReset)
                         {
                             if (pcstateDebugStatus)
-                              printk(KERN_INFO "pcstate: reset the monitor in %d\n", myData->coreId);
+                              printk(KERN_INFO "pcstate: reset the monitor in %d\n", w->coreId);
                             firstReset = false;
                         }
                 }
         }
+    snapshotResidency(&w->resEnd);
     
     if (pcstateDebugStatus)
         {
-            printk(KERN_INFO "pcstate: core %d out of mwait after %d resets\n", myData->coreId, countResets);
+            printk(KERN_INFO "pcstate: core %d out of mwait after %d resets\n", w->coreId, countResets);
             collectCStateStats(cstateStats1);
             printk(KERN_INFO "pcstate: C0 delta %12lld\n", cstateStats1[0]-cstateStats0[0]);
             printk(KERN_INFO "pcstate: C1 delta %12lld\n", cstateStats1[1]-cstateStats0[1]);
@@ -337,149 +505,494 @@ int funcMwaitTask (void* data)
             printk(KERN_INFO "pcstate: C6 delta %12lld\n", cstateStats1[6]-cstateStats0[6]);
             printk(KERN_INFO "pcstate: C7 delta %12lld\n", cstateStats1[7]-cstateStats0[7]);
         }
- getOut:
-    if (!(IS_ERR(myData)))
-      {
-        if (!(IS_ERR(myData->watchedArea)))
-          kfree(myData->watchedArea);
-        kfree(myData);
-      }
-    else if (pcstateDebugStatus)
-      printk(KERN_ERR "pcstate: funcMwaitTask got bad data\n");
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
-  return(SIGCHLD);
-#else
-  do_exit(SIGCHLD);
-#endif
+}
+
+/* index of a C-state in cstateLatency, -1 if it can't be benchmarked */
+static int cstateBenchIndex (uint8_t state)
+{
+  int i;
+
+  for (i=0; i<CSTATE_BENCH_STATES; i++)
+    if (cstateBenchStates[i] == state)
+      return i;
+  return -1;
 }
 
 /*! 
 *******************************************************************************
 * 
-*  \brief   Per core task function
+*  \brief   Exit latency benchmark on the worker's core: park in MWAIT until
+*           another core writes its TSC into the monitored line, then record
+*           the TSC at wake. Wakes without a TSC in the line are interrupts,
+*           counted as spurious and parked again
 * 
-*   \return  int error status 
+******************************************************************************/
+static void mwaitBench (struct cstateWorker_t *w)
+{
+  uint64_t *trig = (uint64_t *) w->watchedArea;
+  uint64_t tsc, t;
+  uint32_t hint = 0;
+
+  cstateHint(w->state, &hint);  // validated by cstateBenchRun
+
+  while (w->benchTaken < w->benchCount)
+    {
+      monitor(w->watchedArea, 0, 0);
+      t = READ_ONCE(*trig);
+      if (t == 0)
+        {
+          smp_store_release(&w->benchArmed, w->benchTaken + 1);
+          mwait(hint, 0);
+        }
+      tsc = rdtsc_ordered();
+      t = READ_ONCE(*trig);
+
+      if (t == CSTATE_BENCH_ABORT)
+        break;
+      if (t == 0)
+        {
+          w->benchSpurious++;
+          fillMsrArray(w->coreId);
+          continue;
+        }
+      w->benchSamples[w->benchTaken] = tsc > t ? tsc - t : 0;
+      WRITE_ONCE(*trig, 0);
+      smp_store_release(&w->benchTaken, w->benchTaken + 1);
+    }
+}
+
+/* end of a step: trip the watched area, all workers of a step share the expiry */
+static enum hrtimer_restart cstateStepEnd (struct hrtimer *timer)
+{
+  struct cstateWorker_t *w = container_of(timer, struct cstateWorker_t, stepTimer);
+
+  WRITE_ONCE(w->watchedArea[0], 1);
+  return HRTIMER_NORESTART;
+}
+
+/*! 
+*******************************************************************************
 * 
-*   \warning  Only MWAIT executing task must be 1) separate thread;
-*                                               2) use affinity
-*             This task has no such requirements
+*  \brief   Persistent per-core worker: sleeps until armed for a step, checks
+*           in at the barrier, spins until the step is released, then keeps
+*           the core in MWAIT until the step timer trips the watched area
 * 
 ******************************************************************************/
-int cTaskFunc (void* data)
+static int cstateWorkerFunc (void* data)
+{
+  struct cstateWorker_t *w = (struct cstateWorker_t *) data;
+  uint64_t gen;
+
+  while (!kthread_should_stop())
+    {
+      set_current_state(TASK_INTERRUPTIBLE);
+      if (READ_ONCE(w->armedGen) == w->doneGen && !kthread_should_stop())
+        schedule();
+      __set_current_state(TASK_RUNNING);
+
+      gen = READ_ONCE(w->armedGen);
+      if (gen == w->doneGen)
+        continue;
+
+      // barrier: every selected core enters MWAIT at the same moment
+      atomic_inc(&cstateReady);
+      while (READ_ONCE(cstateReleaseGen) < gen && !kthread_should_stop())
+        {
+          cpu_relax();
+          cond_resched();
+        }
+
+      if (!kthread_should_stop())
+        {
+          if (w->bench)
+            mwaitBench(w);
+          else
+            {
+              mwaitUntilTripped(w);
+              w->resGen = gen;
+            }
+        }
+      coresInMwait[w->coreId] = false;
+      smp_store_release(&w->doneGen, gen);
+    }
+
+  return 0;
+}
+
+/* create the worker of a core, at module load or on its first use */
+static int cstateWorkerCreate (uint32_t core)
+{
+  struct cstateWorker_t *w = &cstateWorkers[core];
+  struct task_struct *task;
+
+  w->watchedArea = kzalloc_node(TRIGGER_MEMORY_DEFAULT_SIZE, GFP_KERNEL, cpu_to_node(core));
+  if (w->watchedArea == NULL)
+    return -ENOMEM;
+  w->coreId = core;
+  w->armedGen = w->doneGen = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+  hrtimer_setup(&w->stepTimer, cstateStepEnd, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+  hrtimer_init(&w->stepTimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  w->stepTimer.function = cstateStepEnd;
+#endif
+
+  task = kthread_create_on_node(&cstateWorkerFunc, w, cpu_to_node(core), "%s%d", MWAIT_TASK_NAME, core);
+  if (IS_ERR(task))
+    {
+      printk(KERN_ERR "pcstate: can't create worker task %d\n", core);
+      kfree(w->watchedArea);
+      w->watchedArea = NULL;
+      return PTR_ERR(task);
+    }
+  kthread_bind(task, core);
+  w->task = task;
+  wake_up_process(task);
+
+  return 0;
+}
+
+static int cstatePoolInit (void)
 {
-  struct mWaitData *mwdata = (struct mWaitData *) data;
-  struct task_struct * mTask;
-  char name[64];
   uint32_t core;
-  char *watchedArea = NULL;
- 
-  core = mwdata->coreId;
-   
-  // create watched area we will monitor
-  watchedArea = kmalloc(TRIGGER_MEMORY_DEFAULT_SIZE, GFP_KERNEL);
-  if (watchedArea==NULL || mwdata==NULL)
-      return (-ENOMEM);
-  else
-      mwdata->watchedArea = watchedArea;
-  memset(watchedArea, 0, TRIGGER_MEMORY_DEFAULT_SIZE);
-
-  // create MWAIT task, kick it and wait it's finished
-  sprintf(name, "%s%d", MWAIT_TASK_NAME, core);
-
-  mTask = kthread_create(&funcMwaitTask, mwdata, name);
-  // we have to use _create instead of _run because we will immediately do _bind here
-  if (IS_ERR(mTask))
+
+  cstateWorkers = kcalloc(nr_cpu_ids, sizeof (*cstateWorkers), GFP_KERNEL);
+  cstateLatency = kcalloc(CSTATE_BENCH_STATES * nr_cpu_ids, sizeof (*cstateLatency), GFP_KERNEL);
+  if (cstateWorkers == NULL || cstateLatency == NULL)
     {
-      printk(KERN_ERR "pcstate: can't create trigger task %d\n", core);
-      return (-ENOMEM);
+      kfree(cstateWorkers);
+      kfree(cstateLatency);
+      cstateWorkers = NULL;
+      cstateLatency = NULL;
+      return -ENOMEM;
     }
-  else
+
+  for_each_online_cpu(core)
+    if (cstateWorkerCreate(core))
+      printk(KERN_ERR "pcstate: no C-state worker on core %d\n", core);
+
+  return 0;
+}
+
+static void cstatePoolExit (void)
+{
+  struct cstateWorker_t *w;
+  uint32_t core;
+
+  if (cstateWorkers == NULL)
+    return;
+
+  // wake everybody up: spinning at the barrier or parked in MWAIT
+  WRITE_ONCE(cstateReleaseGen, U64_MAX);
+  for (core = 0; core < nr_cpu_ids; core++)
     {
-      kthread_bind(mTask, core);
-      if (pcstateDebugStatus)
-        printk(KERN_INFO "pcstate: task %s=%p\n", name, (void*)mTask);
-      wake_up_process (mTask);
+      w = &cstateWorkers[core];
+      if (w->task == NULL)
+        continue;
+      hrtimer_cancel(&w->stepTimer);
+      WRITE_ONCE(w->watchedArea[0], 1);
+      kthread_stop(w->task);
+      kfree(w->watchedArea);
     }
+  kfree(cstateWorkers);
+  cstateWorkers = NULL;
+  kfree(cstateLatency);
+  cstateLatency = NULL;
+}
 
-  customSleep(mwdata->longevity);
-  watchedArea[0] = 1; /* trip the trigger
-                         tripping the trigger again "to make sure" would cause race condition:
-                         task activated, frees memory, and then we try to write to it with that second "tripping" */
+/*! 
+*******************************************************************************
+* 
+*  \brief   Arm the persistent worker of each core, release
+*           them together once all of them reached the barrier, and end the
+*           step on all of them at the same absolute time
+* 
+*   \param   cpus   online cores of the step
+*   \param   state  C-state to keep them in
+*   \param   time   step duration in microseconds
+* 
+*   \return  int error status (0=OK)
+*
+*   \warning Called with cstateLock held
+*
+*******************************************************************************/
+int startCState (const struct cpumask *cpus, uint8_t state, uint32_t time)
+{
+    struct cstateWorker_t *w;
+    uint32_t i, hint, armed = 0;
+    uint64_t gen;
+    ktime_t deadline, end;
 
-  if (pcstateDebugStatus)
-      printk(KERN_INFO "pcstate: out of trigger on core %d\n", core);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
-  return(SIGCHLD);
-#else
-  do_exit(SIGCHLD);
-#endif
+    if (cstateWorkers == NULL || cstateHint(state, &hint))
+      {
+        printk(KERN_WARNING "pcstate: invalid C-State %#x\n", state);
+        return -EINVAL;
+      }
+
+    // a writer that slept for the previous step can race its workers' wakeup, give them a moment
+    deadline = ktime_add_ms(ktime_get(), CSTATE_BUSY_WAIT_MS);
+    for_each_cpu(i, cpus)
+      {
+        w = &cstateWorkers[i];
+        if (w->task == NULL && cstateWorkerCreate(i))
+          return -ENOMEM;
+        while (READ_ONCE(w->armedGen) != smp_load_acquire(&w->doneGen))
+          {
+            if (!ktime_before(ktime_get(), deadline))
+              {
+                printk(KERN_ERR "pcstate: core %d is still busy with a previous step\n", i);
+                return -EBUSY;
+              }
+            usleep_range(20, 50);
+          }
+      }
+
+    gen = ++cstateGen;
+    atomic_set(&cstateReady, 0);
+    cstateLastStep = gen;
+    cstateLastState = state;
+    cstateLastTime = time;
+    cpumask_clear(&cstateLastCpus);
+    for_each_cpu(i, cpus)
+      {
+        w = &cstateWorkers[i];
+        memset(w->watchedArea, 0, TRIGGER_MEMORY_DEFAULT_SIZE);
+        w->state = state;
+        coresInMwait[i] = true;
+        if (pcstateDebugStatus)
+          printk(KERN_INFO "pcstate: arm worker cpu=%d state=%d\n", i, w->state);
+        WRITE_ONCE(w->armedGen, gen);
+        wake_up_process(w->task);
+        cpumask_set_cpu(i, &cstateLastCpus);
+        armed++;
+      }
+
+    // wait for the workers to check in, but don't hang the writer forever
+    deadline = ktime_add_ms(ktime_get(), 1000);
+    while (atomic_read(&cstateReady) < armed && ktime_before(ktime_get(), deadline))
+      {
+        cpu_relax();
+        cond_resched();
+      }
+    if (atomic_read(&cstateReady) < armed)
+      printk(KERN_WARNING "pcstate: only %d of %u cores reached the barrier\n", atomic_read(&cstateReady), armed);
+
+    WRITE_ONCE(cstateReleaseGen, gen);
+
+    end = ktime_add_us(ktime_get(), time);
+    for_each_cpu(i, cpus)
+      {
+        w = &cstateWorkers[i];
+        if (w->task != NULL && READ_ONCE(w->armedGen) == gen)
+          hrtimer_start(&w->stepTimer, end, HRTIMER_MODE_ABS);
+      }
+
+    return 0;
+}
+
+/* wait for a worker counter to reach target, 0 or -ETIMEDOUT after a second */
+static int cstateBenchWait (uint32_t *counter, uint32_t target)
+{
+  ktime_t deadline = ktime_add_ms(ktime_get(), 1000);
+
+  while (smp_load_acquire(counter) < target)
+    {
+      if (!ktime_before(ktime_get(), deadline))
+        return -ETIMEDOUT;
+      cpu_relax();
+      cond_resched();
+    }
+  return 0;
 }
 
+struct cstateBenchRun_t
+{
+  struct cstateWorker_t *w;
+  uint32_t samples;
+  uint32_t sleepUs;
+};
 
 /*! 
 *******************************************************************************
 * 
-*  \brief   Based on core mask, create separate task for each core. Make per core trigger area
+*  \brief   Waker side of the benchmark, runs on a core other than the target:
+*           once the target is parked, let it settle for sleepUs, then write
+*           the TSC into its monitored line
+* 
+*   \return  long, 0 or -ETIMEDOUT if the target stopped answering
+* 
+******************************************************************************/
+static long cstateBenchWaker (void *data)
+{
+  struct cstateBenchRun_t *run = (struct cstateBenchRun_t *) data;
+  struct cstateWorker_t *w = run->w;
+  uint64_t *trig = (uint64_t *) w->watchedArea;
+  uint32_t i;
+
+  for (i=0; i<run->samples; i++)
+    {
+      if (cstateBenchWait(&w->benchArmed, i + 1))
+        goto abort;
+      usleep_range(run->sleepUs, run->sleepUs + run->sleepUs / 8 + 1);
+      WRITE_ONCE(*trig, rdtsc_ordered());
+      if (cstateBenchWait(&w->benchTaken, i + 1))
+        goto abort;
+    }
+  return 0;
+
+abort:
+  WRITE_ONCE(*trig, CSTATE_BENCH_ABORT);
+  return -ETIMEDOUT;
+}
+
+static int cmpU64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t tscToNs (uint64_t cycles)
+{
+  return tsc_khz ? div_u64(cycles * 1000000ULL, tsc_khz) : cycles;
+}
+
+/*! 
+*******************************************************************************
 * 
-*   \param   struct stateInstructionKernel_t * ptr 
+*  \brief   Measure the exit latency of one core in one C-state and store its
+*           distribution in cstateLatency
 * 
 *   \return  int error status (0=OK)
 *
-*   \warning Assumption: 64-bit core mask (up to 64 cores altogether)
+*   \warning Called with cstateLock held
 *
 *******************************************************************************/
-int startCState (struct stateInstructionKernel_t * si)
+static int cstateBenchRun (uint32_t core, uint8_t state, uint32_t samples, uint32_t sleepUs)
 {
-    struct task_struct * cTask;
-    uint32_t coreDoes;
-    uint32_t i;
-    char cName[64];
-    
-    uint32_t maskPart;
-    ///int cpu = smp_processor_id();
+  struct cstateWorker_t *w;
+  struct cstateLatency_t *lat;
+  struct cstateBenchRun_t run;
+  uint64_t sum = 0;
+  uint32_t hint, i, n;
+  int waker, idx, ret;
+  uint64_t gen;
+
+  idx = cstateBenchIndex(state);
+  if (idx < 0 || cstateHint(state, &hint))
+    return -EINVAL;
+  waker = cpumask_any_but(cpu_online_mask, core);
+  if (waker >= nr_cpu_ids)
+    return -ENODEV;
+
+  w = &cstateWorkers[core];
+  if (w->task == NULL && (ret = cstateWorkerCreate(core)))
+    return ret;
+  if (READ_ONCE(w->armedGen) != smp_load_acquire(&w->doneGen))
+    return -EBUSY;
+
+  w->benchSamples = kvmalloc_array(samples, sizeof (uint64_t), GFP_KERNEL);
+  if (w->benchSamples == NULL)
+    return -ENOMEM;
+  w->benchCount = samples;
+  w->benchArmed = w->benchTaken = w->benchSpurious = 0;
+  w->bench = true;
+  memset(w->watchedArea, 0, TRIGGER_MEMORY_DEFAULT_SIZE);
+  w->state = state;
+  coresInMwait[core] = true;
+
+  // a single core: no barrier to wait for, release it as it is armed
+  gen = ++cstateGen;
+  WRITE_ONCE(cstateReleaseGen, gen);
+  WRITE_ONCE(w->armedGen, gen);
+  wake_up_process(w->task);
+
+  run.w = w;
+  run.samples = samples;
+  run.sleepUs = sleepUs;
+  ret = (int) work_on_cpu(waker, cstateBenchWaker, &run);
+
+  while (smp_load_acquire(&w->doneGen) != gen)
+    msleep(1);
+  w->bench = false;
+
+  n = w->benchTaken;
+  if (n == 0)
+    {
+      kvfree(w->benchSamples);
+      w->benchSamples = NULL;
+      return ret ? ret : -EIO;
+    }
+
+  sort(w->benchSamples, n, sizeof (uint64_t), cmpU64, NULL);
+  for (i=0; i<n; i++)
+    sum += w->benchSamples[i];
+
+  lat = &cstateLatency[idx * nr_cpu_ids + core];
+  lat->samples = n;
+  lat->spurious = w->benchSpurious;
+  lat->minNs = tscToNs(w->benchSamples[0]);
+  lat->p50Ns = tscToNs(w->benchSamples[(n - 1) * 50 / 100]);
+  lat->p90Ns = tscToNs(w->benchSamples[(n - 1) * 90 / 100]);
+  lat->p99Ns = tscToNs(w->benchSamples[(n - 1) * 99 / 100]);
+  lat->maxNs = tscToNs(w->benchSamples[n - 1]);
+  lat->avgNs = tscToNs(div_u64(sum, n));
+
+  if (pcstateDebugStatus)
+    printk(KERN_INFO "pcstate: core %d C%d exit latency p50 %llu ns p99 %llu ns over %u samples\n",
+           core, state, lat->p50Ns, lat->p99Ns, n);
+
+  kvfree(w->benchSamples);
+  w->benchSamples = NULL;
+  return ret;
+}
 
-    // figure out what cores do we have to use
-    for (i=0; i<MAX_CORES; i++)
+/* Serve one MSR request, either on the core itself or from the MWAIT collection */
+static int msrReadOne (struct msrMsg_t *msg)
+{
+  struct task_struct * msrReadTask;
+  struct msrMsg_t *ptr;
+
+  if (pcstateDebugStatus)
+    printk(KERN_INFO "msrReq: need core %d msr %08x ", msg->coreId, msg->msrId);
+  if (msg->coreId >= nr_cpu_ids || !cpu_online(msg->coreId))
+    {
+      printk(KERN_ERR "pcstate: msrRequest for offline core %d\n", msg->coreId);
+      return -EINVAL;
+    }
+  if (coresInMwait[msg->coreId]==false) // we should read independently from MWAIT
+    {
+      if (pcstateDebugStatus)
+        printk(KERN_INFO " - read ");
+      msrReadTask = kthread_create(&msrReadFuncNoMwait, msg, "msrReadTask");
+      if (IS_ERR(msrReadTask))
         {
-            maskPart = si->coreMaskArray[i/32]; // "active" word
-            coreDoes = maskPart & (1UL << i%32 );
-            if (coreDoes)
-                {
-                    /* if (core==cpu) */
-                    /*     printk(KERN_INFO "pcstate: startCState excludes core %d\n", i); */
-                    /* else */
-                        {
-                            // these are per core actions
-                            struct mWaitData *mwdata = kmalloc(sizeof (struct mWaitData), GFP_KERNEL);
-                            if (mwdata==NULL)
-                                return (-ENOMEM);
-                            sprintf(cName, "%s%d", CORE_TASK_NAME, i);
-                            mwdata->coreId = i;
-                            mwdata->state = si->state;
-                            mwdata->longevity = si->time;
-                            
-                            coresInMwait[i] = true;
-                            if (pcstateDebugStatus)
-                                printk(KERN_INFO "pcstate: run %s cpu=%d state=%d\n", cName, i, mwdata->state );
-                            cTask = kthread_run(&cTaskFunc, mwdata, cName);
-                            if (IS_ERR(cTask))
-                                {
-                                    printk(KERN_ERR "pcstate: can't create cTask on core %d\n", i);
-                                    return (-ENOMEM);
-                                }
-                            else if (pcstateDebugStatus)
-                                {
-                                  printk(KERN_INFO "pcstate: task %s=%p\n", cName, (void*)cTask);
-                                }
-
-                              
-                        }
-                }
-            else
-              coresInMwait[i] = false;
+          printk(KERN_ERR "pcstate: can't create msrRead task %d\n", msg->coreId);
+          return (-ENOMEM);
         }
+      kthread_bind(msrReadTask, msg->coreId);
+      printk(KERN_INFO "pcstate: msrRequest task %p", (void *) msrReadTask );
 
-    return 0;
+      // the task answers into this session's message, the caller waits for it
+      msg->status = false;
+      wake_up_process (msrReadTask);
+      while (READ_ONCE(msg->status)==false)
+        customSleep(1);
+
+      if (pcstateDebugStatus)
+        printk(KERN_INFO " val = 0x%llx\n",(long long unsigned int)msg->msrValue);
+    }
+  else  // here just use the data collected by MWAIT
+    {
+      ptr = findMsrPlace(msg->msrId, msg->coreId);
+      if (ptr)
+        *msg = *ptr;
+      else
+        memset(msg, 0, sizeof (struct msrMsg_t));
+      msg->status = true;
+    }
+
+  return 0;
 }
 
 /*! 
@@ -494,67 +1007,37 @@ int startCState (struct stateInstructionKernel_t * si)
 *******************************************************************************/
 ssize_t msrRequest (struct file *filp,const char __user *buf, size_t count, loff_t *offp)
 {
+    struct msrSession_t *session = (struct msrSession_t *)filp->private_data;
+    struct msrMsg_t msg;
+    size_t done = 0;
     int ret = 0;
-    char msg[2*sizeof (struct msrMsg_t)]; // some extra space just in case
 
-    if (count == sizeof (struct msrMsg_t))
+    // one or more requests, all answered into this session's queue
+    if (count == 0 || count % sizeof (struct msrMsg_t))
+      return -ENOSPC;
+
+    mutex_lock(&session->lock);
+    if (session->count + count / sizeof (struct msrMsg_t) > MSR_SESSION_QUEUE)
       {
-          if (copy_from_user(msg, buf, count))
-              return -EFAULT;
-          else
-              {
-                struct task_struct * msrReadTask;
-                ret = count;
-                memcpy(&m, msg, count);
-                if (pcstateDebugStatus)
-                  printk(KERN_INFO "msrReq: need core %d msr %08x ", m.coreId, m.msrId);
-                if (coresInMwait[m.coreId]==false) // we should read independently from MWAIT
-                  {
-                    if (pcstateDebugStatus)
-                      printk(KERN_INFO " - read ");
-                    msrReadTask = kthread_create(&msrReadFuncNoMwait, &m, "msrReadTask");
-                  
- 
-                    if (IS_ERR(msrReadTask))
-                      {
-                        printk(KERN_ERR "pcstate: can't create msrRead task %d\n", m.coreId);
-                        return (-ENOMEM);
-                      }
-                    else
-                      {
-                        kthread_bind(msrReadTask, m.coreId);
-                        printk(KERN_INFO "pcstate: msrRequest task %p", (void *) msrReadTask );
-                      }
-                      
-                    m.status = false;
-                    wake_up_process (msrReadTask);
-                    while (m.status==false)
-                      customSleep(1);
-                 
-                if (pcstateDebugStatus)
-                    printk(KERN_INFO " val = 0x%llx\n",(long long unsigned int)m.msrValue);
-                   
-                  }
-                else  // here just use the data collected by MWAIT
-                  {
-                    struct msrMsg_t *ptr;
-                    ptr = findMsrPlace(m.msrId, m.coreId);
-                    /* if (pcstateDebugStatus) */
-                    /*   printk(KERN_INFO " use mArr %08x val = %08x\n", */
-                    /*          ptr, (ptr? ptr->msrValue:0)); */
-                    if (m.coreId<MAX_CORES && ptr)
-                      m = *ptr;
-                    else
-                      memset(&m, 0, sizeof (struct msrMsg_t));
-                    m.status = true;
-                  }
-                
-              }
+        mutex_unlock(&session->lock);
+        return -ENOSPC;
       }
-    else
-      return -ENOSPC;
-    
-    return ret;
+    for (done = 0; done < count; done += sizeof (struct msrMsg_t))
+      {
+        if (copy_from_user(&msg, buf + done, sizeof (msg)))
+          {
+            ret = -EFAULT;
+            break;
+          }
+        ret = msrReadOne(&msg);
+        if (ret)
+          break;
+        session->results[(session->head + session->count) % MSR_SESSION_QUEUE] = msg;
+        session->count++;
+      }
+    mutex_unlock(&session->lock);
+
+    return done ? done : ret;
 }
 
 /*! 
@@ -569,23 +1052,60 @@ ssize_t msrRequest (struct file *filp,const char __user *buf, size_t count, loff
 *******************************************************************************/
 ssize_t msrResponse (struct file *filp, char __user *buf, size_t count, loff_t *offp ) 
 {
-  int res;
+  struct msrSession_t *session = (struct msrSession_t *)filp->private_data;
+  struct msrMsg_t *msg;
+  size_t done = 0;
 
-  res = copy_to_user(buf, (void*)&m, sizeof(struct msrMsg_t));
-  if (res == 0)
+  mutex_lock(&session->lock);
+  while (session->count && done + sizeof (struct msrMsg_t) <= count)
     {
-      *offp = 0;
+      msg = &session->results[session->head];
+      if (copy_to_user(buf + done, msg, sizeof (struct msrMsg_t)))
+        {
+          if (pcstateDebugStatus)
+            printk(KERN_INFO "msrResp: copy_to_user failed\n");
+          break;
+        }
       if (pcstateDebugStatus)
         printk(KERN_INFO "msrResp: msr %08x on core %d = 0x%llx\n",
-               m.msrId, m.coreId, (long long unsigned int)m.msrValue);
-      return sizeof(struct msrMsg_t);
-    }
-  else
-    {
-      if (pcstateDebugStatus)
-        printk(KERN_INFO "msrResp: copy_to_user = %d\n", res);
-      return 0;
+               msg->msrId, msg->coreId, (long long unsigned int)msg->msrValue);
+      session->head = (session->head + 1) % MSR_SESSION_QUEUE;
+      session->count--;
+      done += sizeof (struct msrMsg_t);
     }
+  mutex_unlock(&session->lock);
+
+  *offp = 0;
+  return done;
+}
+
+static int msrOpen (struct inode *inode, struct file *filp)
+{
+  struct msrSession_t *session = kzalloc(sizeof (*session), GFP_KERNEL);
+
+  if (session == NULL)
+    return -ENOMEM;
+  mutex_init(&session->lock);
+  filp->private_data = session;
+  return 0;
+}
+
+static int cstateOpen (struct inode *inode, struct file *filp)
+{
+  struct cstateSession_t *session = kzalloc(sizeof (*session), GFP_KERNEL);
+
+  if (session == NULL)
+    return -ENOMEM;
+  mutex_init(&session->lock);
+  filp->private_data = session;
+  return 0;
+}
+
+static int sessionRelease (struct inode *inode, struct file *filp)
+{
+  kfree(filp->private_data);
+  filp->private_data = NULL;
+  return 0;
 }
 
 int bit_count (uint32_t mask)
@@ -600,10 +1120,29 @@ int bit_count (uint32_t mask)
 	return sum;
 }
 
+/* C-state step core mask to a cpumask, every core must be online */
+static int stepMaskToCpus (const uint32_t *mask, uint32_t words, struct cpumask *cpus)
+{
+  uint32_t i;
+
+  cpumask_clear(cpus);
+  for (i = 0; i < words * 32; i++)
+    {
+      if (!(mask[i / 32] & (1UL << i % 32)))
+        continue;
+      if (i >= nr_cpu_ids || !cpu_online(i))
+        return -EINVAL;
+      cpumask_set_cpu(i, cpus);
+    }
+  return 0;
+}
+
 /*! 
 *******************************************************************************
 * 
-*  \brief   Data transfer from user to kernel, carrying cstate instruction
+*  \brief   Data transfer from user to kernel, carrying cstate instruction,
+*           either a stateInstructionKernel_t (STEP_C, up to MAX_CORES cores)
+*           or a stateInstructionMask_t with its core mask (STEP_C_CPUMASK)
 * 
 *   \param    
 *   \param    
@@ -615,73 +1154,98 @@ int bit_count (uint32_t mask)
 *******************************************************************************/
 ssize_t writeCstateCommand (struct file *filp,const char __user *buf, size_t count, loff_t *offp)
 {
-    int ret = 0;
-    int i, j, len, sum;
-    uint32_t mask;
+    struct cstateSession_t *session = (struct cstateSession_t *)filp->private_data;
     struct stateInstructionKernel_t si;
+    struct stateInstructionMask_t sm;
+    uint32_t *mask = NULL;
+    cpumask_var_t cpus;
+    uint8_t state;
+    uint32_t time;
+    char type;
+    int status;
+
+    if (count == 0 || copy_from_user(&type, buf, 1))
+        return -EFAULT;
+
+    if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+        return -ENOMEM;
 
-    if (count == sizeof (struct stateInstructionKernel_t)) {
-
+    if (type == STEP_C && count == sizeof (struct stateInstructionKernel_t)) {
         if (copy_from_user((char *) &si, buf, count)) {
-	    printk (KERN_INFO "Error: copy_from_user() failed\n");
-            return -EFAULT;
+            printk (KERN_INFO "Error: copy_from_user() failed\n");
+            status = -EFAULT;
+            goto out;
         }
-        else {
-            ret = len = count;
-
-            // security check starts
-            if (si.type != STEP_C) {
-                printk (KERN_INFO "Error: type is not STEP_C\n");
-                return -EFAULT;
-            }
-            if (si.state > 12) {
-                printk (KERN_INFO "Error: state is bigger than 12\n");
-                return -EFAULT;
-            }
-
-            // check for all of range cores
-            sum = num_online_cpus();
-            if (sum < MAX_CORES) {
-                i = sum / 32;
-                j = sum % 32;
-                mask = (uint32_t) (1 << j) - 1;
-                if (si.coreMaskArray [i] & ~mask) {
-                    printk (KERN_INFO "Error: CPU cores specified out of range\n");
-                    return -EFAULT;
-                }
-
-		i++;
-		for (; i < MAX_CORES / 32; i++) {
-                    if (si.coreMaskArray [i] != 0) {
-                        printk (KERN_INFO "Error: CPU cores specified out of range\n");
-                        return -EFAULT;
-                    }
-		}
-            }
-            else {
-                printk (KERN_INFO "Error: number of CPU cores is more than MAX_CORES=%d\n", MAX_CORES);
-                return -EFAULT;
-            }
-			
-            if (si.time > 15000000) {
-                printk (KERN_INFO "Error: time is bigger than 15000000\n");
-                return -EFAULT;
-            }
-
-            // security check ends
-            else if (si.type == STEP_C) {
-                // printk(KERN_INFO "pcstate: keep state %c%d on cores 0x%x for %u microsec\n",
-                //        si.type, si.state, si.coreMaskArray[0], si.time);
-                startCState(&si);
-            }
+        state = si.state;
+        time = si.time;
+        status = stepMaskToCpus(si.coreMaskArray, MAX_CORES / 32, cpus);
+    }
+    else if (type == STEP_C_CPUMASK && count > sizeof (struct stateInstructionMask_t)) {
+        if (copy_from_user((char *) &sm, buf, sizeof (sm))) {
+            printk (KERN_INFO "Error: copy_from_user() failed\n");
+            status = -EFAULT;
+            goto out;
+        }
+        if (sm.maskWords == 0 || sm.maskWords > MAX_CPUMASK_WORDS ||
+            count != sizeof (sm) + sm.maskWords * sizeof (uint32_t)) {
+            printk (KERN_INFO "Error: size of c-state core mask is not correct.\n");
+            status = -ENOSPC;
+            goto out;
+        }
+        mask = memdup_user(buf + sizeof (sm), sm.maskWords * sizeof (uint32_t));
+        if (IS_ERR(mask)) {
+            status = PTR_ERR(mask);
+            mask = NULL;
+            goto out;
         }
+        state = sm.state;
+        time = sm.time;
+        status = stepMaskToCpus(mask, sm.maskWords, cpus);
     }
     else {
         printk (KERN_INFO "Error: size of c-state command is not correct.\n");
-        return -ENOSPC;
+        status = -ENOSPC;
+        goto out;
     }
-    
-    return ret;
+
+    // security check starts
+    if (status) {
+        printk (KERN_INFO "Error: CPU cores specified out of range\n");
+        status = -EFAULT;
+        goto out;
+    }
+    if (state > 12) {
+        printk (KERN_INFO "Error: state is bigger than 12\n");
+        status = -EFAULT;
+        goto out;
+    }
+    if (time > 15000000) {
+        printk (KERN_INFO "Error: time is bigger than 15000000\n");
+        status = -EFAULT;
+        goto out;
+    }
+    // security check ends
+
+    mutex_lock(&cstateLock);
+    status = startCState(cpus, state, time);
+    mutex_unlock(&cstateLock);
+
+    mutex_lock(&session->lock);
+    session->lastType = type;
+    session->lastState = state;
+    session->lastTime = time;
+    session->lastCores = cpumask_weight(cpus);
+    session->lastStatus = status;
+    session->hasResult = true;
+    mutex_unlock(&session->lock);
+    // a step that could not run is not silently dropped
+    if (status != -EBUSY)
+      status = 0;
+
+out:
+    kfree(mask);
+    free_cpumask_var(cpus);
+    return status ? status : count;
 }
 
 /*! 
@@ -699,24 +1263,22 @@ ssize_t writeCstateCommand (struct file *filp,const char __user *buf, size_t cou
 *******************************************************************************/
 ssize_t readCstateCommand (struct file *filp, char __user *buf, size_t count, loff_t *offp ) 
 {
-    int temp=0, len=0;
-    char msg[512]; 
-    
+    struct cstateSession_t *session = (struct cstateSession_t *)filp->private_data;
+    char msg[128];
+    int len = 0;
+
     if (pcstateDebugStatus)
       printk(KERN_INFO "pcstate: into readCstateCommand\n");
-    if(count>temp)
-        {
-            count=temp;
-        }
-    temp=temp-count;
-    if (copy_to_user(buf, msg, count))
-        {
-            if(count==0)
-                temp=len;
-            return count;
-        }
-    else
-        return 0;
+
+    // report the outcome of the last command written through this open file
+    mutex_lock(&session->lock);
+    if (session->hasResult)
+        len = snprintf(msg, sizeof (msg), "type=%c state=%u time=%u cores=%u status=%d\n",
+                       session->lastType, session->lastState, session->lastTime, session->lastCores,
+                       session->lastStatus);
+    mutex_unlock(&session->lock);
+
+    return simple_read_from_buffer(buf, count, offp, msg, len);
 }
 
 /*
@@ -725,11 +1287,15 @@ ssize_t readCstateCommand (struct file *filp, char __user *buf, size_t count, lo
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
 
 struct proc_ops proc_fops = {
+ .proc_open = cstateOpen,
+ .proc_release = sessionRelease,
  .proc_read = readCstateCommand,
  .proc_write = writeCstateCommand,
 };
 
 struct proc_ops msr_fops = {
+ .proc_open = msrOpen,
+ .proc_release = sessionRelease,
  .proc_read = msrResponse,
  .proc_write = msrRequest,
 };
@@ -738,18 +1304,282 @@ struct proc_ops msr_fops = {
 
 struct file_operations proc_fops = {
  .owner = THIS_MODULE,
+ .open = cstateOpen,
+ .release = sessionRelease,
  .read = readCstateCommand,
  .write = writeCstateCommand,
 };
 
 struct file_operations msr_fops = {
  .owner = THIS_MODULE,
+ .open = msrOpen,
+ .release = sessionRelease,
  .read = msrResponse,
  .write = msrRequest,
 };
 
 #endif
 
+/*! 
+*******************************************************************************
+* 
+*  \brief   Start an exit latency benchmark, the request is a text line
+*           "state=<c-state> [cpus=<cpu list>] [samples=<n>] [sleep_us=<us>]",
+*           cores are measured one after the other
+* 
+*   \return  ssize_t, count or a negative error code
+* 
+*******************************************************************************/
+ssize_t writeCstateLatency (struct file *filp, const char __user *buf, size_t count, loff_t *offp)
+{
+  char line[256], *p, *tok, *val;
+  cpumask_var_t cpus;
+  uint32_t samples = CSTATE_BENCH_DEFAULT_SAMPLES;
+  uint32_t sleepUs = CSTATE_BENCH_DEFAULT_SLEEP_US;
+  uint32_t state = ~0U, core;
+  int ret = 0;
+
+  if (cstateWorkers == NULL)
+    return -ENODEV;
+  if (count >= sizeof (line))
+    return -EINVAL;
+  if (copy_from_user(line, buf, count))
+    return -EFAULT;
+  line[count] = '\0';
+
+  if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+    return -ENOMEM;
+  cpumask_copy(cpus, cpu_online_mask);
+
+  p = line;
+  while ((tok = strsep(&p, " \t\n")) != NULL)
+    {
+      if (*tok == '\0')
+        continue;
+      val = strchr(tok, '=');
+      if (val == NULL)
+        {
+          ret = -EINVAL;
+          break;
+        }
+      *val++ = '\0';
+      if (!strcmp(tok, "state"))
+        ret = kstrtou32(val, 0, &state);
+      else if (!strcmp(tok, "cpus"))
+        ret = cpulist_parse(val, cpus);
+      else if (!strcmp(tok, "samples"))
+        ret = kstrtou32(val, 0, &samples);
+      else if (!strcmp(tok, "sleep_us"))
+        ret = kstrtou32(val, 0, &sleepUs);
+      else
+        ret = -EINVAL;
+      if (ret)
+        break;
+    }
+
+  if (!ret && (state > 0xf || cstateBenchIndex(state) < 0 ||
+               samples == 0 || samples > CSTATE_BENCH_MAX_SAMPLES ||
+               sleepUs < CSTATE_BENCH_MIN_SLEEP_US || sleepUs > CSTATE_BENCH_MAX_SLEEP_US))
+    ret = -EINVAL;
+  if (ret)
+    {
+      printk(KERN_INFO "Error: bad latency request, expected state=<0|1|3|6|7> [cpus=<list>] [samples=1..%d] [sleep_us=%d..%d]\n",
+             CSTATE_BENCH_MAX_SAMPLES, CSTATE_BENCH_MIN_SLEEP_US, CSTATE_BENCH_MAX_SLEEP_US);
+      free_cpumask_var(cpus);
+      return ret;
+    }
+
+  mutex_lock(&cstateLock);
+  for_each_cpu_and(core, cpus, cpu_online_mask)
+    {
+      ret = cstateBenchRun(core, state, samples, sleepUs);
+      if (ret)
+        {
+          printk(KERN_ERR "pcstate: latency benchmark on core %d failed (%d)\n", core, ret);
+          break;
+        }
+    }
+  mutex_unlock(&cstateLock);
+
+  free_cpumask_var(cpus);
+  return ret ? ret : count;
+}
+
+/* one line per measured (C-state, core), latencies in ns */
+static int showCstateLatency (struct seq_file *m, void *v)
+{
+  struct cstateLatency_t *lat;
+  uint32_t idx, core;
+
+  seq_printf(m, "# tsc_khz %u\n", tsc_khz);
+  seq_puts(m, "# state core samples spurious min_ns p50_ns p90_ns p99_ns max_ns avg_ns\n");
+
+  if (cstateLatency == NULL)
+    return 0;
+
+  mutex_lock(&cstateLock);
+  for (idx=0; idx<CSTATE_BENCH_STATES; idx++)
+    for (core=0; core<nr_cpu_ids; core++)
+      {
+        lat = &cstateLatency[idx * nr_cpu_ids + core];
+        if (lat->samples == 0)
+          continue;
+        seq_printf(m, "C%d %u %u %u %llu %llu %llu %llu %llu %llu\n",
+                   cstateBenchStates[idx], core, lat->samples, lat->spurious,
+                   lat->minNs, lat->p50Ns, lat->p90Ns, lat->p99Ns, lat->maxNs, lat->avgNs);
+      }
+  mutex_unlock(&cstateLock);
+
+  return 0;
+}
+
+static int openCstateLatency (struct inode *inode, struct file *filp)
+{
+  return single_open(filp, showCstateLatency, NULL);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+
+struct proc_ops latency_fops = {
+ .proc_open = openCstateLatency,
+ .proc_release = single_release,
+ .proc_read = seq_read,
+ .proc_lseek = seq_lseek,
+ .proc_write = writeCstateLatency,
+};
+
+#else
+
+struct file_operations latency_fops = {
+ .owner = THIS_MODULE,
+ .open = openCstateLatency,
+ .release = single_release,
+ .read = seq_read,
+ .llseek = seq_lseek,
+ .write = writeCstateLatency,
+};
+
+#endif
+
+/* counter delta as a percentage of the TSC delta, with two decimals */
+static void showPercent (struct seq_file *m, uint64_t delta, uint64_t tsc)
+{
+  uint64_t pct = tsc ? div64_u64(delta * 10000ULL, tsc) : 0;
+
+  seq_printf(m, " %llu.%02llu", div_u64(pct, 100), pct % 100);
+}
+
+/* one residency line: C0 from MPERF, C1 is what the other counters leave of the TSC */
+static void showResidency (struct seq_file *m, uint64_t tsc, uint64_t mperf,
+                           const uint64_t *core, const uint64_t *pkg)
+{
+  uint64_t c1 = tsc - min(tsc, mperf);
+  int i;
+
+  for (i=0; i<RESIDENCY_CORE_STATES; i++)
+    c1 -= min(c1, core[i]);
+
+  seq_printf(m, " %llu", tsc);
+  showPercent(m, mperf, tsc);
+  showPercent(m, c1, tsc);
+  for (i=0; i<RESIDENCY_CORE_STATES; i++)
+    showPercent(m, core[i], tsc);
+  for (i=0; i<RESIDENCY_PKG_STATES; i++)
+    showPercent(m, pkg[i], tsc);
+  seq_putc(m, '\n');
+}
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   Residency breakdown of the last C-state step: per core and
+*           aggregate deltas between the snapshots each worker took when it
+*           entered MWAIT and when the step ended, in percent of TSC
+* 
+*******************************************************************************/
+static int showCstateResidency (struct seq_file *m, void *v)
+{
+  struct cstateWorker_t *w;
+  uint64_t tsc, mperf, core[RESIDENCY_CORE_STATES], pkg[RESIDENCY_PKG_STATES];
+  uint64_t sumTsc = 0, sumMperf = 0, sumCore[RESIDENCY_CORE_STATES] = {0}, sumPkg[RESIDENCY_PKG_STATES] = {0};
+  uint32_t cpu, done = 0;
+  int i;
+
+  mutex_lock(&cstateLock);
+  if (cstateLastStep == 0)
+    {
+      mutex_unlock(&cstateLock);
+      seq_puts(m, "# no C-state step yet\n");
+      return 0;
+    }
+
+  seq_printf(m, "# step %llu state C%u time_us %u\n", cstateLastStep, cstateLastState, cstateLastTime);
+  seq_puts(m, "# core tsc c0 c1 c3 c6 c7 pc2 pc3 pc6 pc7 (percent of tsc)\n");
+
+  for_each_cpu(cpu, &cstateLastCpus)
+    {
+      w = &cstateWorkers[cpu];
+      if (smp_load_acquire(&w->doneGen) < cstateLastStep || w->resGen != cstateLastStep)
+        {
+          seq_printf(m, "%u running\n", cpu);
+          continue;
+        }
+
+      tsc = w->resEnd.tsc - w->resStart.tsc;
+      mperf = w->resEnd.mperf - w->resStart.mperf;
+      for (i=0; i<RESIDENCY_CORE_STATES; i++)
+        core[i] = w->resEnd.core[i] - w->resStart.core[i];
+      for (i=0; i<RESIDENCY_PKG_STATES; i++)
+        pkg[i] = w->resEnd.pkg[i] - w->resStart.pkg[i];
+
+      seq_printf(m, "%u", cpu);
+      showResidency(m, tsc, mperf, core, pkg);
+
+      sumTsc += tsc;
+      sumMperf += mperf;
+      for (i=0; i<RESIDENCY_CORE_STATES; i++)
+        sumCore[i] += core[i];
+      for (i=0; i<RESIDENCY_PKG_STATES; i++)
+        sumPkg[i] += pkg[i];
+      done++;
+    }
+  mutex_unlock(&cstateLock);
+
+  if (done)
+    {
+      seq_puts(m, "all");
+      showResidency(m, sumTsc, sumMperf, sumCore, sumPkg);
+    }
+
+  return 0;
+}
+
+static int openCstateResidency (struct inode *inode, struct file *filp)
+{
+  return single_open(filp, showCstateResidency, NULL);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+
+struct proc_ops residency_fops = {
+ .proc_open = openCstateResidency,
+ .proc_release = single_release,
+ .proc_read = seq_read,
+ .proc_lseek = seq_lseek,
+};
+
+#else
+
+struct file_operations residency_fops = {
+ .owner = THIS_MODULE,
+ .open = openCstateResidency,
+ .release = single_release,
+ .read = seq_read,
+ .llseek = seq_lseek,
+};
+
+#endif
+
 static void cleanProcFiles(void)
 {
     printk(KERN_INFO "removing %s subtree \n", MODULE_NAME);
@@ -759,6 +1589,10 @@ static void cleanProcFiles(void)
         remove_proc_entry(MSR_READER_NAME, pcstate_dir);
     if (cstate_command_file)
         remove_proc_entry(CSTATE_COMMAND_NAME, pcstate_dir);
+    if (cstate_latency_file)
+        remove_proc_entry(CSTATE_LATENCY_NAME, pcstate_dir);
+    if (cstate_residency_file)
+        remove_proc_entry(CSTATE_RESIDENCY_NAME, pcstate_dir);
 
     remove_proc_entry(MODULE_NAME, NULL);
 }
@@ -781,12 +1615,18 @@ static int __init pcstateMwaitmonModuleInit(void)
     int ret;
 
     printk(KERN_INFO "Loading %s module\n", MODULE_NAME);
+
+    // MSR collection and MWAIT flags are sized from the CPUs this system can have
+    ret = allocMsrArray();
+    if (ret)
+      return ret;
      
     /* create a directory */
     pcstate_dir = proc_mkdir(MODULE_NAME, NULL);
     if(pcstate_dir == NULL)
     {
       printk(KERN_ERR "failed to create %s proc entry\n", MODULE_NAME);
+      freeMsrArray();
       return -ENOMEM;
     }
     
@@ -805,13 +1645,29 @@ static int __init pcstateMwaitmonModuleInit(void)
     if(msr_command_file == NULL)
       printk(KERN_ERR "failed to create %s proc entry\n", MSR_READER_NAME);
 
-    if (cstate_command_file == NULL || msr_command_file == NULL)
+    cstate_latency_file = proc_create(CSTATE_LATENCY_NAME, 0644, pcstate_dir, &latency_fops);
+    if(cstate_latency_file == NULL)
+      printk(KERN_ERR "failed to create %s proc entry\n", CSTATE_LATENCY_NAME);
+
+    cstate_residency_file = proc_create(CSTATE_RESIDENCY_NAME, 0444, pcstate_dir, &residency_fops);
+    if(cstate_residency_file == NULL)
+      printk(KERN_ERR "failed to create %s proc entry\n", CSTATE_RESIDENCY_NAME);
+
+    if (cstate_command_file == NULL || msr_command_file == NULL || cstate_latency_file == NULL ||
+        cstate_residency_file == NULL)
       {
-        remove_proc_entry(MODULE_NAME, NULL);
+        cleanProcFiles();
+        freeMsrArray();
         return -ENOMEM;
       }
 
-    cleanMsrArray();
+    ret = cstatePoolInit();
+    if (ret)
+      {
+        cleanProcFiles();
+        freeMsrArray();
+        return ret;
+      }
 
     // Set up the dev file for ioctl
     ret = 0;	/* everything ok */
@@ -836,6 +1692,9 @@ static void __exit pcstateMwaitmonModuleExit(void)
     printk(KERN_INFO "Exit %s module \n", MODULE_NAME);
 
     cleanProcFiles();
+
+    cstatePoolExit();
+    freeMsrArray();
 }
 
 /* Module specifiers */
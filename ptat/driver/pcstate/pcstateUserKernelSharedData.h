@@ -55,25 +55,40 @@
 #define MODULE_NAME "pcstate_module"   // create /proc/{MODULE_NAME}
 #define CSTATE_COMMAND_NAME   "cstate_command"  // create /proc/{MODULE_NAME}/{CSTATE_COMMAND_NAME}
 #define MSR_READER_NAME   "msr"  // create /proc/{MODULE_NAME}/{MSR_READER_NAME}
+#define CSTATE_LATENCY_NAME   "cstate_latency"  // create /proc/{MODULE_NAME}/{CSTATE_LATENCY_NAME}
+#define CSTATE_RESIDENCY_NAME   "cstate_residency"  // create /proc/{MODULE_NAME}/{CSTATE_RESIDENCY_NAME}
 #define LKM_NAME  "pcstateMwaitLKM"
 
 #define PROC_MODULE_NAME_MSR_FILE "/proc/" MODULE_NAME "/" MSR_READER_NAME
 #define PROC_MODULE_NAME_CSTATE_FILE "/proc/" MODULE_NAME "/" CSTATE_COMMAND_NAME
+#define PROC_MODULE_NAME_LATENCY_FILE "/proc/" MODULE_NAME "/" CSTATE_LATENCY_NAME
+#define PROC_MODULE_NAME_RESIDENCY_FILE "/proc/" MODULE_NAME "/" CSTATE_RESIDENCY_NAME  // residency of the last step
 
 #define MAX_COMMAND_LEN 32
 #define MAX_COMMANDS 32
-// TODO is this limitation necessary?  this limit could very plausibly be reached by a system
+// width of the fixed coreMaskArray below, the driver itself sizes everything from the CPUs
+// of the system; larger systems pass their cores with STEP_C_CPUMASK
 #define MAX_CORES 512  // must be a multiple of 32 for correct computation of core masks
+#define MAX_CPUMASK_WORDS 256  // up to 8192 CPUs in a stateInstructionMask_t
 #define MAX_CORES_PP 64  // per package cores, currently 28, so 32 was toо close to set it as a limit
 #define TRIGGER_MEMORY_DEFAULT_SIZE 64
 #define MSR_COLLECTION_SIZE 50   // max of how many MSRs we keep under watch
 
+// C-state exit latency benchmark: write "state=6 cpus=0-3 samples=1000 sleep_us=500"
+// to PROC_MODULE_NAME_LATENCY_FILE, read it back for min/p50/p90/p99/max per core
+#define CSTATE_BENCH_DEFAULT_SAMPLES 1000
+#define CSTATE_BENCH_MAX_SAMPLES 100000
+#define CSTATE_BENCH_DEFAULT_SLEEP_US 500   // time parked before each wake
+#define CSTATE_BENCH_MIN_SLEEP_US 10
+#define CSTATE_BENCH_MAX_SLEEP_US 100000
+
 #define MAX_CS_STATE_NUM 9  // just to have something to compare against CS1, CS3, CS7. Let's  set CS9  as the last one
 #define MAX_TEST_STEP_LEN 80  // in text form
 
 #define STEP_END 0
 #define STEP_P 'p'
 #define STEP_C 'c'
+#define STEP_C_CPUMASK 'm'  // STEP_C carried by a stateInstructionMask_t
 #define STEP_DEBUG 'd'
 
 #define MY_IOC_MAGIC 'I'
@@ -102,6 +117,17 @@ struct stateInstructionKernel_t {
     uint32_t time; // duration in microseconds
 };
 
+// C-state step with a core mask of any size: the header is followed by maskWords
+// 32-bit words, bit N for CPU N, so a cpu_set_t can be appended as is
+struct stateInstructionMask_t {
+    char type;  // STEP_C_CPUMASK
+    uint8_t state;  // numerical value for the state: 3 for C3, 6 for C6, etc
+    uint16_t reserved;
+    uint32_t time;  // duration in microseconds
+    uint32_t maskWords;
+    uint32_t coreMask[];
+};
+
 struct msrMsg_t {
 	uint32_t coreId;
     uint32_t msrId;
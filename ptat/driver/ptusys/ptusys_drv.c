@@ -19,6 +19,13 @@
 //#include <linux/bootmem.h>
 #include <linux/pfn.h>
 #include <linux/version.h>
+#include <linux/ioport.h>
+#include <linux/huge_mm.h>
+#include <linux/uaccess.h>
+#include <linux/io.h>
+#include <linux/string.h>
+
+#include "ptusys_ioctl.h"
 
 #ifdef CONFIG_IA64
 # include <linux/efi.h>
@@ -42,6 +49,82 @@ static struct device* ptusysDevice = NULL; ///< The device-driver device struct
 static const struct vm_operations_struct mmap_mem_ops = { .access =
 		generic_access_phys };
 
+/*
+ * Kernels that can map raw PFNs with PMD entries get WB mappings of system RAM
+ * populated on fault with 2MB pages wherever the physical range allows it,
+ * instead of one 4K PTE per page set up front by remap_pfn_range.
+ */
+#if defined(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP) && defined(CONFIG_TRANSPARENT_HUGEPAGE)
+#define PTUSYS_HUGE_MAPPINGS
+#endif
+
+#ifdef PTUSYS_HUGE_MAPPINGS
+static vm_fault_t mmap_mem_huge_fault(struct vm_fault *vmf, unsigned int order) {
+	struct vm_area_struct *vma = vmf->vma;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long pfn = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+
+	if (order != PMD_ORDER || addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end ||
+			!IS_ALIGNED(pfn, 1UL << PMD_ORDER))
+		return VM_FAULT_FALLBACK;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,17,0)
+	return vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#else
+	return vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(pfn, PFN_DEV), vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+
+static vm_fault_t mmap_mem_fault(struct vm_fault *vmf) {
+	struct vm_area_struct *vma = vmf->vma;
+	unsigned long pfn = vma->vm_pgoff + ((vmf->address - vma->vm_start) >> PAGE_SHIFT);
+
+	return vmf_insert_pfn(vma, vmf->address & PAGE_MASK, pfn);
+}
+
+static const struct vm_operations_struct mmap_mem_huge_ops = {
+	.fault = mmap_mem_fault,
+	.huge_fault = mmap_mem_huge_fault,
+	.access = generic_access_phys,
+};
+#endif
+
+/** @brief Check the caching attribute selected for the file against the memory type
+ *  of the range and apply it to the mapping protection
+ *
+ *  @return returns 0 if the attribute can be used on this range
+ */
+static int mmap_mem_caching(struct file * file, struct vm_area_struct * vma,
+		phys_addr_t offset, size_t size) {
+	unsigned long mode = (unsigned long) file->private_data;
+	int ram;
+
+	if (mode == PTUSYS_CACHE_DEFAULT)
+		return 0;
+
+	/* UC or WC aliases of RAM would conflict with the kernel's WB direct map */
+	ram = region_intersects(offset, size, IORESOURCE_SYSTEM_RAM, IORES_DESC_NONE);
+	switch (mode) {
+	case PTUSYS_CACHE_UC:
+		if (ram != REGION_DISJOINT)
+			return -EINVAL;
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+		break;
+	case PTUSYS_CACHE_WC:
+		if (ram != REGION_DISJOINT)
+			return -EINVAL;
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+		break;
+	case PTUSYS_CACHE_WB:
+		if (ram != REGION_INTERSECTS)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
 /** @brief The standard mmap_mem function from mem.c
  *  This function stripped down to map any given physical address range in system
  *
@@ -61,9 +144,23 @@ static int mmap_mem(struct file * file, struct vm_area_struct * vma) {
 	if (offset + (phys_addr_t) size - 1 < offset)
 		return -EINVAL;
 
-	vma->vm_page_prot = vma->vm_page_prot;
+	if (mmap_mem_caching(file, vma, offset, size)) {
+		printk("PTUSYS: caching attribute %lu does not fit the memory type at %llx\n",
+				(unsigned long) file->private_data, (unsigned long long) offset);
+		return -EINVAL;
+	}
 	vma->vm_ops = &mmap_mem_ops;
 
+#ifdef PTUSYS_HUGE_MAPPINGS
+	/* Cached RAM, populated on fault so 2MB aligned parts get PMD mappings */
+	if ((unsigned long) file->private_data == PTUSYS_CACHE_WB && size >= PMD_SIZE &&
+			!is_cow_mapping(vma->vm_flags)) {
+		vm_flags_set(vma, VM_PFNMAP | VM_IO | VM_DONTEXPAND | VM_DONTDUMP);
+		vma->vm_ops = &mmap_mem_huge_ops;
+		return 0;
+	}
+#endif
+
 	/* Remap-pfn-range will mark the range VM_IO */
 	if (remap_pfn_range(vma, vma->vm_start, vma->vm_pgoff, size,
 			vma->vm_page_prot)) {
@@ -84,8 +181,171 @@ static int open_port(struct inode * inode, struct file * filp) {
 	return capable(CAP_SYS_RAWIO) ? 0 : -EPERM;
 }
 
+/*
+ * Mapping of the page the current access falls in, kept while the next
+ * entries stay in the same page.
+ */
+struct access_map {
+	phys_addr_t page;
+	void *virt;
+	bool io;
+};
+
+static void access_unmap(struct access_map *map) {
+	if (map->virt == NULL)
+		return;
+	if (map->io)
+		iounmap((void __iomem *) map->virt);
+	else
+		memunmap(map->virt);
+	map->virt = NULL;
+}
+
+/** @brief Do one access of a vector, reusing the mapping of the previous entry
+ *  when it is in the same page
+ *
+ *  @return returns 0 if successful
+ */
+static int access_one(struct ptusys_access * a, struct access_map * map) {
+	phys_addr_t page = a->phys & PAGE_MASK;
+	void *p;
+
+	if (a->width != 1 && a->width != 2 && a->width != 4 && a->width != 8)
+		return -EINVAL;
+	if (a->op != PTUSYS_OP_READ && a->op != PTUSYS_OP_WRITE)
+		return -EINVAL;
+	if (!IS_ALIGNED(a->phys, a->width) || (phys_addr_t) a->phys != a->phys)
+		return -EINVAL;
+
+	if (map->virt == NULL || map->page != page) {
+		access_unmap(map);
+		map->io = region_intersects(page, PAGE_SIZE, IORESOURCE_SYSTEM_RAM,
+				IORES_DESC_NONE) != REGION_INTERSECTS;
+		if (map->io)
+			map->virt = (void __force *) ioremap(page, PAGE_SIZE);
+		else
+			map->virt = memremap(page, PAGE_SIZE, MEMREMAP_WB);
+		if (map->virt == NULL)
+			return -ENOMEM;
+		map->page = page;
+	}
+	p = map->virt + (a->phys & ~PAGE_MASK);
+
+	if (map->io) {
+		void __iomem *io = (void __iomem *) p;
+
+		if (a->op == PTUSYS_OP_READ) {
+			switch (a->width) {
+			case 1: a->value = readb(io); break;
+			case 2: a->value = readw(io); break;
+			case 4: a->value = readl(io); break;
+			case 8: a->value = readq(io); break;
+			}
+		} else {
+			switch (a->width) {
+			case 1: writeb(a->value, io); break;
+			case 2: writew(a->value, io); break;
+			case 4: writel(a->value, io); break;
+			case 8: writeq(a->value, io); break;
+			}
+		}
+	} else {
+		if (a->op == PTUSYS_OP_READ) {
+			switch (a->width) {
+			case 1: a->value = READ_ONCE(*(u8 *) p); break;
+			case 2: a->value = READ_ONCE(*(u16 *) p); break;
+			case 4: a->value = READ_ONCE(*(u32 *) p); break;
+			case 8: a->value = READ_ONCE(*(u64 *) p); break;
+			}
+		} else {
+			switch (a->width) {
+			case 1: WRITE_ONCE(*(u8 *) p, a->value); break;
+			case 2: WRITE_ONCE(*(u16 *) p, a->value); break;
+			case 4: WRITE_ONCE(*(u32 *) p, a->value); break;
+			case 8: WRITE_ONCE(*(u64 *) p, a->value); break;
+			}
+		}
+	}
+	return 0;
+}
+
+/** @brief Perform a vector of physical reads and writes, results are copied back
+ *  with the vector in one go
+ *
+ *  @param uvec A pointer to the user's struct ptusys_access_vec
+ *
+ *  @return returns 0 if the vector was processed, per entry status in the entries
+ */
+static long access_vec(struct ptusys_access_vec __user * uvec) {
+	struct ptusys_access_vec vec;
+	struct ptusys_access *entries;
+	struct access_map map = { 0 };
+	size_t bytes;
+	__u32 i;
+	long ret = 0;
+
+	/* same privilege mmap_mem relies on, the file may have been passed on */
+	if (!capable(CAP_SYS_RAWIO))
+		return -EPERM;
+	if (copy_from_user(&vec, uvec, sizeof(vec)))
+		return -EFAULT;
+	if (vec.count == 0 || vec.count > PTUSYS_MAX_ACCESSES)
+		return -EINVAL;
+
+	bytes = (size_t) vec.count * sizeof(*entries);
+	entries = vmemdup_user(u64_to_user_ptr(vec.entries), bytes);
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
+
+	vec.done = 0;
+	for (i = 0; i < vec.count; i++) {
+		entries[i].status = access_one(&entries[i], &map);
+		if (entries[i].status == 0)
+			vec.done++;
+	}
+	access_unmap(&map);
+
+	if (copy_to_user(u64_to_user_ptr(vec.entries), entries, bytes) ||
+			put_user(vec.done, &uvec->done))
+		ret = -EFAULT;
+	kvfree(entries);
+	return ret;
+}
+
+/** @brief Select the caching attribute of the next mappings of this file, or
+ *  perform a vector of physical accesses
+ *
+ *  @param filep A pointer to a file object (defined in linux/fs.h)
+ *  @param cmd PTUSYS_IOC_SET_CACHING or PTUSYS_IOC_ACCESS
+ *  @param arg Pointer to one of the PTUSYS_CACHE_* values, or to a struct ptusys_access_vec
+ *
+ *  @return returns 0 if successful
+ */
+static long ioctl_mem(struct file * filp, unsigned int cmd, unsigned long arg) {
+	__u32 mode;
+
+	switch (cmd) {
+	case PTUSYS_IOC_SET_CACHING:
+		if (get_user(mode, (__u32 __user *) arg))
+			return -EFAULT;
+		if (mode > PTUSYS_CACHE_WB)
+			return -EINVAL;
+		filp->private_data = (void *) (unsigned long) mode;
+		return 0;
+	case PTUSYS_IOC_ACCESS:
+		return access_vec((struct ptusys_access_vec __user *) arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static const struct file_operations mem_fops = { .mmap = mmap_mem, .open =
-		open_port, };
+		open_port, .unlocked_ioctl = ioctl_mem,
+#ifdef PTUSYS_HUGE_MAPPINGS
+		/* keep virtual and physical addresses congruent modulo 2MB */
+		.get_unmapped_area = thp_get_unmapped_area,
+#endif
+};
 
 /** @brief The device open function that is called each time the device is opened
  *
@@ -0,0 +1,52 @@
+/*
+ * PTUSYS - ioctl interface of /dev/ptusys shared with user space tools.
+ *
+ * Use of this source code is governed by a GPL license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef PTUSYS_IOCTL_H
+#define PTUSYS_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Caching attribute of the mappings created by the following mmap calls on
+ * the same open file. WB is only accepted on system RAM, UC and WC only
+ * outside of it; DEFAULT keeps the historical behaviour and maps any range.
+ */
+#define PTUSYS_CACHE_DEFAULT	0
+#define PTUSYS_CACHE_UC		1
+#define PTUSYS_CACHE_WC		2
+#define PTUSYS_CACHE_WB		3
+
+/*
+ * Scattered physical accesses done in the kernel in one call: each entry reads
+ * or writes 1, 2, 4 or 8 naturally aligned bytes. System RAM is accessed
+ * cached, anything else uncached; status is 0 or a negative errno per entry.
+ */
+#define PTUSYS_OP_READ		0
+#define PTUSYS_OP_WRITE		1
+#define PTUSYS_MAX_ACCESSES	4096
+
+struct ptusys_access {
+	__u64 phys;		/* physical address, aligned to width */
+	__u64 value;		/* out for reads, in for writes */
+	__u8 width;		/* 1, 2, 4 or 8 bytes */
+	__u8 op;		/* PTUSYS_OP_READ or PTUSYS_OP_WRITE */
+	__u16 reserved;
+	__s32 status;		/* out */
+};
+
+struct ptusys_access_vec {
+	__u64 entries;		/* in: user pointer to count struct ptusys_access */
+	__u32 count;		/* in: at most PTUSYS_MAX_ACCESSES */
+	__u32 done;		/* out: entries completed without error */
+};
+
+#define PTUSYS_IOC_MAGIC	'p'
+#define PTUSYS_IOC_SET_CACHING	_IOW(PTUSYS_IOC_MAGIC, 1, __u32)
+#define PTUSYS_IOC_ACCESS	_IOWR(PTUSYS_IOC_MAGIC, 2, struct ptusys_access_vec)
+
+#endif
@@ -32,6 +32,13 @@
 \par REVISION HISTORY:
 
 06/23/2014       borisv          Original Draft
+                                 MSR reads through IPIs, batched MSR read ioctl
+                                 hrtimer MSR sampler into mmap'd per-core rings
+                                 persistent per-core C-state workers
+                                 C-state exit latency benchmark
+                                 per-step C-state residency report
+                                 CPU capacity sized from nr_cpu_ids, hashed MSR cache
+                                 in-kernel P-state step sequencer
 *****************************************************************************/
 
 #define _GNU_SOURCE
@@ -52,6 +59,23 @@
 #include <linux/cpumask.h>
 #include <linux/cdev.h>		/* for cdev for ioctl */
 #include <linux/device.h>	/* for dev for ioctl */
+#include <linux/fs.h>		/* simple_read_from_buffer() */
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/smp.h>		/* on_each_cpu_mask() */
+#include <linux/cpu.h>		/* cpus_read_lock() */
+#include <linux/capability.h>	/* capable() */
+#include <linux/mm.h>		/* kvmalloc_array() */
+#include <asm/msr.h>		/* rdmsr_safe() */
+#include <linux/hrtimer.h>	/* periodic MSR sampler */
+#include <linux/seq_file.h>	/* cstate_latency */
+#include <linux/hash.h>		/* hash_32() */
+#include <linux/sort.h>
+#include <linux/workqueue.h>	/* work_on_cpu() */
+#include <asm/tsc.h>		/* rdtsc_ordered(), tsc_khz */
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>	/* vmalloc_user() */
+#include <linux/log2.h>		/* roundup_pow_of_two() */
 
 // include shared data with application part
 #include "srmtUserKernelSharedData.h"
@@ -64,43 +88,127 @@ MODULE_SUPPORTED_DEVICE("None");
 #define MY_FIRST_MINOR 0
 #define MY_MINOR_CNT 1
 
-static struct proc_dir_entry *srmt_dir, *cstate_command_file, *msr_command_file;
-#define CORE_TASK_NAME "srmtCoreTask"
+static struct proc_dir_entry *srmt_dir, *cstate_command_file, *msr_command_file, *cstate_latency_file, *cstate_residency_file;
 #define MWAIT_TASK_NAME "srmtMwaitTask"
 
 #define TRIGGER_MEMORY_SIZE_INT (TRIGGER_MEMORY_DEFAULT_SIZE/(sizeof (int)))
 
-struct mWaitData
+/* Residency counters of one core, snapshot at step start and end */
+#define RESIDENCY_CORE_STATES 3  // C3, C6, C7
+#define RESIDENCY_PKG_STATES 4   // PC2, PC3, PC6, PC7
+#define CSTATE_BUSY_WAIT_MS 100  // grace for workers still ending the previous step
+struct cstateResidency_t
 {
+  uint64_t tsc;
+  uint64_t mperf;
+  uint64_t core[RESIDENCY_CORE_STATES];
+  uint64_t pkg[RESIDENCY_PKG_STATES];
+};
+
+/* Persistent per-core C-state worker, armed for every step without creating threads */
+struct cstateWorker_t
+{
+  struct task_struct *task;
   uint32_t coreId;
-  char *watchedArea;
-  uint32_t longevity;  // in microsec
+  char *watchedArea;         // monitored line, tripped to end the step
   uint8_t state;
+  uint64_t armedGen;         // step this worker is armed for
+  uint64_t doneGen;          // last step it completed
+  struct hrtimer stepTimer;  // ends the step at the same absolute time on every core
+  bool bench;                // exit latency benchmark instead of a step
+  uint64_t *benchSamples;    // wake latencies in TSC cycles
+  uint32_t benchCount;
+  uint32_t benchArmed;       // samples the worker parked for
+  uint32_t benchTaken;       // samples recorded
+  uint32_t benchSpurious;    // wakes not caused by the waker
+  struct cstateResidency_t resStart;  // taken when entering MWAIT
+  struct cstateResidency_t resEnd;    // taken when the step ended
+  uint64_t resGen;           // step the snapshots belong to
+};
+
+static struct cstateWorker_t *cstateWorkers;  // nr_cpu_ids entries
+static uint64_t cstateGen;                    // last step armed
+static uint64_t cstateReleaseGen;             // last step released from the barrier
+static atomic_t cstateReady = ATOMIC_INIT(0); // workers of the current step at the barrier
+static uint64_t cstateLastStep;               // last step started by startCState, 0 if none
+static uint8_t cstateLastState;
+static uint32_t cstateLastTime;
+static struct cpumask cstateLastCpus;         // cores of the last step
+
+/* Exit latency distribution of one core in one C-state, from the last benchmark */
+struct cstateLatency_t
+{
+  uint32_t samples;
+  uint32_t spurious;
+  uint64_t minNs;
+  uint64_t p50Ns;
+  uint64_t p90Ns;
+  uint64_t p99Ns;
+  uint64_t maxNs;
+  uint64_t avgNs;
 };
 
+#define CSTATE_BENCH_STATES 5
+#define CSTATE_BENCH_ABORT U64_MAX   // written by the waker to stop a benchmark
+static const uint8_t cstateBenchStates[CSTATE_BENCH_STATES] = {0, 1, 3, 6, 7};
+static struct cstateLatency_t *cstateLatency;  // CSTATE_BENCH_STATES x nr_cpu_ids
+
 /* run-time flag to dynamically control a volume of debug printouts */
 bool srmtDebugStatus = false;  
 
 
 /* If application decided not to use /dev/cpu/X/msr pseudo files to read MSRs,
    but instead to call LKM to get that info, then we use msrReq/msrResp.
-   We also assume that we have one MSR request from user at any moment of time */
-static struct msrMsg_t m;
+   Every open of the MSR file is a separate session: the requests written to it
+   are answered into its own result queue, read back in the same order */
+#define MSR_SESSION_QUEUE 64
+
+struct msrSession_t
+{
+  struct mutex lock;
+  struct msrMsg_t results[MSR_SESSION_QUEUE];
+  uint32_t head;   // oldest result not read yet
+  uint32_t count;  // results queued
+};
+
+/* Every open of the cstate command file keeps the outcome of its last command */
+struct cstateSession_t
+{
+  struct mutex lock;
+  char lastType;
+  uint8_t lastState;
+  uint32_t lastTime;
+  uint32_t lastCores;
+  int lastStatus;
+  bool hasResult;
+};
+
+static DEFINE_SPINLOCK(msrArrLock);  // slot allocation in mArr
+static DEFINE_MUTEX(cstateLock);     // C-state steps share coresInMwait and the per-core tasks
 
 // Bunch of MSRs we watch inside MWAIT loop
-static struct msrMsg_t mArr[MSR_COLLECTION_SIZE][MAX_CORES];
-bool coresInMwait[MAX_CORES];
+/* MSRs collected by the MWAIT loop of one core, hashed on the MSR id */
+#define MSR_CACHE_SHIFT 6
+#define MSR_CACHE_SLOTS (1 << MSR_CACHE_SHIFT)  // room for MSR_COLLECTION_SIZE with short probes
+struct msrCache_t
+{
+  uint32_t used;
+  struct msrMsg_t slot[MSR_CACHE_SLOTS];
+};
+
+static struct msrCache_t *mArr;  // nr_cpu_ids entries
+static bool *coresInMwait;       // nr_cpu_ids entries
 
 /*****************************************************************/
 
-int msrReadFuncNoMwait(void *data)
+/* IPI handler: read one MSR on the core it runs on */
+static void msrReadFuncOnCpu(void *data)
 {
   struct msrMsg_t *mPtr = (struct msrMsg_t *)data;
-  uint32_t hi,lo; 
-  asm volatile("rdmsr":"=a"(lo),"=d"(hi):"c"(mPtr->msrId));
+  uint32_t hi = 0, lo = 0;
+
+  mPtr->status = (rdmsr_safe(mPtr->msrId, &lo, &hi) == 0);
   mPtr->msrValue = (uint64_t) hi << 32 | lo;
-  mPtr->status = true;
-  do_exit(SIGCHLD);
 }
 
 void msrReadFuncInMwait(struct msrMsg_t *data)
@@ -133,50 +241,82 @@ uint64_t readTsc(void)
 
 
 /***********************************************************/
-void cleanMsrArray (void)
+void freeMsrArray (void);
+
+int allocMsrArray (void)
+{
+  mArr = kvmalloc_array(nr_cpu_ids, sizeof (*mArr), GFP_KERNEL | __GFP_ZERO);
+  coresInMwait = kcalloc(nr_cpu_ids, sizeof (*coresInMwait), GFP_KERNEL);
+  if (mArr == NULL || coresInMwait == NULL)
+    {
+      freeMsrArray();
+      return -ENOMEM;
+    }
+  return 0;
+}
+
+void freeMsrArray (void)
 {
-  memset(mArr, 0, sizeof (mArr));
+  kvfree(mArr);
+  kfree(coresInMwait);
+  mArr = NULL;
+  coresInMwait = NULL;
 }
 
 
-/* finds either the filled structure with required MSR, or the first empty slot */ 
+/* finds either the filled structure with required MSR, or takes an empty slot,
+   open addressing on the MSR id so a lookup is a probe or two whatever the core count */ 
 struct msrMsg_t *findMsrPlace (uint32_t id, uint32_t core)
 {
-  int i=0;
-  struct msrMsg_t *notOccupied = NULL;
-  
-  if (core <= MAX_CORES)
+  struct msrCache_t *cache;
+  struct msrMsg_t *slot = NULL;
+  uint32_t i, h;
+
+  if (mArr == NULL || core >= nr_cpu_ids || id == 0)
+    return NULL;
+
+  cache = &mArr[core];
+  h = hash_32(id, MSR_CACHE_SHIFT);
+  spin_lock(&msrArrLock);
+  for (i=0; i<MSR_CACHE_SLOTS; i++)
     {
-      for (i=0; i<MSR_COLLECTION_SIZE; i++)
-        {
-          if (mArr[i][core].msrId==id)
-            return &mArr[i][core];
-          else if (notOccupied==NULL && mArr[i][core].msrId==0)
-            {
-              // take this slot
-              notOccupied = &mArr[i][core];
-            }
-        }
-      if (notOccupied)
+      slot = &cache->slot[(h + i) & (MSR_CACHE_SLOTS - 1)];
+      if (slot->msrId == id)
         {
-          memset(notOccupied, 0, sizeof (struct msrMsg_t));
-          notOccupied->msrId = id;
-          notOccupied->coreId = core;
-          return notOccupied;
+          spin_unlock(&msrArrLock);
+          return slot;
         }
+      if (slot->msrId == 0)
+        break;
     }
-  
-  return NULL;
+  if (i == MSR_CACHE_SLOTS || cache->used >= MSR_COLLECTION_SIZE)
+    {
+      spin_unlock(&msrArrLock);
+      return NULL;
+    }
+
+  // take this slot
+  memset(slot, 0, sizeof (struct msrMsg_t));
+  slot->coreId = core;
+  WRITE_ONCE(slot->msrId, id);
+  cache->used++;
+  spin_unlock(&msrArrLock);
+  return slot;
 }
 
 /*-----  read all MSRs needed ------------*/
 void fillMsrArray(uint32_t core)
 {
+  struct msrMsg_t *slot;
   int i;
-  for (i=0; i<MSR_COLLECTION_SIZE; i++)
+
+  if (mArr == NULL || core >= nr_cpu_ids)
+    return;
+  for (i=0; i<MSR_CACHE_SLOTS; i++)
     {
-      if (core < MAX_CORES)
-        msrReadFuncInMwait(&(mArr[i][core]));
+      slot = &mArr[core].slot[i];
+      if (READ_ONCE(slot->msrId) != 0)
+        msrReadFuncInMwait(slot);
     }
 }
 
@@ -235,60 +375,96 @@ static inline void mwait(unsigned long eax, unsigned long ecx)
 /*! 
 *******************************************************************************
 * 
-*  \brief   task to perform MWAIT and MONITOR
+*  \brief   MWAIT hint for a C-state, the same codes as the Windows version
+*           (0xf0 & ((state - 1) << 4) didn't work on C3, C6)
+* 
+*   \return  int, 0 or -EINVAL for an unknown C-state
+* 
+******************************************************************************/
+static int cstateHint (uint8_t state, uint32_t *hint)
+{
+  switch (state & 0xf)
+    {
+      case 0:
+        *hint = 0xf0;
+        break;
+      case 1:
+        *hint = 0x00;
+        break;
+      case 3:
+        *hint = 0x10;
+        break;
+      case 6:
+        *hint = 0x20;
+        break;
+      case 7:
+        *hint = 0x30;
+        break;
+      default:
+        return -EINVAL;
+    }
+  return 0;
+}
+
+static const uint32_t residencyCoreMsrs[RESIDENCY_CORE_STATES] = {MSR_CORE_C3_RESIDENCY, MSR_CORE_C6_RESIDENCY, MSR_CORE_C7_RESIDENCY};
+static const uint32_t residencyPkgMsrs[RESIDENCY_PKG_STATES] = {MSR_PKG_C2_RESIDENCY, MSR_PKG_C3_RESIDENCY, MSR_PKG_C6_RESIDENCY, MSR_PKG_C7_RESIDENCY};
+
+/* local MSR read, counters missing on this CPU model read as 0 */
+static uint64_t residencyMsr (uint32_t msr)
+{
+  uint32_t lo, hi;
+
+  if (rdmsr_safe(msr, &lo, &hi))
+    return 0;
+  return (uint64_t) hi << 32 | lo;
+}
+
+/* snapshot of the residency counters of the calling core */
+static void snapshotResidency (struct cstateResidency_t *r)
+{
+  int i;
+
+  r->tsc = rdtsc_ordered();
+  r->mperf = residencyMsr(MSR_IA32_MPERF);
+  for (i=0; i<RESIDENCY_CORE_STATES; i++)
+    r->core[i] = residencyMsr(residencyCoreMsrs[i]);
+  for (i=0; i<RESIDENCY_PKG_STATES; i++)
+    r->pkg[i] = residencyMsr(residencyPkgMsrs[i]);
+}
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   MWAIT and MONITOR until the watched area is tripped
 * 
 ******************************************************************************/
-int funcMwaitTask (void* data)
+static void mwaitUntilTripped (struct cstateWorker_t *w)
 {
-    struct mWaitData *myData = (struct mWaitData *) data;
     bool stillWaiting = true;
     bool firstReset = true;
     uint32_t countResets = 0;
     uint64_t cstateStats0[11]; // temp objects for debug
     uint64_t cstateStats1[11];
+    uint32_t hint = 0;
+    int i;
 
     if (srmtDebugStatus)
       {
-        printk(KERN_INFO "srmt: funcMwaitTask core %d to c%1.1d\n", myData->coreId, myData->state);
+        printk(KERN_INFO "srmt: mwait core %d to c%1.1d\n", w->coreId, w->state);
         collectCStateStats(cstateStats0);
       }
+    cstateHint(w->state, &hint);  // validated by startCState
+    snapshotResidency(&w->resStart);
+
     while (stillWaiting)
       {
-            int i;
-            uint32_t hint = 0;
-            // go down to C-state
-            
-            /*  those codes didn't work on C3, C6:
-                hint = 0xf0 & (((myData.state&0xf) - 1)<<4);
-                so we use the same as Windows version */
-            switch (myData->state & 0xf)
-              {
-                case 0:
-                  hint = 0xf0;
-                  break;
-                case 1:
-                  hint = 0x00;
-                  break;
-                case 3:
-                  hint = 0x10;
-                  break;
-                case 6:
-                  hint = 0x20;
-                  break;
-                case 7:
-                  hint = 0x30;
-                  break;
-                default:
-                  printk(KERN_WARNING "srmt: invalid C-State %#x\n",  myData->state);
-                  goto getOut;
-              }
             if (firstReset)
                 {
                   if (srmtDebugStatus) {
                     printk(KERN_INFO "srmt: call mwait(%#x,%d) on core %d\n",
-                                                           hint, 0, myData->coreId);
+                                                           hint, 0, w->coreId);
 		  }
-                    monitor(myData->watchedArea, 0, 0);
+                    monitor(w->watchedArea, 0, 0);
                 }
             
             mwait(hint, 0);
@@ -298,11 +474,11 @@ int funcMwaitTask (void* data)
                 printk(KERN_INFO "srmt: mwait state ended\n");
             for (i=0; i<TRIGGER_MEMORY_SIZE_INT; i++)
                 {
-                    int *ptr = (int*)(myData->watchedArea);
-                    if (ptr[i] != 0)
+                    int *ptr = (int*)(w->watchedArea);
+                    if (READ_ONCE(ptr[i]) != 0)
                         {
                             stillWaiting = false;
-                            coresInMwait[myData->coreId]=false;
+                            coresInMwait[w->coreId]=false;
                             break;
                         }
                 }
@@ -310,20 +486,21 @@ int funcMwaitTask (void* data)
             if (stillWaiting) // no trigger happened, reset the monitor
                 {
                     countResets++;
-                    fillMsrArray(myData->coreId);
-                    monitor(myData->watchedArea, 0, 0);
+                    fillMsrArray(w->coreId);
+                    monitor(w->watchedArea, 0, 0);
                     if (firstReset)
                         {
                             if (srmtDebugStatus)
-                              printk(KERN_INFO "srmt: reset the monitor in %d\n", myData->coreId);
+                              printk(KERN_INFO "srmt: reset the monitor in %d\n", w->coreId);
                             firstReset = false;
                         }
                 }
         }
+    snapshotResidency(&w->resEnd);
     
     if (srmtDebugStatus)
         {
-            printk(KERN_INFO "srmt: core %d out of mwait after %d resets\n", myData->coreId, countResets);
+            printk(KERN_INFO "srmt: core %d out of mwait after %d resets\n", w->coreId, countResets);
             collectCStateStats(cstateStats1);
             printk(KERN_INFO "srmt: C0 delta %12lld\n", cstateStats1[0]-cstateStats0[0]);
             printk(KERN_INFO "srmt: C1 delta %12lld\n", cstateStats1[1]-cstateStats0[1]);
@@ -331,379 +508,1413 @@ int funcMwaitTask (void* data)
             printk(KERN_INFO "srmt: C6 delta %12lld\n", cstateStats1[6]-cstateStats0[6]);
             printk(KERN_INFO "srmt: C7 delta %12lld\n", cstateStats1[7]-cstateStats0[7]);
         }
- getOut:
-    if (!(IS_ERR(myData)))
-      {
-        if (!(IS_ERR(myData->watchedArea)))
-          kfree(myData->watchedArea);
-        kfree(myData);
-      }
-    else if (srmtDebugStatus)
-      printk(KERN_ERR "srmt: funcMwaitTask got bad data\n");
-    do_exit(SIGCHLD); // we are done here, terminate the task
+}
+
+/* index of a C-state in cstateLatency, -1 if it can't be benchmarked */
+static int cstateBenchIndex (uint8_t state)
+{
+  int i;
+
+  for (i=0; i<CSTATE_BENCH_STATES; i++)
+    if (cstateBenchStates[i] == state)
+      return i;
+  return -1;
 }
 
 /*! 
 *******************************************************************************
 * 
-*  \brief   Per core task function
-* 
-*   \return  int error status 
-* 
-*   \warning  Only MWAIT executing task must be 1) separate thread;
-*                                               2) use affinity
-*             This task has no such requirements
+*  \brief   Exit latency benchmark on the worker's core: park in MWAIT until
+*           another core writes its TSC into the monitored line, then record
+*           the TSC at wake. Wakes without a TSC in the line are interrupts,
+*           counted as spurious and parked again
 * 
 ******************************************************************************/
-int cTaskFunc (void* data)
+static void mwaitBench (struct cstateWorker_t *w)
 {
-  struct mWaitData *mwdata = (struct mWaitData *) data;
-  struct task_struct * mTask;
-  char name[64];
-  uint32_t core;
-  char *watchedArea = NULL;
- 
-  core = mwdata->coreId;
-   
-  // create watched area we will monitor
-  watchedArea = kmalloc(TRIGGER_MEMORY_DEFAULT_SIZE, GFP_KERNEL);
-  if (watchedArea==NULL || mwdata==NULL)
-      return (-ENOMEM);
-  else
-      mwdata->watchedArea = watchedArea;
-  memset(watchedArea, 0, TRIGGER_MEMORY_DEFAULT_SIZE);
+  uint64_t *trig = (uint64_t *) w->watchedArea;
+  uint64_t tsc, t;
+  uint32_t hint = 0;
 
-  // create MWAIT task, kick it and wait it's finished
-  sprintf(name, "%s%d", MWAIT_TASK_NAME, core);
+  cstateHint(w->state, &hint);  // validated by cstateBenchRun
 
-  mTask = kthread_create(&funcMwaitTask, mwdata, name);
-  // we have to use _create instead of _run because we will immediately do _bind here
-  if (IS_ERR(mTask))
-    {
-      printk(KERN_ERR "srmt: can't create trigger task %d\n", core);
-      return (-ENOMEM);
-    }
-  else
+  while (w->benchTaken < w->benchCount)
     {
-      kthread_bind(mTask, core);
-      if (srmtDebugStatus)
-        printk(KERN_INFO "srmt: task %s=%p\n", name, (void*)mTask);
-      wake_up_process (mTask);
+      monitor(w->watchedArea, 0, 0);
+      t = READ_ONCE(*trig);
+      if (t == 0)
+        {
+          smp_store_release(&w->benchArmed, w->benchTaken + 1);
+          mwait(hint, 0);
+        }
+      tsc = rdtsc_ordered();
+      t = READ_ONCE(*trig);
+
+      if (t == CSTATE_BENCH_ABORT)
+        break;
+      if (t == 0)
+        {
+          w->benchSpurious++;
+          fillMsrArray(w->coreId);
+          continue;
+        }
+      w->benchSamples[w->benchTaken] = tsc > t ? tsc - t : 0;
+      WRITE_ONCE(*trig, 0);
+      smp_store_release(&w->benchTaken, w->benchTaken + 1);
     }
+}
 
-  customSleep(mwdata->longevity);
-  watchedArea[0] = 1; /* trip the trigger
-                         tripping the trigger again "to make sure" would cause race condition:
-                         task activated, frees memory, and then we try to write to it with that second "tripping" */
+/* end of a step: trip the watched area, all workers of a step share the expiry */
+static enum hrtimer_restart cstateStepEnd (struct hrtimer *timer)
+{
+  struct cstateWorker_t *w = container_of(timer, struct cstateWorker_t, stepTimer);
 
-  if (srmtDebugStatus)
-      printk(KERN_INFO "srmt: out of trigger on core %d\n", core);
-  do_exit(SIGCHLD); // we are done here, terminate the task
+  WRITE_ONCE(w->watchedArea[0], 1);
+  return HRTIMER_NORESTART;
 }
 
-
 /*! 
 *******************************************************************************
 * 
-*  \brief   Based on core mask, create separate task for each core. Make per core trigger area
-* 
-*   \param   struct stateInstructionKernel_t * ptr 
+*  \brief   Persistent per-core worker: sleeps until armed for a step, checks
+*           in at the barrier, spins until the step is released, then keeps
+*           the core in MWAIT until the step timer trips the watched area
 * 
-*   \return  int error status (0=OK)
-*
-*   \warning Assumption: 64-bit core mask (up to 64 cores altogether)
-*
-*******************************************************************************/
-int startCState (struct stateInstructionKernel_t * si)
+******************************************************************************/
+static int cstateWorkerFunc (void* data)
 {
-    struct task_struct * cTask;
-    uint32_t coreDoes;
-    uint32_t i;
-    char cName[64];
-    
-    uint32_t maskPart;
-    ///int cpu = smp_processor_id();
+  struct cstateWorker_t *w = (struct cstateWorker_t *) data;
+  uint64_t gen;
 
-    // figure out what cores do we have to use
-    for (i=0; i<MAX_CORES; i++)
+  while (!kthread_should_stop())
+    {
+      set_current_state(TASK_INTERRUPTIBLE);
+      if (READ_ONCE(w->armedGen) == w->doneGen && !kthread_should_stop())
+        schedule();
+      __set_current_state(TASK_RUNNING);
+
+      gen = READ_ONCE(w->armedGen);
+      if (gen == w->doneGen)
+        continue;
+
+      // barrier: every selected core enters MWAIT at the same moment
+      atomic_inc(&cstateReady);
+      while (READ_ONCE(cstateReleaseGen) < gen && !kthread_should_stop())
         {
-            maskPart = si->coreMaskArray[i/32]; // "active" word
-            coreDoes = maskPart & (1UL << i%32 );
-            if (coreDoes)
-                {
-                    /* if (core==cpu) */
-                    /*     printk(KERN_INFO "srmt: startCState excludes core %d\n", i); */
-                    /* else */
-                        {
-                            // these are per core actions
-                            struct mWaitData *mwdata = kmalloc(sizeof (struct mWaitData), GFP_KERNEL);
-                            if (mwdata==NULL)
-                                return (-ENOMEM);
-                            sprintf(cName, "%s%d", CORE_TASK_NAME, i);
-                            mwdata->coreId = i;
-                            mwdata->state = si->state;
-                            mwdata->longevity = si->time;
-                            
-                            coresInMwait[i] = true;
-                            if (srmtDebugStatus)
-                                printk(KERN_INFO "srmt: run %s cpu=%d state=%d\n", cName, i, mwdata->state );
-                            cTask = kthread_run(&cTaskFunc, mwdata, cName);
-                            if (IS_ERR(cTask))
-                                {
-                                    printk(KERN_ERR "srmt: can't create cTask on core %d\n", i);
-                                    return (-ENOMEM);
-                                }
-                            else if (srmtDebugStatus)
-                                {
-                                  printk(KERN_INFO "srmt: task %s=%p\n", cName, (void*)cTask);
-                                }
-
-                              
-                        }
-                }
-            else
-              coresInMwait[i] = false;
+          cpu_relax();
+          cond_resched();
         }
 
-    return 0;
+      if (!kthread_should_stop())
+        {
+          if (w->bench)
+            mwaitBench(w);
+          else
+            {
+              mwaitUntilTripped(w);
+              w->resGen = gen;
+            }
+        }
+      coresInMwait[w->coreId] = false;
+      smp_store_release(&w->doneGen, gen);
+    }
+
+  return 0;
+}
+
+/* create the worker of a core, at module load or on its first use */
+static int cstateWorkerCreate (uint32_t core)
+{
+  struct cstateWorker_t *w = &cstateWorkers[core];
+  struct task_struct *task;
+
+  w->watchedArea = kzalloc_node(TRIGGER_MEMORY_DEFAULT_SIZE, GFP_KERNEL, cpu_to_node(core));
+  if (w->watchedArea == NULL)
+    return -ENOMEM;
+  w->coreId = core;
+  w->armedGen = w->doneGen = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+  hrtimer_setup(&w->stepTimer, cstateStepEnd, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+  hrtimer_init(&w->stepTimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  w->stepTimer.function = cstateStepEnd;
+#endif
+
+  task = kthread_create_on_node(&cstateWorkerFunc, w, cpu_to_node(core), "%s%d", MWAIT_TASK_NAME, core);
+  if (IS_ERR(task))
+    {
+      printk(KERN_ERR "srmt: can't create worker task %d\n", core);
+      kfree(w->watchedArea);
+      w->watchedArea = NULL;
+      return PTR_ERR(task);
+    }
+  kthread_bind(task, core);
+  w->task = task;
+  wake_up_process(task);
+
+  return 0;
+}
+
+static int cstatePoolInit (void)
+{
+  uint32_t core;
+
+  cstateWorkers = kcalloc(nr_cpu_ids, sizeof (*cstateWorkers), GFP_KERNEL);
+  cstateLatency = kcalloc(CSTATE_BENCH_STATES * nr_cpu_ids, sizeof (*cstateLatency), GFP_KERNEL);
+  if (cstateWorkers == NULL || cstateLatency == NULL)
+    {
+      kfree(cstateWorkers);
+      kfree(cstateLatency);
+      cstateWorkers = NULL;
+      cstateLatency = NULL;
+      return -ENOMEM;
+    }
+
+  for_each_online_cpu(core)
+    if (cstateWorkerCreate(core))
+      printk(KERN_ERR "srmt: no C-state worker on core %d\n", core);
+
+  return 0;
+}
+
+static void cstatePoolExit (void)
+{
+  struct cstateWorker_t *w;
+  uint32_t core;
+
+  if (cstateWorkers == NULL)
+    return;
+
+  // wake everybody up: spinning at the barrier or parked in MWAIT
+  WRITE_ONCE(cstateReleaseGen, U64_MAX);
+  for (core = 0; core < nr_cpu_ids; core++)
+    {
+      w = &cstateWorkers[core];
+      if (w->task == NULL)
+        continue;
+      hrtimer_cancel(&w->stepTimer);
+      WRITE_ONCE(w->watchedArea[0], 1);
+      kthread_stop(w->task);
+      kfree(w->watchedArea);
+    }
+  kfree(cstateWorkers);
+  cstateWorkers = NULL;
+  kfree(cstateLatency);
+  cstateLatency = NULL;
 }
 
 /*! 
 *******************************************************************************
 * 
-*  \brief   Data transfer from user to kernel, carrying MSR params
-* 
-*   \return  int,  if positive: amount of data transfered
+*  \brief   Arm the persistent worker of each core, release
+*           them together once all of them reached the barrier, and end the
+*           step on all of them at the same absolute time
 * 
-*   \warning  
+*   \param   cpus   online cores of the step
+*   \param   state  C-state to keep them in
+*   \param   time   step duration in microseconds
 * 
+*   \return  int error status (0=OK)
+*
+*   \warning Called with cstateLock held
+*
 *******************************************************************************/
-ssize_t msrRequest (struct file *filp,const char __user *buf, size_t count, loff_t *offp)
+int startCState (const struct cpumask *cpus, uint8_t state, uint32_t time)
 {
-    int ret = 0;
-    char msg[2*sizeof (struct msrMsg_t)]; // some extra space just in case
+    struct cstateWorker_t *w;
+    uint32_t i, hint, armed = 0;
+    uint64_t gen;
+    ktime_t deadline, end;
 
-    if (count == sizeof (struct msrMsg_t))
+    if (cstateWorkers == NULL || cstateHint(state, &hint))
       {
-          if (copy_from_user(msg, buf, count))
-              return -EFAULT;
-          else
+        printk(KERN_WARNING "srmt: invalid C-State %#x\n", state);
+        return -EINVAL;
+      }
+
+    // a writer that slept for the previous step can race its workers' wakeup, give them a moment
+    deadline = ktime_add_ms(ktime_get(), CSTATE_BUSY_WAIT_MS);
+    for_each_cpu(i, cpus)
+      {
+        w = &cstateWorkers[i];
+        if (w->task == NULL && cstateWorkerCreate(i))
+          return -ENOMEM;
+        while (READ_ONCE(w->armedGen) != smp_load_acquire(&w->doneGen))
+          {
+            if (!ktime_before(ktime_get(), deadline))
               {
-                struct task_struct * msrReadTask;
-                ret = count;
-                memcpy(&m, msg, count);
-                if (srmtDebugStatus)
-                  printk(KERN_INFO "msrReq: need core %d msr %08x ", m.coreId, m.msrId);
-                if (coresInMwait[m.coreId]==false) // we should read independently from MWAIT
-                  {
-                    if (srmtDebugStatus)
-                      printk(KERN_INFO " - read ");
-                    msrReadTask = kthread_create(&msrReadFuncNoMwait, &m, "msrReadTask");
-                  
- 
-                    if (IS_ERR(msrReadTask))
-                      {
-                        printk(KERN_ERR "srmt: can't create msrRead task %d\n", m.coreId);
-                        return (-ENOMEM);
-                      }
-                    else
-                      {
-                        kthread_bind(msrReadTask, m.coreId);
-                        printk(KERN_INFO "srmt: msrRequest task %p", (void *) msrReadTask );
-                      }
-                      
-                    m.status = false;
-                    wake_up_process (msrReadTask);
-                    while (m.status==false)
-                      customSleep(1);
-                 
-                if (srmtDebugStatus)
-                    printk(KERN_INFO " val = 0x%llx\n",(long long unsigned int)m.msrValue);
-                   
-                  }
-                else  // here just use the data collected by MWAIT
-                  {
-                    struct msrMsg_t *ptr;
-                    ptr = findMsrPlace(m.msrId, m.coreId);
-                    /* if (srmtDebugStatus) */
-                    /*   printk(KERN_INFO " use mArr %08x val = %08x\n", */
-                    /*          ptr, (ptr? ptr->msrValue:0)); */
-                    if (m.coreId<MAX_CORES && ptr)
-                      m = *ptr;
-                    else
-                      memset(&m, 0, sizeof (struct msrMsg_t));
-                    m.status = true;
-                  }
-                
+                printk(KERN_ERR "srmt: core %d is still busy with a previous step\n", i);
+                return -EBUSY;
               }
+            usleep_range(20, 50);
+          }
       }
-    else
-      return -ENOSPC;
-    
-    return ret;
+
+    gen = ++cstateGen;
+    atomic_set(&cstateReady, 0);
+    cstateLastStep = gen;
+    cstateLastState = state;
+    cstateLastTime = time;
+    cpumask_clear(&cstateLastCpus);
+    for_each_cpu(i, cpus)
+      {
+        w = &cstateWorkers[i];
+        memset(w->watchedArea, 0, TRIGGER_MEMORY_DEFAULT_SIZE);
+        w->state = state;
+        coresInMwait[i] = true;
+        if (srmtDebugStatus)
+          printk(KERN_INFO "srmt: arm worker cpu=%d state=%d\n", i, w->state);
+        WRITE_ONCE(w->armedGen, gen);
+        wake_up_process(w->task);
+        cpumask_set_cpu(i, &cstateLastCpus);
+        armed++;
+      }
+
+    // wait for the workers to check in, but don't hang the writer forever
+    deadline = ktime_add_ms(ktime_get(), 1000);
+    while (atomic_read(&cstateReady) < armed && ktime_before(ktime_get(), deadline))
+      {
+        cpu_relax();
+        cond_resched();
+      }
+    if (atomic_read(&cstateReady) < armed)
+      printk(KERN_WARNING "srmt: only %d of %u cores reached the barrier\n", atomic_read(&cstateReady), armed);
+
+    WRITE_ONCE(cstateReleaseGen, gen);
+
+    end = ktime_add_us(ktime_get(), time);
+    for_each_cpu(i, cpus)
+      {
+        w = &cstateWorkers[i];
+        if (w->task != NULL && READ_ONCE(w->armedGen) == gen)
+          hrtimer_start(&w->stepTimer, end, HRTIMER_MODE_ABS);
+      }
+
+    return 0;
+}
+
+/* wait for a worker counter to reach target, 0 or -ETIMEDOUT after a second */
+static int cstateBenchWait (uint32_t *counter, uint32_t target)
+{
+  ktime_t deadline = ktime_add_ms(ktime_get(), 1000);
+
+  while (smp_load_acquire(counter) < target)
+    {
+      if (!ktime_before(ktime_get(), deadline))
+        return -ETIMEDOUT;
+      cpu_relax();
+      cond_resched();
+    }
+  return 0;
 }
 
+struct cstateBenchRun_t
+{
+  struct cstateWorker_t *w;
+  uint32_t samples;
+  uint32_t sleepUs;
+};
+
 /*! 
 *******************************************************************************
 * 
-*  \brief   Data transfer from kernel to user, carrying MSR value
-* 
-*   \return  int,  if positive: amount of data transfered
+*  \brief   Waker side of the benchmark, runs on a core other than the target:
+*           once the target is parked, let it settle for sleepUs, then write
+*           the TSC into its monitored line
 * 
-*   \warning  
+*   \return  long, 0 or -ETIMEDOUT if the target stopped answering
 * 
-*******************************************************************************/
-ssize_t msrResponse (struct file *filp, char __user *buf, size_t count, loff_t *offp ) 
+******************************************************************************/
+static long cstateBenchWaker (void *data)
 {
-  int res;
+  struct cstateBenchRun_t *run = (struct cstateBenchRun_t *) data;
+  struct cstateWorker_t *w = run->w;
+  uint64_t *trig = (uint64_t *) w->watchedArea;
+  uint32_t i;
 
-  res = copy_to_user(buf, (void*)&m, sizeof(struct msrMsg_t));
-  if (res == 0)
-    {
-      *offp = 0;
-      if (srmtDebugStatus)
-        printk(KERN_INFO "msrResp: msr %08x on core %d = 0x%llx\n",
-               m.msrId, m.coreId, (long long unsigned int)m.msrValue);
-      return sizeof(struct msrMsg_t);
-    }
-  else
+  for (i=0; i<run->samples; i++)
     {
-      if (srmtDebugStatus)
-        printk(KERN_INFO "msrResp: copy_to_user = %d\n", res);
-      return 0;
+      if (cstateBenchWait(&w->benchArmed, i + 1))
+        goto abort;
+      usleep_range(run->sleepUs, run->sleepUs + run->sleepUs / 8 + 1);
+      WRITE_ONCE(*trig, rdtsc_ordered());
+      if (cstateBenchWait(&w->benchTaken, i + 1))
+        goto abort;
     }
+  return 0;
+
+abort:
+  WRITE_ONCE(*trig, CSTATE_BENCH_ABORT);
+  return -ETIMEDOUT;
 }
 
-int bit_count (uint32_t mask)
+static int cmpU64 (const void *a, const void *b)
 {
-	int sum, i;
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
 
-	sum = 0;
-	for (i = 0; i < 32; i++) {
-		if (mask & (1 << i))
-			sum++;
-	}
-	return sum;
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t tscToNs (uint64_t cycles)
+{
+  return tsc_khz ? div_u64(cycles * 1000000ULL, tsc_khz) : cycles;
 }
 
 /*! 
 *******************************************************************************
 * 
-*  \brief   Data transfer from user to kernel, carrying cstate instruction
-* 
-*   \param    
-*   \param    
-* 
-*   \return  int,  if positive: amount of data transfered
-* 
-*   \warning  
+*  \brief   Measure the exit latency of one core in one C-state and store its
+*           distribution in cstateLatency
 * 
+*   \return  int error status (0=OK)
+*
+*   \warning Called with cstateLock held
+*
 *******************************************************************************/
-ssize_t writeCstateCommand (struct file *filp,const char __user *buf, size_t count, loff_t *offp)
+static int cstateBenchRun (uint32_t core, uint8_t state, uint32_t samples, uint32_t sleepUs)
 {
-    int ret = 0;
-    int i, j, len, sum;
-    uint32_t mask;
-    struct stateInstructionKernel_t si;
+  struct cstateWorker_t *w;
+  struct cstateLatency_t *lat;
+  struct cstateBenchRun_t run;
+  uint64_t sum = 0;
+  uint32_t hint, i, n;
+  int waker, idx, ret;
+  uint64_t gen;
+
+  idx = cstateBenchIndex(state);
+  if (idx < 0 || cstateHint(state, &hint))
+    return -EINVAL;
+  waker = cpumask_any_but(cpu_online_mask, core);
+  if (waker >= nr_cpu_ids)
+    return -ENODEV;
+
+  w = &cstateWorkers[core];
+  if (w->task == NULL && (ret = cstateWorkerCreate(core)))
+    return ret;
+  if (READ_ONCE(w->armedGen) != smp_load_acquire(&w->doneGen))
+    return -EBUSY;
+
+  w->benchSamples = kvmalloc_array(samples, sizeof (uint64_t), GFP_KERNEL);
+  if (w->benchSamples == NULL)
+    return -ENOMEM;
+  w->benchCount = samples;
+  w->benchArmed = w->benchTaken = w->benchSpurious = 0;
+  w->bench = true;
+  memset(w->watchedArea, 0, TRIGGER_MEMORY_DEFAULT_SIZE);
+  w->state = state;
+  coresInMwait[core] = true;
+
+  // a single core: no barrier to wait for, release it as it is armed
+  gen = ++cstateGen;
+  WRITE_ONCE(cstateReleaseGen, gen);
+  WRITE_ONCE(w->armedGen, gen);
+  wake_up_process(w->task);
+
+  run.w = w;
+  run.samples = samples;
+  run.sleepUs = sleepUs;
+  ret = (int) work_on_cpu(waker, cstateBenchWaker, &run);
+
+  while (smp_load_acquire(&w->doneGen) != gen)
+    msleep(1);
+  w->bench = false;
+
+  n = w->benchTaken;
+  if (n == 0)
+    {
+      kvfree(w->benchSamples);
+      w->benchSamples = NULL;
+      return ret ? ret : -EIO;
+    }
 
-    if (count == sizeof (struct stateInstructionKernel_t)) {
+  sort(w->benchSamples, n, sizeof (uint64_t), cmpU64, NULL);
+  for (i=0; i<n; i++)
+    sum += w->benchSamples[i];
 
-        if (copy_from_user((char *) &si, buf, count)) {
-	    printk (KERN_INFO "Error: copy_from_user() failed\n");
-            return -EFAULT;
-        }
-        else {
-            ret = len = count;
+  lat = &cstateLatency[idx * nr_cpu_ids + core];
+  lat->samples = n;
+  lat->spurious = w->benchSpurious;
+  lat->minNs = tscToNs(w->benchSamples[0]);
+  lat->p50Ns = tscToNs(w->benchSamples[(n - 1) * 50 / 100]);
+  lat->p90Ns = tscToNs(w->benchSamples[(n - 1) * 90 / 100]);
+  lat->p99Ns = tscToNs(w->benchSamples[(n - 1) * 99 / 100]);
+  lat->maxNs = tscToNs(w->benchSamples[n - 1]);
+  lat->avgNs = tscToNs(div_u64(sum, n));
 
-            // security check starts
-            if (si.type != STEP_C) {
-                printk (KERN_INFO "Error: type is not STEP_C\n");
-                return -EFAULT;
-            }
-            if (si.state > 12) {
-                printk (KERN_INFO "Error: state is bigger than 12\n");
-                return -EFAULT;
-            }
+  if (srmtDebugStatus)
+    printk(KERN_INFO "srmt: core %d C%d exit latency p50 %llu ns p99 %llu ns over %u samples\n",
+           core, state, lat->p50Ns, lat->p99Ns, n);
 
-            // check for all of range cores
-            sum = num_online_cpus();
-            if (sum < MAX_CORES) {
-                i = sum / 32;
-                j = sum % 32;
-                mask = (uint32_t) (1 << j) - 1;
-                if (si.coreMaskArray [i] & ~mask) {
-                    printk (KERN_INFO "Error: CPU cores specified out of range\n");
-                    return -EFAULT;
-                }
+  kvfree(w->benchSamples);
+  w->benchSamples = NULL;
+  return ret;
+}
 
-		i++;
-		for (; i < MAX_CORES / 32; i++) {
-                    if (si.coreMaskArray [i] != 0) {
-                        printk (KERN_INFO "Error: CPU cores specified out of range\n");
-                        return -EFAULT;
-                    }
-		}
-            }
-            else {
-                printk (KERN_INFO "Error: number of CPU cores is more than MAX_CORES=%d\n", MAX_CORES);
-                return -EFAULT;
-            }
-			
-            if (si.time > 15000000) {
-                printk (KERN_INFO "Error: time is bigger than 15000000\n");
-                return -EFAULT;
-            }
+/* Serve one MSR request, either on the core itself or from the MWAIT collection */
+static int msrReadOne (struct msrMsg_t *msg)
+{
+  struct msrMsg_t *ptr;
 
-            // security check ends
-            else if (si.type == STEP_C) {
-                // printk(KERN_INFO "srmt: keep state %c%d on cores 0x%x for %u microsec\n",
-                //        si.type, si.state, si.coreMaskArray[0], si.time);
-                startCState(&si);
-            }
-        }
+  if (srmtDebugStatus)
+    printk(KERN_INFO "msrReq: need core %d msr %08x ", msg->coreId, msg->msrId);
+  if (msg->coreId >= nr_cpu_ids || !cpu_online(msg->coreId))
+    {
+      printk(KERN_ERR "srmt: msrRequest for offline core %d\n", msg->coreId);
+      return -EINVAL;
     }
-    else {
-        printk (KERN_INFO "Error: size of c-state command is not correct.\n");
-        return -ENOSPC;
+  if (coresInMwait[msg->coreId]==false) // we should read independently from MWAIT
+    {
+      if (srmtDebugStatus)
+        printk(KERN_INFO " - read ");
+      // IPI the target core instead of spawning a bound task per read
+      msg->status = false;
+      smp_call_function_single(msg->coreId, msrReadFuncOnCpu, msg, 1);
+      if (srmtDebugStatus)
+        printk(KERN_INFO " val = 0x%llx\n",(long long unsigned int)msg->msrValue);
     }
-    
-    return ret;
+  else  // here just use the data collected by MWAIT
+    {
+      ptr = findMsrPlace(msg->msrId, msg->coreId);
+      if (ptr)
+        *msg = *ptr;
+      else
+        memset(msg, 0, sizeof (struct msrMsg_t));
+      msg->status = true;
+    }
+
+  return 0;
 }
 
 /*! 
 *******************************************************************************
 * 
-*  \brief   Data transfer from kernel to user, carrying cstate instruction
-* 
-*   \param    
-*   \param    
+*  \brief   Data transfer from user to kernel, carrying MSR params
 * 
 *   \return  int,  if positive: amount of data transfered
 * 
 *   \warning  
 * 
 *******************************************************************************/
-ssize_t readCstateCommand (struct file *filp, char __user *buf, size_t count, loff_t *offp ) 
+ssize_t msrRequest (struct file *filp,const char __user *buf, size_t count, loff_t *offp)
 {
-    int temp=0, len=0;
-    char msg[512]; 
-    
-    if (srmtDebugStatus)
-      printk(KERN_INFO "srmt: into readCstateCommand\n");
-    if(count>temp)
-        {
-            count=temp;
-        }
-    temp=temp-count;
-    if (copy_to_user(buf, msg, count))
-        {
-            if(count==0)
-                temp=len;
-            return count;
-        }
-    else
-        return 0;
-}
+    struct msrSession_t *session = (struct msrSession_t *)filp->private_data;
+    struct msrMsg_t msg;
+    size_t done = 0;
+    int ret = 0;
+
+    // one or more requests, all answered into this session's queue
+    if (count == 0 || count % sizeof (struct msrMsg_t))
+      return -ENOSPC;
+
+    mutex_lock(&session->lock);
+    if (session->count + count / sizeof (struct msrMsg_t) > MSR_SESSION_QUEUE)
+      {
+        mutex_unlock(&session->lock);
+        return -ENOSPC;
+      }
+    for (done = 0; done < count; done += sizeof (struct msrMsg_t))
+      {
+        if (copy_from_user(&msg, buf + done, sizeof (msg)))
+          {
+            ret = -EFAULT;
+            break;
+          }
+        ret = msrReadOne(&msg);
+        if (ret)
+          break;
+        session->results[(session->head + session->count) % MSR_SESSION_QUEUE] = msg;
+        session->count++;
+      }
+    mutex_unlock(&session->lock);
+
+    return done ? done : ret;
+}
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   Data transfer from kernel to user, carrying MSR value
+* 
+*   \return  int,  if positive: amount of data transfered
+* 
+*   \warning  
+* 
+*******************************************************************************/
+ssize_t msrResponse (struct file *filp, char __user *buf, size_t count, loff_t *offp ) 
+{
+  struct msrSession_t *session = (struct msrSession_t *)filp->private_data;
+  struct msrMsg_t *msg;
+  size_t done = 0;
+
+  mutex_lock(&session->lock);
+  while (session->count && done + sizeof (struct msrMsg_t) <= count)
+    {
+      msg = &session->results[session->head];
+      if (copy_to_user(buf + done, msg, sizeof (struct msrMsg_t)))
+        {
+          if (srmtDebugStatus)
+            printk(KERN_INFO "msrResp: copy_to_user failed\n");
+          break;
+        }
+      if (srmtDebugStatus)
+        printk(KERN_INFO "msrResp: msr %08x on core %d = 0x%llx\n",
+               msg->msrId, msg->coreId, (long long unsigned int)msg->msrValue);
+      session->head = (session->head + 1) % MSR_SESSION_QUEUE;
+      session->count--;
+      done += sizeof (struct msrMsg_t);
+    }
+  mutex_unlock(&session->lock);
+
+  *offp = 0;
+  return done;
+}
+
+static int msrOpen (struct inode *inode, struct file *filp)
+{
+  struct msrSession_t *session = kzalloc(sizeof (*session), GFP_KERNEL);
+
+  if (session == NULL)
+    return -ENOMEM;
+  mutex_init(&session->lock);
+  filp->private_data = session;
+  return 0;
+}
+
+static int cstateOpen (struct inode *inode, struct file *filp)
+{
+  struct cstateSession_t *session = kzalloc(sizeof (*session), GFP_KERNEL);
+
+  if (session == NULL)
+    return -ENOMEM;
+  mutex_init(&session->lock);
+  filp->private_data = session;
+  return 0;
+}
+
+static int sessionRelease (struct inode *inode, struct file *filp)
+{
+  kfree(filp->private_data);
+  filp->private_data = NULL;
+  return 0;
+}
+
+/* Entries of one batch grouped per core: order[ranges[cpu].first ...] index entries */
+struct msrBatchRange_t
+{
+  uint32_t first;
+  uint32_t count;
+};
+
+struct msrBatchCall_t
+{
+  struct msrBatchEntry_t *entries;
+  uint32_t *order;
+  struct msrBatchRange_t *ranges;
+};
+
+/* IPI handler: read every MSR of the batch that targets the core it runs on */
+static void msrBatchReadOnCpu(void *data)
+{
+  struct msrBatchCall_t *call = (struct msrBatchCall_t *)data;
+  struct msrBatchRange_t *range = &call->ranges[smp_processor_id()];
+  struct msrBatchEntry_t *e;
+  uint32_t hi, lo, i;
+
+  for (i = 0; i < range->count; i++)
+    {
+      e = &call->entries[call->order[range->first + i]];
+      hi = lo = 0;
+      e->status = rdmsr_safe(e->msrId, &lo, &hi) ? MSR_STATUS_FAULT : MSR_STATUS_OK;
+      e->msrValue = (uint64_t) hi << 32 | lo;
+    }
+}
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   Read a list of (core, MSR) pairs with one IPI round: one call per
+*           target core reads all of its MSRs. Cores parked in MWAIT are not
+*           woken up, their values come from the MWAIT collection instead
+* 
+*   \return  long, error code
+* 
+*******************************************************************************/
+static long msrBatchRead(struct msrBatch_t __user *ubatch)
+{
+  struct msrBatch_t batch;
+  struct msrBatchCall_t call = { NULL, NULL, NULL };
+  struct msrBatchEntry_t *e;
+  struct msrMsg_t *cached;
+  cpumask_var_t cpus;
+  uint32_t i, first, core;
+  long ret = 0;
+
+  if (copy_from_user(&batch, ubatch, sizeof (batch)))
+    return -EFAULT;
+  if (batch.count == 0 || batch.count > MAX_MSR_BATCH)
+    return -EINVAL;
+  if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+    return -ENOMEM;
+
+  call.entries = kvmalloc_array(batch.count, sizeof (*call.entries), GFP_KERNEL);
+  call.order = kvmalloc_array(batch.count, sizeof (*call.order), GFP_KERNEL);
+  call.ranges = kcalloc(nr_cpu_ids, sizeof (*call.ranges), GFP_KERNEL);
+  if (call.entries == NULL || call.order == NULL || call.ranges == NULL)
+    {
+      ret = -ENOMEM;
+      goto out;
+    }
+  if (copy_from_user(call.entries, u64_to_user_ptr(batch.entries), batch.count * sizeof (*call.entries)))
+    {
+      ret = -EFAULT;
+      goto out;
+    }
+
+  // serve parked and offline cores right away, count the reads left per core
+  for (i = 0; i < batch.count; i++)
+    {
+      e = &call.entries[i];
+      core = e->coreId;
+      e->msrValue = 0;
+      if (core >= nr_cpu_ids || !cpu_online(core))
+        e->status = MSR_STATUS_OFFLINE;
+      else if (coresInMwait[core])
+        {
+          cached = findMsrPlace(e->msrId, core);
+          e->msrValue = cached ? cached->msrValue : 0;
+          e->status = MSR_STATUS_CACHED;
+        }
+      else
+        {
+          e->status = MSR_STATUS_FAULT;  // until read on the core
+          call.ranges[core].count++;
+          cpumask_set_cpu(core, cpus);
+        }
+    }
+
+  // counting sort of the remaining reads by core
+  first = 0;
+  for_each_cpu(core, cpus)
+    {
+      call.ranges[core].first = first;
+      first += call.ranges[core].count;
+      call.ranges[core].count = 0;
+    }
+  for (i = 0; i < batch.count; i++)
+    {
+      core = call.entries[i].coreId;
+      if (core < nr_cpu_ids && cpumask_test_cpu(core, cpus))
+        call.order[call.ranges[core].first + call.ranges[core].count++] = i;
+    }
+
+  if (srmtDebugStatus)
+    printk(KERN_INFO "srmt: msrBatchRead %u MSRs on %u cores\n", batch.count, cpumask_weight(cpus));
+
+  on_each_cpu_mask(cpus, msrBatchReadOnCpu, &call, true);
+
+  if (copy_to_user(u64_to_user_ptr(batch.entries), call.entries, batch.count * sizeof (*call.entries)))
+    ret = -EFAULT;
+
+ out:
+  kvfree(call.entries);
+  kvfree(call.order);
+  kfree(call.ranges);
+  free_cpumask_var(cpus);
+  return ret;
+}
+
+/* Per-core sampler state, the ring itself lives in the mmap'd buffer */
+struct msrSamplerCpu_t
+{
+  struct hrtimer timer;
+  struct msrSamplerRing_t *ring;
+  uint64_t head;  // kernel copy, user space may scribble over the ring header
+  bool armed;
+};
+
+static DEFINE_PER_CPU(struct msrSamplerCpu_t, samplerCpu);
+static DEFINE_MUTEX(samplerLock);
+static void *samplerBuf;
+static size_t samplerBufSize;
+static atomic_t samplerMaps = ATOMIC_INIT(0);
+static bool samplerActive;
+// kernel copies of the sampling parameters published in the buffer header
+static ktime_t samplerPeriod;
+static uint32_t samplerEntries;
+static uint32_t samplerRecordSize;
+static uint32_t samplerNumMsrs;
+static uint32_t samplerMsrIds[SAMPLER_MAX_MSRS];
+
+static enum hrtimer_restart samplerTick(struct hrtimer *timer)
+{
+  struct msrSamplerCpu_t *sc = container_of(timer, struct msrSamplerCpu_t, timer);
+  struct msrSamplerRing_t *ring = sc->ring;
+  struct msrSamplerRecord_t *rec;
+  uint32_t hi, lo, i;
+
+  hrtimer_forward_now(timer, samplerPeriod);
+
+  if (sc->head - READ_ONCE(ring->tail) >= samplerEntries)
+    {
+      WRITE_ONCE(ring->overflows, ring->overflows + 1);
+      return HRTIMER_RESTART;
+    }
+
+  rec = (struct msrSamplerRecord_t *)((char *)ring + SAMPLER_RING_HEADER_SIZE +
+                                      (sc->head & (samplerEntries - 1)) * samplerRecordSize);
+  rec->tsc = readTsc();
+  rec->timeNs = ktime_get_ns();
+  for (i = 0; i < samplerNumMsrs; i++)
+    {
+      hi = lo = 0;
+      if (rdmsr_safe(samplerMsrIds[i], &lo, &hi))
+        WRITE_ONCE(ring->faults, ring->faults + 1);
+      rec->values[i] = (uint64_t) hi << 32 | lo;
+    }
+
+  // publish the record after its content
+  smp_wmb();
+  sc->head++;
+  WRITE_ONCE(ring->head, sc->head);
+
+  return HRTIMER_RESTART;
+}
+
+/* IPI handler: arm the pinned sampling timer on the core it runs on */
+static void samplerArmOnCpu(void *data)
+{
+  struct msrSamplerCpu_t *sc = this_cpu_ptr(&samplerCpu);
+
+  hrtimer_start(&sc->timer, samplerPeriod, HRTIMER_MODE_REL_PINNED);
+}
+
+/* stop all sampling timers, the buffer stays mapped until the next start */
+static void samplerStop(void)
+{
+  struct msrSamplerCpu_t *sc;
+  int cpu;
+
+  mutex_lock(&samplerLock);
+  for_each_possible_cpu(cpu)
+    {
+      sc = per_cpu_ptr(&samplerCpu, cpu);
+      if (!sc->armed)
+        continue;
+      hrtimer_cancel(&sc->timer);
+      sc->armed = false;
+    }
+  samplerActive = false;
+  mutex_unlock(&samplerLock);
+}
+
+/* core mask of a step or the sampler to a cpumask, every core must be online */
+static int stepMaskToCpus (const uint32_t *mask, uint32_t words, struct cpumask *cpus)
+{
+  uint32_t i;
+
+  cpumask_clear(cpus);
+  for (i = 0; i < words * 32; i++)
+    {
+      if (!(mask[i / 32] & (1UL << i % 32)))
+        continue;
+      if (i >= nr_cpu_ids || !cpu_online(i))
+        return -EINVAL;
+      cpumask_set_cpu(i, cpus);
+    }
+  return 0;
+}
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   Allocate the shared rings and start sampling the configured MSRs
+*           on every selected core, all timers are armed by one IPI round
+* 
+*   \return  long, error code
+* 
+*******************************************************************************/
+static long samplerStart(struct msrSamplerConfig_t __user *ucfg)
+{
+  struct msrSamplerConfig_t cfg;
+  struct msrSamplerHeader_t *hdr;
+  struct msrSamplerCpu_t *sc;
+  cpumask_var_t cpus;
+  uint32_t *mask;
+  uint32_t entries, recordSize, ringSize, numCores, i;
+  int cpu;
+  long ret = 0;
+
+  BUILD_BUG_ON(sizeof (struct msrSamplerRing_t) > SAMPLER_RING_HEADER_SIZE);
+
+  if (copy_from_user(&cfg, ucfg, sizeof (cfg)))
+    return -EFAULT;
+  if (cfg.numMsrs == 0 || cfg.numMsrs > SAMPLER_MAX_MSRS || cfg.periodUs < SAMPLER_MIN_PERIOD_US ||
+      cfg.maskWords == 0 || cfg.maskWords > MAX_CPUMASK_WORDS)
+    return -EINVAL;
+  entries = cfg.ringEntries ? cfg.ringEntries : SAMPLER_DEFAULT_ENTRIES;
+  entries = roundup_pow_of_two(clamp_t(uint32_t, entries, 16, SAMPLER_MAX_ENTRIES));
+
+  mask = memdup_user(u64_to_user_ptr(cfg.coreMask), cfg.maskWords * sizeof (uint32_t));
+  if (IS_ERR(mask))
+    return PTR_ERR(mask);
+  if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+    {
+      kfree(mask);
+      return -ENOMEM;
+    }
+  ret = stepMaskToCpus(mask, cfg.maskWords, cpus);
+  kfree(mask);
+  numCores = cpumask_weight(cpus);
+  if (ret || numCores == 0)
+    {
+      free_cpumask_var(cpus);
+      return -EINVAL;
+    }
+
+  mutex_lock(&samplerLock);
+  if (samplerActive)
+    {
+      ret = -EBUSY;
+      goto out;
+    }
+  if (samplerBuf)
+    {
+      // the previous rings can only go once nobody maps them anymore
+      if (atomic_read(&samplerMaps))
+        {
+          ret = -EBUSY;
+          goto out;
+        }
+      vfree(samplerBuf);
+      samplerBuf = NULL;
+    }
+
+  recordSize = sizeof (struct msrSamplerRecord_t) + cfg.numMsrs * sizeof (uint64_t);
+  ringSize = ALIGN(SAMPLER_RING_HEADER_SIZE + entries * recordSize, 64);
+  samplerBufSize = PAGE_ALIGN(PAGE_SIZE + (size_t)numCores * ringSize);
+  samplerBuf = vmalloc_user(samplerBufSize);
+  if (samplerBuf == NULL)
+    {
+      ret = -ENOMEM;
+      goto out;
+    }
+
+  samplerPeriod = ns_to_ktime((uint64_t)cfg.periodUs * NSEC_PER_USEC);
+  samplerEntries = entries;
+  samplerRecordSize = recordSize;
+  samplerNumMsrs = cfg.numMsrs;
+  memcpy(samplerMsrIds, cfg.msrIds, sizeof (samplerMsrIds));
+
+  hdr = (struct msrSamplerHeader_t *)samplerBuf;
+  hdr->numCores = numCores;
+  hdr->numMsrs = cfg.numMsrs;
+  hdr->ringEntries = entries;
+  hdr->recordSize = recordSize;
+  hdr->periodUs = cfg.periodUs;
+  hdr->ringSize = ringSize;
+  hdr->ringOffset = PAGE_SIZE;
+  memcpy(hdr->msrIds, cfg.msrIds, sizeof (hdr->msrIds));
+
+  i = 0;
+  for_each_cpu(cpu, cpus)
+    {
+      sc = per_cpu_ptr(&samplerCpu, cpu);
+      sc->ring = (struct msrSamplerRing_t *)((char *)samplerBuf + PAGE_SIZE + (size_t)i++ * ringSize);
+      sc->ring->coreId = cpu;
+      sc->head = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+      hrtimer_setup(&sc->timer, samplerTick, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+#else
+      hrtimer_init(&sc->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+      sc->timer.function = samplerTick;
+#endif
+      sc->armed = true;
+    }
+
+  on_each_cpu_mask(cpus, samplerArmOnCpu, NULL, true);
+  samplerActive = true;
+
+  if (srmtDebugStatus)
+    printk(KERN_INFO "srmt: sampler started on %u cores, %u MSRs every %u us\n",
+           numCores, cfg.numMsrs, cfg.periodUs);
+
+  cfg.bufferSize = samplerBufSize;
+  if (copy_to_user(ucfg, &cfg, sizeof (cfg)))
+    ret = -EFAULT;
+
+ out:
+  mutex_unlock(&samplerLock);
+  free_cpumask_var(cpus);
+  return ret;
+}
+
+/* proc_ops carry no owner, the mappings pin the module so rmmod can't free these ops under them */
+static void samplerVmOpen(struct vm_area_struct *vma)
+{
+  __module_get(THIS_MODULE);
+  atomic_inc(&samplerMaps);
+}
+
+static void samplerVmClose(struct vm_area_struct *vma)
+{
+  atomic_dec(&samplerMaps);
+  module_put(THIS_MODULE);
+}
+
+static const struct vm_operations_struct samplerVmOps = {
+  .open = samplerVmOpen,
+  .close = samplerVmClose,
+};
+
+/* map the sampler rings, user space needs write access to advance tail */
+static int msrMmap(struct file *filp, struct vm_area_struct *vma)
+{
+  int ret;
+
+  mutex_lock(&samplerLock);
+  if (samplerBuf == NULL)
+    ret = -ENODEV;
+  else
+    ret = remap_vmalloc_range(vma, samplerBuf, vma->vm_pgoff);
+  if (ret == 0)
+    {
+      vma->vm_ops = &samplerVmOps;
+      samplerVmOpen(vma);
+    }
+  mutex_unlock(&samplerLock);
+
+  return ret;
+}
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   ioctl entry of the MSR proc file
+* 
+*   \return  long, error code
+* 
+*******************************************************************************/
+static long pstateSequence (struct pstateSequence_t __user *useq);
+
+static long msrIoctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  // the proc file is world writable, these reach any MSR on any core
+  if (!capable(CAP_SYS_RAWIO))
+    return -EPERM;
+
+  switch (cmd)
+    {
+      case SRMT_IOCTL_READ_MSR_BATCH:
+        return msrBatchRead((struct msrBatch_t __user *)arg);
+      case SRMT_IOCTL_SAMPLER_START:
+        return samplerStart((struct msrSamplerConfig_t __user *)arg);
+      case SRMT_IOCTL_SAMPLER_STOP:
+        samplerStop();
+        return 0;
+      case SRMT_IOCTL_PSTATE_SEQUENCE:
+        return pstateSequence((struct pstateSequence_t __user *)arg);
+      default:
+        return -ENOTTY;
+    }
+}
+
+int bit_count (uint32_t mask)
+{
+	int sum, i;
+
+	sum = 0;
+	for (i = 0; i < 32; i++) {
+		if (mask & (1 << i))
+			sum++;
+	}
+	return sum;
+}
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   Data transfer from user to kernel, carrying cstate instruction,
+*           either a stateInstructionKernel_t (STEP_C, up to MAX_CORES cores)
+*           or a stateInstructionMask_t with its core mask (STEP_C_CPUMASK)
+* 
+*   \param    
+*   \param    
+* 
+*   \return  int,  if positive: amount of data transfered
+* 
+*   \warning  
+* 
+*******************************************************************************/
+ssize_t writeCstateCommand (struct file *filp,const char __user *buf, size_t count, loff_t *offp)
+{
+    struct cstateSession_t *session = (struct cstateSession_t *)filp->private_data;
+    struct stateInstructionKernel_t si;
+    struct stateInstructionMask_t sm;
+    uint32_t *mask = NULL;
+    cpumask_var_t cpus;
+    uint8_t state;
+    uint32_t time;
+    char type;
+    int status;
+
+    if (count == 0 || copy_from_user(&type, buf, 1))
+        return -EFAULT;
+
+    if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+        return -ENOMEM;
+
+    if (type == STEP_C && count == sizeof (struct stateInstructionKernel_t)) {
+        if (copy_from_user((char *) &si, buf, count)) {
+            printk (KERN_INFO "Error: copy_from_user() failed\n");
+            status = -EFAULT;
+            goto out;
+        }
+        state = si.state;
+        time = si.time;
+        status = stepMaskToCpus(si.coreMaskArray, MAX_CORES / 32, cpus);
+    }
+    else if (type == STEP_C_CPUMASK && count > sizeof (struct stateInstructionMask_t)) {
+        if (copy_from_user((char *) &sm, buf, sizeof (sm))) {
+            printk (KERN_INFO "Error: copy_from_user() failed\n");
+            status = -EFAULT;
+            goto out;
+        }
+        if (sm.maskWords == 0 || sm.maskWords > MAX_CPUMASK_WORDS ||
+            count != sizeof (sm) + sm.maskWords * sizeof (uint32_t)) {
+            printk (KERN_INFO "Error: size of c-state core mask is not correct.\n");
+            status = -ENOSPC;
+            goto out;
+        }
+        mask = memdup_user(buf + sizeof (sm), sm.maskWords * sizeof (uint32_t));
+        if (IS_ERR(mask)) {
+            status = PTR_ERR(mask);
+            mask = NULL;
+            goto out;
+        }
+        state = sm.state;
+        time = sm.time;
+        status = stepMaskToCpus(mask, sm.maskWords, cpus);
+    }
+    else {
+        printk (KERN_INFO "Error: size of c-state command is not correct.\n");
+        status = -ENOSPC;
+        goto out;
+    }
+
+    // security check starts
+    if (status) {
+        printk (KERN_INFO "Error: CPU cores specified out of range\n");
+        status = -EFAULT;
+        goto out;
+    }
+    if (state > 12) {
+        printk (KERN_INFO "Error: state is bigger than 12\n");
+        status = -EFAULT;
+        goto out;
+    }
+    if (time > 15000000) {
+        printk (KERN_INFO "Error: time is bigger than 15000000\n");
+        status = -EFAULT;
+        goto out;
+    }
+    // security check ends
+
+    mutex_lock(&cstateLock);
+    status = startCState(cpus, state, time);
+    mutex_unlock(&cstateLock);
+
+    mutex_lock(&session->lock);
+    session->lastType = type;
+    session->lastState = state;
+    session->lastTime = time;
+    session->lastCores = cpumask_weight(cpus);
+    session->lastStatus = status;
+    session->hasResult = true;
+    mutex_unlock(&session->lock);
+    // a step that could not run is not silently dropped
+    if (status != -EBUSY)
+      status = 0;
+
+out:
+    kfree(mask);
+    free_cpumask_var(cpus);
+    return status ? status : count;
+}
+
+/* Per-core state of the P-state sequencer, written from the core itself */
+struct pstateCpu_t
+{
+  uint64_t origCtl;      // IA32_PERF_CTL before the sequence
+  uint64_t aperf;        // at the start of the dwell
+  uint64_t mperf;
+  uint64_t latency;      // TSC cycles from the write until IA32_PERF_STATUS matched
+  uint64_t khz;          // achieved over the dwell
+  bool settled;
+  bool faulted;
+};
+
+struct pstateCall_t
+{
+  struct pstateCpu_t *cpu;  // nr_cpu_ids entries
+  uint32_t ratio;
+  uint64_t timeoutCycles;
+};
+
+static DEFINE_MUTEX(pstateLock);  // one sequence at a time
+
+static bool pstateRead (uint32_t msr, uint64_t *value)
+{
+  uint32_t lo, hi;
+
+  if (rdmsr_safe(msr, &lo, &hi))
+    return false;
+  *value = (uint64_t) hi << 32 | lo;
+  return true;
+}
+
+static void pstateSaveOnCpu (void *data)
+{
+  struct pstateCall_t *call = (struct pstateCall_t *) data;
+  struct pstateCpu_t *c = &call->cpu[smp_processor_id()];
+
+  c->faulted = !pstateRead(MSR_IA32_PERF_CTL, &c->origCtl);
+}
+
+static void pstateRestoreOnCpu (void *data)
+{
+  struct pstateCall_t *call = (struct pstateCall_t *) data;
+  struct pstateCpu_t *c = &call->cpu[smp_processor_id()];
+
+  wrmsr_safe(MSR_IA32_PERF_CTL, (uint32_t) c->origCtl, (uint32_t) (c->origCtl >> 32));
+}
+
+/* write the step ratio, poll until the core runs at it, then start the dwell */
+static void pstateApplyOnCpu (void *data)
+{
+  struct pstateCall_t *call = (struct pstateCall_t *) data;
+  struct pstateCpu_t *c = &call->cpu[smp_processor_id()];
+  uint64_t ctl = (c->origCtl & ~0xff00ULL) | (uint64_t) call->ratio << 8;
+  uint64_t start, now, status;
+
+  c->settled = false;
+  c->latency = 0;
+  start = rdtsc_ordered();
+  if (wrmsr_safe(MSR_IA32_PERF_CTL, (uint32_t) ctl, (uint32_t) (ctl >> 32)))
+    {
+      c->faulted = true;
+      return;
+    }
+  do
+    {
+      now = rdtsc_ordered();
+      if (!pstateRead(MSR_IA32_PERF_STATUS, &status))
+        {
+          c->faulted = true;
+          return;
+        }
+      if (((status >> 8) & 0xff) == call->ratio)
+        {
+          c->settled = true;
+          c->latency = now - start;
+          break;
+        }
+      cpu_relax();
+    }
+  while (now - start < call->timeoutCycles);
+
+  if (!pstateRead(MSR_IA32_APERF, &c->aperf) || !pstateRead(MSR_IA32_MPERF, &c->mperf))
+    c->faulted = true;
+}
+
+/* end of the dwell: frequency from the APERF/MPERF ratio, MPERF counts at TSC rate */
+static void pstateDwellEndOnCpu (void *data)
+{
+  struct pstateCall_t *call = (struct pstateCall_t *) data;
+  struct pstateCpu_t *c = &call->cpu[smp_processor_id()];
+  uint64_t aperf, mperf;
+
+  c->khz = 0;
+  if (c->faulted || !pstateRead(MSR_IA32_APERF, &aperf) || !pstateRead(MSR_IA32_MPERF, &mperf))
+    {
+      c->faulted = true;
+      return;
+    }
+  if (mperf != c->mperf)
+    c->khz = div64_u64((uint64_t) tsc_khz * (aperf - c->aperf), mperf - c->mperf);
+}
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   Run a list of P-state steps on a set of cores from the kernel,
+*           so the steps start together and their timing doesn't depend on
+*           user space. Each step is applied by IPI on all cores at once, the
+*           cores time their own transition and the dwell is measured with
+*           APERF/MPERF
+* 
+*   \param   useq  user pointer to a struct pstateSequence_t, steps are
+*                  filled with the results
+* 
+*   \return  long, 0 or a negative error code
+* 
+*******************************************************************************/
+static long pstateSequence (struct pstateSequence_t __user *useq)
+{
+  struct pstateSequence_t *seq;
+  struct pstateStep_t *step;
+  struct pstateCpu_t *c;
+  struct pstateCall_t call;
+  uint32_t *mask = NULL;
+  cpumask_var_t cpus;
+  uint64_t sumLatency, sumKhz;
+  uint32_t s, cpu, freqCores;
+  long ret = 0;
+
+  seq = memdup_user(useq, sizeof (*seq));
+  if (IS_ERR(seq))
+    return PTR_ERR(seq);
+  if (seq->maskWords == 0 || seq->maskWords > MAX_CPUMASK_WORDS ||
+      seq->numSteps == 0 || seq->numSteps > PSTATE_MAX_STEPS ||
+      seq->settleTimeoutUs > PSTATE_MAX_SETTLE_US || tsc_khz == 0)
+    {
+      kfree(seq);
+      return -EINVAL;
+    }
+  for (s = 0; s < seq->numSteps; s++)
+    if (seq->steps[s].ratio == 0 || seq->steps[s].ratio > 0xff ||
+        seq->steps[s].dwellUs > PSTATE_MAX_DWELL_US)
+      {
+        kfree(seq);
+        return -EINVAL;
+      }
+
+  mask = memdup_user(u64_to_user_ptr(seq->coreMask), seq->maskWords * sizeof (uint32_t));
+  if (IS_ERR(mask))
+    {
+      kfree(seq);
+      return PTR_ERR(mask);
+    }
+  if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+    {
+      ret = -ENOMEM;
+      goto out_mask;
+    }
+  if (stepMaskToCpus(mask, seq->maskWords, cpus) || cpumask_empty(cpus))
+    {
+      ret = -EINVAL;
+      goto out_cpus;
+    }
+
+  call.cpu = kcalloc(nr_cpu_ids, sizeof (struct pstateCpu_t), GFP_KERNEL);
+  if (call.cpu == NULL)
+    {
+      ret = -ENOMEM;
+      goto out_cpus;
+    }
+  call.timeoutCycles = (uint64_t) tsc_khz * (seq->settleTimeoutUs ? seq->settleTimeoutUs : PSTATE_DEFAULT_SETTLE_US) / 1000;
+
+  mutex_lock(&pstateLock);
+  cpus_read_lock();
+  cpumask_and(cpus, cpus, cpu_online_mask);
+  on_each_cpu_mask(cpus, pstateSaveOnCpu, &call, true);
+
+  for (s = 0; s < seq->numSteps; s++)
+    {
+      step = &seq->steps[s];
+      call.ratio = step->ratio;
+      on_each_cpu_mask(cpus, pstateApplyOnCpu, &call, true);
+      if (step->dwellUs)
+        customSleep(step->dwellUs);
+      on_each_cpu_mask(cpus, pstateDwellEndOnCpu, &call, true);
+
+      step->settledCores = step->faultedCores = 0;
+      step->maxLatencyNs = step->avgLatencyNs = 0;
+      step->minKhz = U64_MAX;
+      step->avgKhz = step->maxKhz = 0;
+      sumLatency = sumKhz = 0;
+      freqCores = 0;
+      for_each_cpu(cpu, cpus)
+        {
+          c = &call.cpu[cpu];
+          if (c->faulted)
+            {
+              step->faultedCores++;
+              continue;
+            }
+          if (c->settled)
+            {
+              step->settledCores++;
+              sumLatency += c->latency;
+              step->maxLatencyNs = max(step->maxLatencyNs, tscToNs(c->latency));
+            }
+          if (c->khz)
+            {
+              freqCores++;
+              sumKhz += c->khz;
+              step->minKhz = min(step->minKhz, c->khz);
+              step->maxKhz = max(step->maxKhz, c->khz);
+            }
+        }
+      if (step->settledCores)
+        step->avgLatencyNs = tscToNs(div_u64(sumLatency, step->settledCores));
+      if (freqCores)
+        step->avgKhz = div_u64(sumKhz, freqCores);
+      else
+        step->minKhz = 0;
+
+      if (srmtDebugStatus)
+        printk(KERN_INFO "srmt: P-state step %u ratio %u settled on %u cores, max %llu ns, avg %llu kHz\n",
+               s, step->ratio, step->settledCores, step->maxLatencyNs, step->avgKhz);
+    }
+
+  on_each_cpu_mask(cpus, pstateRestoreOnCpu, &call, true);
+  cpus_read_unlock();
+  mutex_unlock(&pstateLock);
+
+  if (copy_to_user(useq->steps, seq->steps, seq->numSteps * sizeof (struct pstateStep_t)))
+    ret = -EFAULT;
+
+  kfree(call.cpu);
+out_cpus:
+  free_cpumask_var(cpus);
+out_mask:
+  kfree(mask);
+  kfree(seq);
+  return ret;
+}
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   Data transfer from kernel to user, carrying cstate instruction
+* 
+*   \param    
+*   \param    
+* 
+*   \return  int,  if positive: amount of data transfered
+* 
+*   \warning  
+* 
+*******************************************************************************/
+ssize_t readCstateCommand (struct file *filp, char __user *buf, size_t count, loff_t *offp ) 
+{
+    struct cstateSession_t *session = (struct cstateSession_t *)filp->private_data;
+    char msg[128];
+    int len = 0;
+
+    if (srmtDebugStatus)
+      printk(KERN_INFO "srmt: into readCstateCommand\n");
+
+    // report the outcome of the last command written through this open file
+    mutex_lock(&session->lock);
+    if (session->hasResult)
+        len = snprintf(msg, sizeof (msg), "type=%c state=%u time=%u cores=%u status=%d\n",
+                       session->lastType, session->lastState, session->lastTime, session->lastCores,
+                       session->lastStatus);
+    mutex_unlock(&session->lock);
+
+    return simple_read_from_buffer(buf, count, offp, msg, len);
+}
 
 /*
 **********************************************************************************
@@ -711,27 +1922,299 @@ ssize_t readCstateCommand (struct file *filp, char __user *buf, size_t count, lo
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
 
 struct proc_ops proc_fops = {
+ .proc_open = cstateOpen,
+ .proc_release = sessionRelease,
  .proc_read = readCstateCommand,
  .proc_write = writeCstateCommand,
 };
 
 struct proc_ops msr_fops = {
+ .proc_open = msrOpen,
+ .proc_release = sessionRelease,
  .proc_read = msrResponse,
  .proc_write = msrRequest,
+ .proc_ioctl = msrIoctl,
+ .proc_mmap = msrMmap,
 };
 
 #else
 
 struct file_operations proc_fops = {
  .owner = THIS_MODULE,
+ .open = cstateOpen,
+ .release = sessionRelease,
  .read = readCstateCommand,
  .write = writeCstateCommand,
 };
 
 struct file_operations msr_fops = {
  .owner = THIS_MODULE,
+ .open = msrOpen,
+ .release = sessionRelease,
  .read = msrResponse,
  .write = msrRequest,
+ .unlocked_ioctl = msrIoctl,
+ .mmap = msrMmap,
+};
+
+#endif
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   Start an exit latency benchmark, the request is a text line
+*           "state=<c-state> [cpus=<cpu list>] [samples=<n>] [sleep_us=<us>]",
+*           cores are measured one after the other
+* 
+*   \return  ssize_t, count or a negative error code
+* 
+*******************************************************************************/
+ssize_t writeCstateLatency (struct file *filp, const char __user *buf, size_t count, loff_t *offp)
+{
+  char line[256], *p, *tok, *val;
+  cpumask_var_t cpus;
+  uint32_t samples = CSTATE_BENCH_DEFAULT_SAMPLES;
+  uint32_t sleepUs = CSTATE_BENCH_DEFAULT_SLEEP_US;
+  uint32_t state = ~0U, core;
+  int ret = 0;
+
+  if (cstateWorkers == NULL)
+    return -ENODEV;
+  if (count >= sizeof (line))
+    return -EINVAL;
+  if (copy_from_user(line, buf, count))
+    return -EFAULT;
+  line[count] = '\0';
+
+  if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+    return -ENOMEM;
+  cpumask_copy(cpus, cpu_online_mask);
+
+  p = line;
+  while ((tok = strsep(&p, " \t\n")) != NULL)
+    {
+      if (*tok == '\0')
+        continue;
+      val = strchr(tok, '=');
+      if (val == NULL)
+        {
+          ret = -EINVAL;
+          break;
+        }
+      *val++ = '\0';
+      if (!strcmp(tok, "state"))
+        ret = kstrtou32(val, 0, &state);
+      else if (!strcmp(tok, "cpus"))
+        ret = cpulist_parse(val, cpus);
+      else if (!strcmp(tok, "samples"))
+        ret = kstrtou32(val, 0, &samples);
+      else if (!strcmp(tok, "sleep_us"))
+        ret = kstrtou32(val, 0, &sleepUs);
+      else
+        ret = -EINVAL;
+      if (ret)
+        break;
+    }
+
+  if (!ret && (state > 0xf || cstateBenchIndex(state) < 0 ||
+               samples == 0 || samples > CSTATE_BENCH_MAX_SAMPLES ||
+               sleepUs < CSTATE_BENCH_MIN_SLEEP_US || sleepUs > CSTATE_BENCH_MAX_SLEEP_US))
+    ret = -EINVAL;
+  if (ret)
+    {
+      printk(KERN_INFO "Error: bad latency request, expected state=<0|1|3|6|7> [cpus=<list>] [samples=1..%d] [sleep_us=%d..%d]\n",
+             CSTATE_BENCH_MAX_SAMPLES, CSTATE_BENCH_MIN_SLEEP_US, CSTATE_BENCH_MAX_SLEEP_US);
+      free_cpumask_var(cpus);
+      return ret;
+    }
+
+  mutex_lock(&cstateLock);
+  for_each_cpu_and(core, cpus, cpu_online_mask)
+    {
+      ret = cstateBenchRun(core, state, samples, sleepUs);
+      if (ret)
+        {
+          printk(KERN_ERR "srmt: latency benchmark on core %d failed (%d)\n", core, ret);
+          break;
+        }
+    }
+  mutex_unlock(&cstateLock);
+
+  free_cpumask_var(cpus);
+  return ret ? ret : count;
+}
+
+/* one line per measured (C-state, core), latencies in ns */
+static int showCstateLatency (struct seq_file *m, void *v)
+{
+  struct cstateLatency_t *lat;
+  uint32_t idx, core;
+
+  seq_printf(m, "# tsc_khz %u\n", tsc_khz);
+  seq_puts(m, "# state core samples spurious min_ns p50_ns p90_ns p99_ns max_ns avg_ns\n");
+
+  if (cstateLatency == NULL)
+    return 0;
+
+  mutex_lock(&cstateLock);
+  for (idx=0; idx<CSTATE_BENCH_STATES; idx++)
+    for (core=0; core<nr_cpu_ids; core++)
+      {
+        lat = &cstateLatency[idx * nr_cpu_ids + core];
+        if (lat->samples == 0)
+          continue;
+        seq_printf(m, "C%d %u %u %u %llu %llu %llu %llu %llu %llu\n",
+                   cstateBenchStates[idx], core, lat->samples, lat->spurious,
+                   lat->minNs, lat->p50Ns, lat->p90Ns, lat->p99Ns, lat->maxNs, lat->avgNs);
+      }
+  mutex_unlock(&cstateLock);
+
+  return 0;
+}
+
+static int openCstateLatency (struct inode *inode, struct file *filp)
+{
+  return single_open(filp, showCstateLatency, NULL);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+
+struct proc_ops latency_fops = {
+ .proc_open = openCstateLatency,
+ .proc_release = single_release,
+ .proc_read = seq_read,
+ .proc_lseek = seq_lseek,
+ .proc_write = writeCstateLatency,
+};
+
+#else
+
+struct file_operations latency_fops = {
+ .owner = THIS_MODULE,
+ .open = openCstateLatency,
+ .release = single_release,
+ .read = seq_read,
+ .llseek = seq_lseek,
+ .write = writeCstateLatency,
+};
+
+#endif
+
+/* counter delta as a percentage of the TSC delta, with two decimals */
+static void showPercent (struct seq_file *m, uint64_t delta, uint64_t tsc)
+{
+  uint64_t pct = tsc ? div64_u64(delta * 10000ULL, tsc) : 0;
+
+  seq_printf(m, " %llu.%02llu", div_u64(pct, 100), pct % 100);
+}
+
+/* one residency line: C0 from MPERF, C1 is what the other counters leave of the TSC */
+static void showResidency (struct seq_file *m, uint64_t tsc, uint64_t mperf,
+                           const uint64_t *core, const uint64_t *pkg)
+{
+  uint64_t c1 = tsc - min(tsc, mperf);
+  int i;
+
+  for (i=0; i<RESIDENCY_CORE_STATES; i++)
+    c1 -= min(c1, core[i]);
+
+  seq_printf(m, " %llu", tsc);
+  showPercent(m, mperf, tsc);
+  showPercent(m, c1, tsc);
+  for (i=0; i<RESIDENCY_CORE_STATES; i++)
+    showPercent(m, core[i], tsc);
+  for (i=0; i<RESIDENCY_PKG_STATES; i++)
+    showPercent(m, pkg[i], tsc);
+  seq_putc(m, '\n');
+}
+
+/*! 
+*******************************************************************************
+* 
+*  \brief   Residency breakdown of the last C-state step: per core and
+*           aggregate deltas between the snapshots each worker took when it
+*           entered MWAIT and when the step ended, in percent of TSC
+* 
+*******************************************************************************/
+static int showCstateResidency (struct seq_file *m, void *v)
+{
+  struct cstateWorker_t *w;
+  uint64_t tsc, mperf, core[RESIDENCY_CORE_STATES], pkg[RESIDENCY_PKG_STATES];
+  uint64_t sumTsc = 0, sumMperf = 0, sumCore[RESIDENCY_CORE_STATES] = {0}, sumPkg[RESIDENCY_PKG_STATES] = {0};
+  uint32_t cpu, done = 0;
+  int i;
+
+  mutex_lock(&cstateLock);
+  if (cstateLastStep == 0)
+    {
+      mutex_unlock(&cstateLock);
+      seq_puts(m, "# no C-state step yet\n");
+      return 0;
+    }
+
+  seq_printf(m, "# step %llu state C%u time_us %u\n", cstateLastStep, cstateLastState, cstateLastTime);
+  seq_puts(m, "# core tsc c0 c1 c3 c6 c7 pc2 pc3 pc6 pc7 (percent of tsc)\n");
+
+  for_each_cpu(cpu, &cstateLastCpus)
+    {
+      w = &cstateWorkers[cpu];
+      if (smp_load_acquire(&w->doneGen) < cstateLastStep || w->resGen != cstateLastStep)
+        {
+          seq_printf(m, "%u running\n", cpu);
+          continue;
+        }
+
+      tsc = w->resEnd.tsc - w->resStart.tsc;
+      mperf = w->resEnd.mperf - w->resStart.mperf;
+      for (i=0; i<RESIDENCY_CORE_STATES; i++)
+        core[i] = w->resEnd.core[i] - w->resStart.core[i];
+      for (i=0; i<RESIDENCY_PKG_STATES; i++)
+        pkg[i] = w->resEnd.pkg[i] - w->resStart.pkg[i];
+
+      seq_printf(m, "%u", cpu);
+      showResidency(m, tsc, mperf, core, pkg);
+
+      sumTsc += tsc;
+      sumMperf += mperf;
+      for (i=0; i<RESIDENCY_CORE_STATES; i++)
+        sumCore[i] += core[i];
+      for (i=0; i<RESIDENCY_PKG_STATES; i++)
+        sumPkg[i] += pkg[i];
+      done++;
+    }
+  mutex_unlock(&cstateLock);
+
+  if (done)
+    {
+      seq_puts(m, "all");
+      showResidency(m, sumTsc, sumMperf, sumCore, sumPkg);
+    }
+
+  return 0;
+}
+
+static int openCstateResidency (struct inode *inode, struct file *filp)
+{
+  return single_open(filp, showCstateResidency, NULL);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+
+struct proc_ops residency_fops = {
+ .proc_open = openCstateResidency,
+ .proc_release = single_release,
+ .proc_read = seq_read,
+ .proc_lseek = seq_lseek,
+};
+
+#else
+
+struct file_operations residency_fops = {
+ .owner = THIS_MODULE,
+ .open = openCstateResidency,
+ .release = single_release,
+ .read = seq_read,
+ .llseek = seq_lseek,
 };
 
 #endif
@@ -745,6 +2228,10 @@ static void cleanProcFiles(void)
         remove_proc_entry(MSR_READER_NAME, srmt_dir);
     if (cstate_command_file)
         remove_proc_entry(CSTATE_COMMAND_NAME, srmt_dir);
+    if (cstate_latency_file)
+        remove_proc_entry(CSTATE_LATENCY_NAME, srmt_dir);
+    if (cstate_residency_file)
+        remove_proc_entry(CSTATE_RESIDENCY_NAME, srmt_dir);
 
     remove_proc_entry(MODULE_NAME, NULL);
 }
@@ -767,12 +2254,18 @@ static int __init srmtMwaitmonModuleInit(void)
     int ret;
 
     printk(KERN_INFO "Loading %s module\n", MODULE_NAME);
+
+    // MSR collection and MWAIT flags are sized from the CPUs this system can have
+    ret = allocMsrArray();
+    if (ret)
+      return ret;
      
     /* create a directory */
     srmt_dir = proc_mkdir(MODULE_NAME, NULL);
     if(srmt_dir == NULL)
     {
       printk(KERN_ERR "failed to create %s proc entry\n", MODULE_NAME);
+      freeMsrArray();
       return -ENOMEM;
     }
     
@@ -791,13 +2284,29 @@ static int __init srmtMwaitmonModuleInit(void)
     if(msr_command_file == NULL)
       printk(KERN_ERR "failed to create %s proc entry\n", MSR_READER_NAME);
 
-    if (cstate_command_file == NULL || msr_command_file == NULL)
+    cstate_latency_file = proc_create(CSTATE_LATENCY_NAME, 0644, srmt_dir, &latency_fops);
+    if(cstate_latency_file == NULL)
+      printk(KERN_ERR "failed to create %s proc entry\n", CSTATE_LATENCY_NAME);
+
+    cstate_residency_file = proc_create(CSTATE_RESIDENCY_NAME, 0444, srmt_dir, &residency_fops);
+    if(cstate_residency_file == NULL)
+      printk(KERN_ERR "failed to create %s proc entry\n", CSTATE_RESIDENCY_NAME);
+
+    if (cstate_command_file == NULL || msr_command_file == NULL || cstate_latency_file == NULL ||
+        cstate_residency_file == NULL)
       {
-        remove_proc_entry(MODULE_NAME, NULL);
+        cleanProcFiles();
+        freeMsrArray();
         return -ENOMEM;
       }
 
-    cleanMsrArray();
+    ret = cstatePoolInit();
+    if (ret)
+      {
+        cleanProcFiles();
+        freeMsrArray();
+        return ret;
+      }
 
     // Set up the dev file for ioctl
     ret = 0;	/* everything ok */
@@ -822,6 +2331,12 @@ static void __exit srmtMwaitmonModuleExit(void)
     printk(KERN_INFO "Exit %s module \n", MODULE_NAME);
 
     cleanProcFiles();
+
+    cstatePoolExit();
+
+    samplerStop();
+    vfree(samplerBuf);
+    freeMsrArray();
 }
 
 /* Module specifiers */
@@ -48,6 +48,8 @@
 
 07/18/2014       borisv          Original Draft
 07/06/2017       mbogochow       Added ioctl definitions
+                                 Added batched MSR read ioctl
+                                 Added mmap ring-buffer MSR sampler
 *****************************************************************************/
 #ifndef SRMT_USERKERNEL_DATA_HH_
 #define SRMT_USERKERNEL_DATA_HH_
@@ -55,25 +57,40 @@
 #define MODULE_NAME "srmt_module"   // create /proc/{MODULE_NAME}
 #define CSTATE_COMMAND_NAME   "cstate_command"  // create /proc/{MODULE_NAME}/{CSTATE_COMMAND_NAME}
 #define MSR_READER_NAME   "msr"  // create /proc/{MODULE_NAME}/{MSR_READER_NAME}
+#define CSTATE_LATENCY_NAME   "cstate_latency"  // create /proc/{MODULE_NAME}/{CSTATE_LATENCY_NAME}
+#define CSTATE_RESIDENCY_NAME   "cstate_residency"  // create /proc/{MODULE_NAME}/{CSTATE_RESIDENCY_NAME}
 #define LKM_NAME  "srmtMwaitLKM"
 
 #define PROC_MODULE_NAME_MSR_FILE "/proc/" MODULE_NAME "/" MSR_READER_NAME
 #define PROC_MODULE_NAME_CSTATE_FILE "/proc/" MODULE_NAME "/" CSTATE_COMMAND_NAME
+#define PROC_MODULE_NAME_LATENCY_FILE "/proc/" MODULE_NAME "/" CSTATE_LATENCY_NAME
+#define PROC_MODULE_NAME_RESIDENCY_FILE "/proc/" MODULE_NAME "/" CSTATE_RESIDENCY_NAME  // residency of the last step
 
 #define MAX_COMMAND_LEN 32
 #define MAX_COMMANDS 32
-// TODO is this limitation necessary?  this limit could very plausibly be reached by a system
+// width of the fixed coreMaskArray below, the driver itself sizes everything from the CPUs
+// of the system; larger systems pass their cores with STEP_C_CPUMASK
 #define MAX_CORES 512  // must be a multiple of 32 for correct computation of core masks
+#define MAX_CPUMASK_WORDS 256  // up to 8192 CPUs in a stateInstructionMask_t
 #define MAX_CORES_PP 64  // per package cores, currently 28, so 32 was toо close to set it as a limit
 #define TRIGGER_MEMORY_DEFAULT_SIZE 64
 #define MSR_COLLECTION_SIZE 50   // max of how many MSRs we keep under watch
 
+// C-state exit latency benchmark: write "state=6 cpus=0-3 samples=1000 sleep_us=500"
+// to PROC_MODULE_NAME_LATENCY_FILE, read it back for min/p50/p90/p99/max per core
+#define CSTATE_BENCH_DEFAULT_SAMPLES 1000
+#define CSTATE_BENCH_MAX_SAMPLES 100000
+#define CSTATE_BENCH_DEFAULT_SLEEP_US 500   // time parked before each wake
+#define CSTATE_BENCH_MIN_SLEEP_US 10
+#define CSTATE_BENCH_MAX_SLEEP_US 100000
+
 #define MAX_CS_STATE_NUM 9  // just to have something to compare against CS1, CS3, CS7. Let's  set CS9  as the last one
 #define MAX_TEST_STEP_LEN 80  // in text form
 
 #define STEP_END 0
 #define STEP_P 'p'
 #define STEP_C 'c'
+#define STEP_C_CPUMASK 'm'  // STEP_C carried by a stateInstructionMask_t
 #define STEP_DEBUG 'd'
 
 #define MY_IOC_MAGIC 'I'
@@ -85,6 +102,10 @@
  */
 enum {
     SRMT_READ_MPERF_APERF = 0xe5,
+    SRMT_READ_MSR_BATCH = 0xe6,
+    SRMT_SAMPLER_START = 0xe7,
+    SRMT_SAMPLER_STOP = 0xe8,
+    SRMT_PSTATE_SEQUENCE = 0xe9,
 };
 
 struct msr_aperf_mperf {
@@ -94,6 +115,118 @@ struct msr_aperf_mperf {
 
 #define SRMT_IOCTL_READ_MPERF_APERF _IOR(MY_IOC_MAGIC, SRMT_READ_MPERF_APERF, struct msr_aperf_mperf *)
 
+// Batched MSR reads, issued as ioctl on PROC_MODULE_NAME_MSR_FILE
+#define MAX_MSR_BATCH 4096
+
+#define MSR_STATUS_OK       0  // read on the core
+#define MSR_STATUS_CACHED   1  // core is parked in MWAIT, value collected by the MWAIT loop
+#define MSR_STATUS_FAULT    2  // rdmsr faulted, the MSR does not exist on that core
+#define MSR_STATUS_OFFLINE  3  // core is out of range or offline
+
+struct msrBatchEntry_t {
+    uint32_t coreId;    // in
+    uint32_t msrId;     // in
+    uint64_t msrValue;  // out
+    uint32_t status;    // out: one of MSR_STATUS_*
+    uint32_t reserved;
+};
+
+struct msrBatch_t {
+    uint32_t count;     // number of entries, at most MAX_MSR_BATCH
+    uint32_t reserved;
+    uint64_t entries;   // user pointer to count struct msrBatchEntry_t
+};
+
+#define SRMT_IOCTL_READ_MSR_BATCH _IOWR(MY_IOC_MAGIC, SRMT_READ_MSR_BATCH, struct msrBatch_t)
+
+/* Periodic MSR sampler: every selected core samples the MSRs from a pinned
+   hrtimer into its own ring. After SRMT_IOCTL_SAMPLER_START, mmap bufferSize
+   bytes of PROC_MODULE_NAME_MSR_FILE: msrSamplerHeader_t at offset 0, then
+   numCores rings of ringSize bytes from ringOffset on. Each ring starts with
+   msrSamplerRing_t followed by ringEntries records of recordSize bytes.
+   Record n is at index n & (ringEntries - 1); the driver publishes head, user
+   space advances tail once it consumed records. A full ring drops the new
+   sample and counts it in overflows. Note the timer wakes cores up from MWAIT.
+   The core mask is maskWords 32-bit words at coreMask, bit N for CPU N */
+#define SAMPLER_MAX_MSRS 8
+#define SAMPLER_MIN_PERIOD_US 100
+#define SAMPLER_DEFAULT_ENTRIES 1024
+#define SAMPLER_MAX_ENTRIES 65536
+#define SAMPLER_RING_HEADER_SIZE 128
+
+struct msrSamplerConfig_t {
+    uint64_t coreMask;                      // in: user pointer to maskWords uint32_t, cores to sample
+    uint32_t msrIds[SAMPLER_MAX_MSRS];      // in
+    uint32_t numMsrs;                       // in
+    uint32_t periodUs;                      // in: at least SAMPLER_MIN_PERIOD_US
+    uint32_t ringEntries;                   // in: per core, rounded up to a power of 2, 0 for default
+    uint32_t maskWords;                     // in: at most MAX_CPUMASK_WORDS
+    uint64_t bufferSize;                    // out: bytes to mmap
+};
+
+struct msrSamplerHeader_t {
+    uint32_t numCores;
+    uint32_t numMsrs;
+    uint32_t ringEntries;
+    uint32_t recordSize;
+    uint32_t periodUs;
+    uint32_t ringSize;
+    uint64_t ringOffset;
+    uint32_t msrIds[SAMPLER_MAX_MSRS];
+};
+
+struct msrSamplerRing_t {
+    uint32_t coreId;
+    uint32_t reserved;
+    uint64_t head;       // written by the driver: records produced
+    uint64_t overflows;  // samples dropped on a full ring
+    uint64_t faults;     // MSR reads that faulted, stored as 0
+    uint64_t tail __attribute__((aligned(64)));  // written by user space: records consumed
+};
+
+struct msrSamplerRecord_t {
+    uint64_t tsc;
+    uint64_t timeNs;     // CLOCK_MONOTONIC
+    uint64_t values[];   // numMsrs values, in msrIds order
+};
+
+#define SRMT_IOCTL_SAMPLER_START _IOWR(MY_IOC_MAGIC, SRMT_SAMPLER_START, struct msrSamplerConfig_t)
+#define SRMT_IOCTL_SAMPLER_STOP _IO(MY_IOC_MAGIC, SRMT_SAMPLER_STOP)
+
+/* P-state step sequencer (STEP_P in the kernel): for each step, every
+   selected core writes the ratio into IA32_PERF_CTL at the same time, then
+   polls IA32_PERF_STATUS until it reports that ratio (or settleTimeoutUs
+   passes), stays there dwellUs and reports its APERF/MPERF frequency.
+   The original IA32_PERF_CTL of every core is restored at the end.
+   The core mask is maskWords 32-bit words at coreMask, bit N for CPU N */
+#define PSTATE_MAX_STEPS 64
+#define PSTATE_MAX_DWELL_US 10000000
+#define PSTATE_DEFAULT_SETTLE_US 2000
+#define PSTATE_MAX_SETTLE_US 10000   // cores poll with interrupts off
+
+struct pstateStep_t {
+    uint32_t ratio;           // in: bus ratio, IA32_PERF_CTL bits 15:8
+    uint32_t dwellUs;         // in: time spent at the ratio once settled
+    uint32_t settledCores;    // out: cores whose IA32_PERF_STATUS reached the ratio
+    uint32_t faultedCores;    // out: cores where the MSR access faulted
+    uint64_t maxLatencyNs;    // out: until the last core settled
+    uint64_t avgLatencyNs;    // out: over the settled cores
+    uint64_t minKhz;          // out: achieved frequency over the dwell, APERF/MPERF
+    uint64_t avgKhz;
+    uint64_t maxKhz;
+};
+
+struct pstateSequence_t {
+    uint64_t coreMask;        // in: user pointer to maskWords uint32_t
+    uint32_t maskWords;       // in: at most MAX_CPUMASK_WORDS
+    uint32_t numSteps;        // in: at most PSTATE_MAX_STEPS
+    uint32_t settleTimeoutUs; // in: 0 for PSTATE_DEFAULT_SETTLE_US
+    uint32_t reserved;
+    struct pstateStep_t steps[PSTATE_MAX_STEPS];
+};
+
+#define SRMT_IOCTL_PSTATE_SEQUENCE _IOWR(MY_IOC_MAGIC, SRMT_PSTATE_SEQUENCE, struct pstateSequence_t)
+
 // We can't use cpu_set_t in LKM, so we make two different data types: User and Kernel
 struct stateInstructionKernel_t {
     char type; // one of the step types defined above
@@ -102,6 +235,17 @@ struct stateInstructionKernel_t {
     uint32_t time; // duration in microseconds
 };
 
+// C-state step with a core mask of any size: the header is followed by maskWords
+// 32-bit words, bit N for CPU N, so a cpu_set_t can be appended as is
+struct stateInstructionMask_t {
+    char type;  // STEP_C_CPUMASK
+    uint8_t state;  // numerical value for the state: 3 for C3, 6 for C6, etc
+    uint16_t reserved;
+    uint32_t time;  // duration in microseconds
+    uint32_t maskWords;
+    uint32_t coreMask[];
+};
+
 struct msrMsg_t {
 	uint32_t coreId;
     uint32_t msrId;